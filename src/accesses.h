@@ -0,0 +1,139 @@
+#pragma once
+
+#include <cstdint>
+
+#include "machine.h"
+
+// Decoding of an instruction for the models that run beside the machine (timing.h, heatmap.h): its fields, and the RAM
+// it accesses, from the registers before it runs.
+
+struct DecodedInstruction
+{
+    uint32_t                pc = 0;
+    Opcode                  opcode{};
+    const InstructionInfo*  info = nullptr;     // nullptr for an invalid opcode
+    bool                    flag = false;
+    int                     operand1 = 0;       // without WIDE_OPERAND
+    int                     operand2 = 0;
+    uint32_t                num = 0;            // operand2 as a number, or the wide operand
+    uint32_t                size = 4;           // bytes of the instruction: 8 with a wide operand
+
+    // true for KBD, DSP, DPL and the file device, whose accesses are the devices'.
+    bool io() const { return (opcode>=Opcode::KBD && opcode<=Opcode::FFL); }
+};
+
+template<class Word>
+DecodedInstruction decode_instruction(RAM<Word>& ram, uint32_t pc)
+{
+    DecodedInstruction d;
+    Instruction instruction = ram.fetch_instruction(int(pc));
+    d.pc = pc;
+    d.opcode = Opcode(instruction >> 24);
+    d.info = findInstruction(d.opcode);
+    d.flag = (instruction >> 23) & 1;
+    d.operand1 = (instruction >> 16) & 0x7F;
+    d.operand2 = instruction & 0xffff;
+    d.num = uint32_t(int32_t(short(d.operand2)));
+    if( MachineTraits<Word>::WIDE && (d.operand1 & WIDE_OPERAND) )
+    {
+        d.operand1 &= ~WIDE_OPERAND;
+        d.num = ram.fetch_instruction(int(pc+4));
+        d.size = 8;
+    }
+    return d;
+}
+
+enum class AccessKind : uint8_t
+{
+    FETCH,          // of the instruction
+    READ,           // loads, block instructions, atomics, and the devices of DSP and DPL
+    WRITE,          // stores, block instructions, atomics, and the device of KBD
+    STACK_READ,     // POP, RET
+    STACK_WRITE,    // PSH, CLL
+};
+
+struct MemoryAccess
+{
+    uint32_t    address;
+    uint32_t    size;       // bytes
+    AccessKind  kind;
+};
+
+constexpr int MAX_ACCESSES = 4;
+
+// the RAM accesses of instruction d, from the registers before it runs, into accesses. return their number.
+// a block instruction accesses its whole range, also BCM and BSC, which can stop early. KBD writes the count of the
+// input area; the input it writes is not known before it runs.
+template<class Word>
+int instruction_accesses(const DecodedInstruction& d, RegisterFile<Word>& regs, RAM<Word>& ram, MemoryAccess (&accesses)[MAX_ACCESSES])
+{
+    using UWord = std::make_unsigned_t<Word>;
+    auto value = [&regs](int operand){ Word* r = regs.getRegister(operand); return r ? uint32_t(UWord(*r)) : 0u; };
+    int n = 0;
+    auto add = [&](uint32_t address, uint32_t size, AccessKind kind){ accesses[n++] = {address, size, kind}; };
+    add(d.pc, d.size, AccessKind::FETCH);
+    const uint32_t word = sizeof(Word);
+    Opcode opc = d.opcode;
+    if( !d.info )
+        return n;
+    if( opc==Opcode::CAS )
+    {
+        uint32_t address = value(d.operand1);
+        add(address, 2, AccessKind::READ);
+        add(address, 2, AccessKind::WRITE);
+    }
+    else if( d.info->data.block() )
+    {
+        BlockOperand block = BlockOperand::decode(uint16_t(d.operand2));
+        uint32_t count = value(block.count);
+        if( opc==Opcode::BCP || opc==Opcode::BCM )
+            add(value(block.reg), count, AccessKind::READ);
+        add(value(d.operand1), count, opc==Opcode::BCM || opc==Opcode::BSC ? AccessKind::READ : AccessKind::WRITE);
+    }
+    else if( d.info->data.indexed() )
+    {
+        uint32_t size = opc==Opcode::LDB || opc==Opcode::STB ? 1 : opc==Opcode::LDW || opc==Opcode::STW ? word : 2;
+        uint32_t address = d.num;
+        if( !d.flag )
+        {
+            IndexedOperand index = IndexedOperand::decode(uint16_t(d.operand2));
+            address = uint32_t(UWord(Word(value(index.reg) + index.offset)));
+        }
+        bool store = opc==Opcode::STB || opc==Opcode::STS || opc==Opcode::STW;
+        if( !store )
+            add(address, size, AccessKind::READ);
+        if( store || opc==Opcode::FAD )
+            add(address, size, AccessKind::WRITE);
+    }
+    else
+    {
+        uint32_t sp = value(int(Register::SP));
+        switch( opc )
+        {
+            case Opcode::PSH:
+            case Opcode::CLL:
+                add(sp - word, word, AccessKind::STACK_WRITE);
+                break;
+            case Opcode::POP:
+            case Opcode::RET:
+                add(sp, word, AccessKind::STACK_READ);
+                break;
+            case Opcode::KBD:
+                add(INPUT_START, 2, AccessKind::WRITE);
+                break;
+            case Opcode::DSP:
+                add(DISPLAY_START, 25*80, AccessKind::READ);
+                break;
+            case Opcode::DPL:
+            {
+                uint32_t loc = d.flag ? uint32_t(UWord(Word(d.num))) : value(d.operand2);
+                BYTE* count = ram.access_block(int(loc), 2);
+                add(loc, 2 + (count ? uint32_t(std::max<int>(0, *reinterpret_cast<short*>(count))) : 0), AccessKind::READ);
+                break;
+            }
+            default:
+                break;
+        }
+    }
+    return n;
+}
@@ -0,0 +1,864 @@
+#pragma once
+
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <vector>
+#include <map>
+
+#include "parser.h"
+#include "image.h"
+#include "machine.h"
+
+// The assembler: from a loaded SourceFile to machine code and the data segment, see assemble().
+
+// operand tokens of an instruction line, without the separating commas.
+struct Operands
+{
+    Token   tokens[3];
+    int     count = 0;
+};
+
+// split the tokens after the mnemonic into operands. a comma between two operands is optional.
+// return false for misplaced commas or too many operands.
+inline bool split_operands(const TokenList& tokens, Operands& ops)
+{
+    bool commaAllowed = false;
+    for(size_t i=1; i<tokens.size(); ++i)
+    {
+        Token token = tokens[i];
+        if( token.kind==TokenKind::Comma )
+        {
+            if( !commaAllowed )
+                return false;
+            commaAllowed = false;
+        }
+        else
+        {
+            if( ops.count==3 )
+                return false;
+            ops.tokens[ops.count++] = token;
+            commaAllowed = true;
+        }
+    }
+    return commaAllowed || ops.count==0;    // no trailing comma.
+}
+
+// reg
+inline bool parse_register(const Token& token, int& operand)
+{
+    if( token.kind!=TokenKind::Register )
+        return false;
+    operand = static_cast<int>(*findRegister(token.text));
+    return true;
+}
+
+// num, label or constant, or an expression of them, e.g. `label+2`.
+inline bool parse_value(std::string_view text, const LabelMap& symbols, int& value)
+{
+    return string_to_number(text, value) || eval_expression(text, symbols, value);
+}
+
+// reg, num or label
+inline bool parse_naked_reg_or_num(const Token& token, const LabelMap& symbols, int& flag, int& operand)
+{
+    if( token.kind==TokenKind::Register )
+    {
+        Register reg = *findRegister(token.text);
+        if( reg==Register::PC || reg==Register::SR )
+            return false;   // do not allow literal use of these two registers.
+        flag = 0;
+        operand = static_cast<int>(reg);
+        return true;
+    }
+    
+    // must be num or label
+    flag = 1;
+    if( token.kind==TokenKind::Identifier || token.kind==TokenKind::Number )
+        return parse_value(token.text, symbols, operand);
+    return token.kind==TokenKind::String && string_to_number(token.text, operand);
+}
+
+// the register of a memory operand `reg+imm`, `reg-imm` or `reg+`, and the text after it in rest. nullptr if text does
+// not start with a register followed by + or -.
+inline const Register* find_index_register(std::string_view text, std::string_view& rest)
+{
+    size_t end = 0;
+    while( end<text.size() && is_symbol_char(text[end]) )
+        ++end;
+    const Register* reg = findRegister(text.substr(0, end));
+    rest = trim(text.substr(end));
+    return reg && !rest.empty() && (rest[0]=='+' || rest[0]=='-') ? reg : nullptr;
+}
+
+// [reg], [num] or [label]; with indexed (loads and stores), also [reg+imm], [reg-imm] and [reg+], see IndexedOperand.
+inline bool parse_memory(const Token& token, const LabelMap& symbols, int& flag, int& operand, bool indexed = false)
+{
+    if( token.kind!=TokenKind::Memory || token.text.empty() )
+        return false;
+    if( const Register* reg = findRegister(token.text) )
+    {
+        flag = 0;
+        operand = static_cast<int>(*reg);
+        return true;
+    }
+    if( indexed )
+    {
+        std::string_view rest;
+        if( const Register* reg = find_index_register(token.text, rest) )
+        {
+            if( *reg==Register::PC || *reg==Register::SR )
+                return false;
+            IndexedOperand index{ uint8_t(*reg), false, 0 };
+            int offset = 0;
+            if( rest=="+" )
+                index.postIncrement = true;
+            else if( !eval_expression(rest, symbols, offset) || offset<IndexedOperand::MIN_OFFSET || offset>IndexedOperand::MAX_OFFSET )
+                return false;
+            index.offset = int8_t(offset);
+            flag = 0;
+            operand = index.encode();
+            return true;
+        }
+    }
+    // must be [num] or [label] for memory
+    flag = 1;
+    return parse_value(token.text, symbols, operand);
+}
+
+// machine words of an instruction line checked by check_line(). on the 32-bit machine (wide), an instruction with a
+// num, mem or label operand2 (flag 1) takes 2 words, see WIDE_OPERAND; all other instructions take 1. only the kinds of
+// the tokens are looked at, so labels need not be known yet.
+inline int instruction_words(const CodeLine& line, bool wide)
+{
+    const InstructionData* instr = findInstruction(line.tokens.front().text);
+    Operands ops;
+    if( !wide || !instr || (instr->operandCount!=1 && instr->operandCount!=2) || !split_operands(line.tokens, ops) || ops.count==0 )
+        return 1;
+    const Token& operand = ops.tokens[ops.count-1];
+    std::string_view rest;
+    if( operand.kind==TokenKind::Register )
+        return 1;
+    if( operand.kind==TokenKind::Memory && (findRegister(operand.text) || (instr->indexed() && find_index_register(operand.text, rest))) )
+        return 1;
+    return 2;
+}
+
+// second pass work on an instruction line checked by check_line(): encode the instruction into code. symbols are the
+// labels and the constants. syntax errors are written to out.
+// wideOperand is for the 32-bit machine: an instruction with a num/mem/label operand2 gets WIDE_OPERAND, and its operand2
+// is written to *wideOperand, as the next word.
+inline bool encode_line(const std::string& filePath, const CodeLine& line, const LabelMap& symbols, uint32_t& code, std::ostream& out, uint32_t* wideOperand = nullptr)
+{
+    assert( !line.tokens.empty() );
+    const InstructionData* instr = findInstruction(line.tokens.front().text);
+    if( !instr )
+    {
+        assert(false);  // no such instruction; but this should be caught at first pass.
+        return false;
+    }
+    
+    auto syntaxError = [&](const auto&... message){
+        out << "Syntax error: ";
+        (out << ... << message);
+        out << filePath << ", Line: " << line.number << std::endl
+            <<"    " << line.original << std::endl;
+        return false;
+    };
+
+    Operands ops;
+    bool split = split_operands(line.tokens, ops);
+    int opcode = static_cast<int>(instr->opcode);
+    int flag = 0;
+    int operand1 = 0;
+    int operand2 = 0;
+    if( instr->operandCount == 0 )
+    {
+        // zero operand instruction
+        if( !split || ops.count!=0 )
+            return syntaxError("instruction cannot have operands: ");
+    }
+    else if( instr->operandCount == 1 )
+    {
+        // single operand instruction
+        if( !split || ops.count!=1 )
+            return syntaxError("only one operand allowed for instruction: ");
+        const Token& operand = ops.tokens[0];
+        switch( instr->opcode )
+        {
+            case Opcode::INC:
+            case Opcode::DEC:
+            case Opcode::NOT:
+            case Opcode::POP:
+            case Opcode::BSW:
+            case Opcode::CID:
+            case Opcode::FAV:
+            case Opcode::FFL:
+                // naked reg operand only
+                if( !parse_register(operand, operand2) )
+                    return syntaxError("invalid register: ", operand.text, " : ");
+                break;
+            case Opcode::JPE:
+            case Opcode::JNE:
+            case Opcode::JPL:
+            case Opcode::JLE:
+            case Opcode::JPG:
+            case Opcode::JGE:
+            case Opcode::JPB:
+            case Opcode::JBE:
+            case Opcode::JPA:
+            case Opcode::JAE:
+            case Opcode::JMP:
+            case Opcode::CLL:
+            {
+                // label, [label], or [reg].
+                const Register* reg = operand.kind==TokenKind::Memory ? findRegister(operand.text) : nullptr;
+                if( reg )
+                    operand2 = static_cast<int>(*reg);
+                else
+                {
+                    // must be label.
+                    if( operand.kind==TokenKind::Register || !parse_value(operand.text, symbols, operand2) )
+                        return syntaxError("unrecognized label: ", operand.text, " : ");
+                    flag = 1;
+                }
+                break;
+            }
+            case Opcode::DPL:
+                // [mem], or [reg].
+                if( operand.kind!=TokenKind::Memory || operand.text.empty() )
+                    return syntaxError("memory location needed: ");
+                if( !parse_memory(operand, symbols, flag, operand2) )
+                    return syntaxError("invalid memory location: ", operand.text, " : ");
+                break;
+            case Opcode::PSH:
+                // naked reg, num or label
+                if( !parse_naked_reg_or_num(operand, symbols, flag, operand2) )
+                    return operand.kind==TokenKind::Identifier ? syntaxError("unrecognized label: ", operand.text, " : ")
+                                                               : syntaxError("operand must be register or number: ");
+                break;
+            default:
+                assert(false);  // unhandled single operand instruction
+                return false;
+        }
+    }
+    else if( instr->operandCount == 2 )
+    {
+        // double operand instruction
+        if( !split || ops.count!=2 )
+            return syntaxError("instruction needs 2 operands: ");
+
+        // parse reg1
+        if( !parse_register(ops.tokens[0], operand1) )
+            return syntaxError("invalid register: ", ops.tokens[0].text, " : ");
+
+        // parse operand2
+        const Token& operand = ops.tokens[1];
+        if( instr->operand2Memory )
+        {
+            // operand2: [reg] or [mem]
+            if( operand.kind!=TokenKind::Memory )
+                return syntaxError("invalid operand2, needing `[` and `]`: ", operand.text, " : ");
+            if( !parse_memory(operand, symbols, flag, operand2, instr->indexed()) )
+                return syntaxError("invalid memory location: ", operand.text, " : ");
+        }
+        else // all other 2-operand instruction use operand2 as reg/num.
+        {
+            // operand2: naked reg, num or label.
+            if( ! parse_naked_reg_or_num(operand, symbols, flag, operand2) )
+                return operand.kind==TokenKind::Identifier ? syntaxError("unrecognized label: ", operand.text, " : ")
+                                                           : syntaxError("operand must be register or number: ");
+        }
+    }
+    else if( instr->block() )
+    {
+        // block instruction reg1, reg2, reg3
+        if( !split || ops.count!=3 )
+            return syntaxError("instruction needs 3 operands: ");
+        int regs[3];
+        for(int i=0; i<3; ++i)
+        {
+            if( !parse_register(ops.tokens[i], regs[i]) )
+                return syntaxError("invalid register: ", ops.tokens[i].text, " : ");
+        }
+        operand1 = regs[0];
+        operand2 = BlockOperand{uint8_t(regs[1]), uint8_t(regs[2])}.encode();
+    }
+    else if( instr->operandCount == 3 )
+    {
+        // CMV cc, reg, reg/num
+        if( !split || ops.count!=3 )
+            return syntaxError("instruction needs 3 operands: ");
+        ConditionalOperand conditional{};
+        if( ops.tokens[0].kind!=TokenKind::Identifier || !findCondition(ops.tokens[0].text, conditional.condition) )
+            return syntaxError("invalid condition: ", ops.tokens[0].text, " : ");
+        if( !parse_register(ops.tokens[1], operand1) )
+            return syntaxError("invalid register: ", ops.tokens[1].text, " : ");
+        int value = 0;
+        const Token& operand = ops.tokens[2];
+        if( ! parse_naked_reg_or_num(operand, symbols, flag, value) )
+            return operand.kind==TokenKind::Identifier ? syntaxError("unrecognized label: ", operand.text, " : ")
+                                                       : syntaxError("operand must be register or number: ");
+        value = int16_t(value);     // 0xffff is -1, as for other instructions.
+        if( flag && (value<ConditionalOperand::MIN_IMMEDIATE || value>ConditionalOperand::MAX_IMMEDIATE) )
+            return syntaxError("number out of range ", ConditionalOperand::MIN_IMMEDIATE, "..", ConditionalOperand::MAX_IMMEDIATE, ": ", operand.text, " : ");
+        conditional.value = int16_t(value);
+        operand2 = conditional.encode();
+    }
+    else
+    {
+        assert(false);  // should not have instructions with other operand count
+    }
+
+    if( wideOperand && flag && (instr->operandCount==1 || instr->operandCount==2) )
+    {
+        *wideOperand = uint32_t(operand2);
+        operand1 |= WIDE_OPERAND;
+        operand2 = 0;
+    }
+    code = assemble_machine_code(opcode, flag, operand1, operand2);
+    return true;
+}
+
+// work on a data directive line checked by check_line(): append its bytes to data, whose size is the offset of the
+// line in the data segment. values are resolved with symbols; when only the size of the line is wanted (!final), symbols
+// may lack the labels, and values with unknown labels encode as 0. counts of DS and ALIGN must always resolve.
+// wide: the data segment of the 32-bit machine, see DATA_START_32.
+// return false with a short description in error if the line is invalid.
+inline bool encode_data(const CodeLine& line, const LabelMap& symbols, bool final, std::string& data, std::string& error, bool wide = false)
+{
+    DataDirective directive;
+    if( line.tokens.empty() || !find_data_directive(line.tokens.front().text, directive) )
+    {
+        error = "not a data directive";
+        return false;
+    }
+    
+    // the operands, separated by optional commas like instruction operands.
+    std::vector<Token> items;
+    bool commaAllowed = false;
+    for(size_t i=1; i<line.tokens.size(); ++i)
+    {
+        Token token = line.tokens[i];
+        if( token.kind==TokenKind::Comma )
+        {
+            if( !commaAllowed )
+            {
+                error = "misplaced comma";
+                return false;
+            }
+            commaAllowed = false;
+        }
+        else
+        {
+            items.push_back(token);
+            commaAllowed = true;
+        }
+    }
+    if( !commaAllowed && !items.empty() )
+    {
+        error = "misplaced comma";
+        return false;
+    }
+    
+    auto invalid = [&error](const char* what, std::string_view text){
+        error = std::string(what) + ": `" + std::string(text) + "` ";
+        return false;
+    };
+    auto number = [&](const Token& token, int low, int high, bool allowUnknown, int& value){
+        if( token.kind!=TokenKind::Number && token.kind!=TokenKind::Identifier )
+            return invalid("number needed", token.text);
+        if( !string_to_number(token.text, value) && !eval_expression(token.text, symbols, value, allowUnknown) )
+            return invalid(token.kind==TokenKind::Number ? "number needed" : "unrecognized label", token.text);
+        if( (value<low || value>high) && !allowUnknown )
+            return invalid("value out of range", token.text);
+        return true;
+    };
+    
+    switch( directive )
+    {
+        case DataDirective::DB:
+        case DataDirective::DW:
+        case DataDirective::DD:
+        {
+            if( items.empty() )
+            {
+                error = "data needed";
+                return false;
+            }
+            for(const Token& item : items)
+            {
+                int value = 0;
+                if( directive==DataDirective::DB && item.kind==TokenKind::String )
+                {
+                    data.append(item.text.substr(1, item.text.size()-2));   // the chars, without a length.
+                    continue;
+                }
+                if( directive==DataDirective::DD )
+                {
+                    if( !number(item, INT32_MIN, INT32_MAX, !final, value) )
+                        return false;
+                    for(int i=0; i<4; ++i)
+                        data.push_back(char(value >> (8*i)));   // little-endian
+                    continue;
+                }
+                if( directive==DataDirective::DB ? !number(item, -128, 255, !final, value) : !number(item, -32768, 65535, !final, value) )
+                    return false;
+                data.push_back(char(value));
+                if( directive==DataDirective::DW )
+                    data.push_back(char(value >> 8));     // little-endian, like xsim's shorts.
+            }
+            return true;
+        }
+        case DataDirective::DX:
+        {
+            if( items.size()!=1 || items[0].kind!=TokenKind::String )
+            {
+                error = "one string needed";
+                return false;
+            }
+            std::string_view text = items[0].text.substr(1, items[0].text.size()-2);
+            data.push_back(char(text.size()));
+            data.push_back(char(text.size() >> 8));
+            data.append(text);
+            return true;
+        }
+        case DataDirective::DS:
+        case DataDirective::ALIGN:
+        {
+            int count = 0;
+            if( items.size()!=1 )
+            {
+                error = "one count needed";
+                return false;
+            }
+            int dataStart = wide ? DATA_START_32 : DATA_START;
+            if( !number(items[0], directive==DataDirective::DS ? 0 : 1, wide ? MachineTraits<int32_t>::RAM_SIZE : 0xffff, false, count) )
+                return false;
+            if( directive==DataDirective::ALIGN )
+                count = (count - (dataStart + int(data.size())) % count) % count;
+            data.append(size_t(count), '\0');
+            return true;
+        }
+    }
+    return false;
+}
+
+// append an address to a listing or map: 4 hex digits, or 8 for the 32-bit machine (wide).
+inline void append_address(std::string& out, int address, bool wide)
+{
+    if( wide )
+        append_hex(out, uint32_t(address));
+    else
+        append_hex(out, uint16_t(address));
+}
+
+// append a listing line of a data line to listing: address, up to 8 bytes of data, source file:line, source text.
+inline void append_data_listing(std::string& listing, int address, std::string_view bytes, const std::string& filePath, const CodeLine& line, bool wide)
+{
+    append_address(listing, address, wide);
+    listing += "  ";
+    for(size_t i=0; i<8; ++i)
+    {
+        if( i<bytes.size() )
+            append_hex(listing, uint8_t(bytes[i]));
+        else
+            listing += "  ";
+    }
+    listing += bytes.size()>8 ? "..  " : "    ";
+    listing += filePath;
+    listing += ':';
+    char number[16];
+    listing.append(number, std::to_chars(number, number+sizeof(number), line.number).ptr);
+    listing += "  ";
+    listing += trim(line.original);
+    listing += '\n';
+}
+
+// append a listing line of an instruction to listing: address, machine word(s), source file:line, disassembly.
+// wideOperand is the word after an instruction with WIDE_OPERAND, on the 32-bit machine (wide).
+inline void append_listing(std::string& listing, int address, uint32_t code, const std::string& filePath, int lineNumber, const LabelIndex& label_index,
+                    bool wide = false, const uint32_t* wideOperand = nullptr)
+{
+    append_address(listing, address, wide);
+    listing += "  ";
+    append_hex(listing, code);
+    if( wideOperand )
+    {
+        listing += ' ';
+        append_hex(listing, *wideOperand);
+    }
+    else if( wide )
+        listing += "         ";
+    listing += "  ";
+    listing += filePath;
+    listing += ':';
+    char number[16];
+    listing.append(number, std::to_chars(number, number+sizeof(number), lineNumber).ptr);
+    listing += "  ";
+    if( !append_disassembly(listing, code, label_index, wideOperand ? *wideOperand : 0) )
+        listing += "!! Invalid machine code";
+    listing += '\n';
+}
+
+// append a line of the debug line table: the address of an instruction, and its source line and file.
+//   1000 12 xlib/find_max.xasm
+inline void append_line_table(std::string& table, int address, const std::string& filePath, int lineNumber, bool wide)
+{
+    append_address(table, address, wide);
+    table += ' ';
+    table += std::to_string(lineNumber);
+    table += ' ';
+    table += filePath;
+    table += '\n';
+}
+
+// a non-#include line of the source tree, in assembling order.
+struct LineRef
+{
+    uint32_t            file;       // index into SourceFile::files
+    uint32_t            line;       // index into SourceFile::lines
+    int                 site;       // innermost #include line containing this line (index into IncludeSite list), or -1.
+};
+
+// an #include line; used to report the include chain of an error like for_each_line() does.
+struct IncludeSite
+{
+    uint32_t            file;
+    uint32_t            line;
+    int                 level;
+    int                 parent;
+};
+
+inline void flatten_lines(const SourceFile& source, uint32_t file, int level, int site, std::vector<LineRef>& lines, std::vector<IncludeSite>& sites)
+{
+    const SourceFile::File& f = source.files[file];
+    for(uint32_t i=f.firstLine; i<f.firstLine+f.lineCount; ++i)
+    {
+        int32_t inclusion = source.lines[i].inclusion;
+        if( inclusion<0 )
+            lines.push_back({file, i, site});
+        else
+        {
+            sites.push_back({file, i, level, site});
+            flatten_lines(source, uint32_t(inclusion), level+1, int(sites.size()-1), lines, sites);
+        }
+    }
+}
+
+inline void report_include_chain(std::ostream& log, const SourceFile& source, const std::vector<IncludeSite>& sites, int site)
+{
+    for(; site>=0; site = sites[site].parent)
+    {
+        const IncludeSite& s = sites[site];
+        CodeLine line = source.code_line(s.file, s.line);
+        log << "["<<s.level<<"] " << "At: " << source.files[s.file].filePath << ", Line: " << line.number << std::endl
+            <<"    " << line.original << std::endl;
+    }
+}
+
+struct AssembleOptions
+{
+    unsigned        threads = 1;
+    bool            verbose = false;    // print progress and the label table; otherwise only errors and summary counts.
+    std::string     listingPath;        // listing file; "-" is the log, empty is none.
+    std::string     mapPath;            // symbol map file; "-" is the log, empty is none.
+    std::string     linesPath;          // debug line table, see append_line_table(); "-" is the log, empty is none.
+    std::ostream*   log = &std::cout;   // errors, progress and summary counts
+    bool            summary = true;     // print summary counts
+    int             bits = 16;          // of the machine: 16, or 32 for wide operands and the 32-bit layout.
+};
+
+// write text to path, or to log if path is "-"; an error goes to log.
+inline bool write_text_file(const std::string& path, const std::string& text, std::ostream& log)
+{
+    if( path=="-" )
+    {
+        log << text << std::flush;
+        return true;
+    }
+    std::ofstream s(path, std::ios::binary);
+    if( !s.is_open() || !s.write(text.data(), text.size()) )
+    {
+        log << "Failed to open for write: " << path << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// the symbol map: one `address  label` line per label, by address.
+inline std::string make_symbol_map(const LabelMap& label_map, bool wide = false)
+{
+    std::vector<std::pair<int, std::string_view>> symbols;
+    symbols.reserve(label_map.size());
+    for(auto& entry : label_map)
+        symbols.push_back({entry.second, entry.first});
+    std::stable_sort(symbols.begin(), symbols.end(), [](auto& a, auto& b){ return a.first < b.first; });
+    std::string map;
+    for(auto& [address, label] : symbols)
+    {
+        append_address(map, address, wide);
+        map += "  ";
+        map += label;
+        map += '\n';
+    }
+    return map;
+}
+
+// assemble the source tree into instructions and the data segment.
+// the lines are split into chunks, and both passes work on chunks concurrently on `threads` threads: the first pass
+// finds each chunk's labels, data lines and instruction count, labels get their addresses from a prefix sum of the
+// counts, then the second pass encodes each chunk into its own range of instructions. results, listings and errors are
+// merged in source order, so the output does not depend on the number of threads.
+// data lines are laid out in source order while the labels are merged. a label labels the line it is on, or the next
+// instruction or data line; ALIGN passes its labels on to the line after it.
+// instructions are the machine words; for the 32-bit machine, an instruction can take 2 words, see instruction_words().
+inline bool assemble(const SourceFile& source, std::vector<int>& instructions, std::string& data, const AssembleOptions& options = {})
+{
+    std::ostream& log = *options.log;
+    const bool wide = options.bits==32;
+    const int dataStart = wide ? DATA_START_32 : DATA_START;
+    // the 32-bit data segment ends below the stacks of cores 1.., at the end of RAM
+    using Wide = MachineTraits<int32_t>;
+    const int dataEnd = wide ? Wide::core_stack(Wide::MAX_CORES-1) - Wide::CORE_STACK_SIZE : MACHINE_CODE_START;
+    std::vector<LineRef> lines;
+    std::vector<IncludeSite> sites;
+    if( !source.files.empty() )
+        flatten_lines(source, 0, 0, -1, lines, sites);
+
+    // a label or data line, with the index of the next instruction within the chunk.
+    struct Mark
+    {
+        size_t                  line;
+        int                     index;
+        bool                    label;
+        bool                    data;
+    };
+    struct Chunk
+    {
+        size_t                  begin = 0, end = 0; // [begin, end) of lines
+        int                     base = 0;           // global index of the first instruction word
+        int                     count = 0;          // instruction words
+        int                     instructions = 0;
+        std::vector<Mark>       marks;
+        size_t                  errorLine = SIZE_MAX;
+        std::string             error;              // first pass error, or second pass error messages
+        std::string             listing;            // second pass listing
+        std::string             lineTable;          // second pass debug line table
+    };
+    const size_t CHUNK_LINES = 4096;
+    std::vector<Chunk> chunks;
+    for(size_t begin=0; begin<lines.size(); begin += CHUNK_LINES)
+    {
+        chunks.emplace_back();
+        chunks.back().begin = begin;
+        chunks.back().end = std::min(begin+CHUNK_LINES, lines.size());
+    }
+
+    auto lineError = [&](size_t i, const std::string& message){
+        const LineRef& ref = lines[i];
+        CodeLine line = source.code_line(ref.file, ref.line);
+        log << "Syntax error: " << message << ": " << source.files[ref.file].filePath << ", Line: " << line.number << std::endl
+            <<"    " << line.original << std::endl;
+        report_include_chain(log, source, sites, ref.site);
+        return false;
+    };
+
+    // first pass: handle labels
+    if( options.verbose )
+        log << "Processing labels and comments..." << std::endl;
+    parallel_for(chunks.size(), options.threads, [&](size_t c){
+        Chunk& chunk = chunks[c];
+        for(size_t i=chunk.begin; i<chunk.end; ++i)
+        {
+            CodeLine line = source.code_line(lines[i].file, lines[i].line);
+            LineKind kind;
+            if( !check_line(line, kind, chunk.error) )
+            {
+                chunk.errorLine = i;
+                return;
+            }
+            if( line.labeled || kind==LineKind::Data )
+                chunk.marks.push_back({i, chunk.count, line.labeled, kind==LineKind::Data});
+            if( kind==LineKind::Instruction )
+            {
+                // valid instruction, checked by check_line().
+                chunk.count += instruction_words(line, wide);
+                ++ chunk.instructions;
+            }
+        }
+    });
+
+    LabelMap label_map;       // the label instruction_number map
+    LabelMap symbols = source.constants;    // the labels and the constants, for values
+    auto addLabel = [&](size_t i, int address){
+        const LineRef& ref = lines[i];
+        std::string_view label = source.code_line(ref.file, ref.line).label;
+        if( !symbols.emplace(label, address).second )
+            return lineError(i, "duplicate label: `" + std::string(label) + "` ");
+        label_map.emplace(label, address);
+        return true;
+    };
+    std::vector<std::pair<size_t, int>> pending;    // labels of the next instruction or data line: line index, instruction index
+    std::vector<std::pair<size_t, int>> dataLines;  // line index, offset in the data segment
+    std::string layout;                             // the data segment without label values, for the offsets
+    int global_instruction_line_number = 0;
+    for(Chunk& chunk : chunks)
+    {
+        chunk.base = global_instruction_line_number;
+        for(const Mark& mark : chunk.marks)
+        {
+            // pending labels followed by an instruction label the instruction.
+            int index = chunk.base + mark.index;
+            size_t labeled = 0;
+            for(; labeled<pending.size() && pending[labeled].second<index; ++labeled)
+            {
+                if( !addLabel(pending[labeled].first, MACHINE_CODE_START + pending[labeled].second * 4) )
+                    return false;
+            }
+            pending.erase(pending.begin(), pending.begin()+labeled);
+            if( mark.label )
+                pending.push_back({mark.line, index});
+            if( !mark.data )
+                continue;
+            
+            CodeLine line = source.code_line(lines[mark.line].file, lines[mark.line].line);
+            DataDirective directive;
+            if( line.tokens.empty() || !find_data_directive(line.tokens.front().text, directive) )
+                return lineError(mark.line, "not a data directive");
+            if( directive!=DataDirective::ALIGN )
+            {
+                for(auto& [i, unused] : pending)
+                {
+                    if( !addLabel(i, dataStart + int(layout.size())) )
+                        return false;
+                }
+                pending.clear();
+            }
+            dataLines.push_back({mark.line, int(layout.size())});
+            std::string error;
+            if( !encode_data(line, source.constants, false, layout, error, wide) )
+                return lineError(mark.line, error);
+            if( dataStart + layout.size() > size_t(dataEnd) )
+                return lineError(mark.line, wide ? "data segment overflows into the core stacks at 0x" + integer_as_hex(uint32_t(dataEnd)) + " "
+                                                 : "data segment overflows into code at 0x" + integer_as_hex(uint16_t(MACHINE_CODE_START)) + " ");
+        }
+        if( chunk.errorLine != SIZE_MAX )
+            return lineError(chunk.errorLine, chunk.error);
+        global_instruction_line_number += chunk.count;
+    }
+    for(auto& [i, index] : pending)
+    {
+        if( !addLabel(i, MACHINE_CODE_START + index * 4) )
+            return false;
+    }
+    
+    if( options.summary )
+        log << "Labels processed: " << label_map.size() << std::endl;
+    if( options.verbose && !label_map.empty() )
+    {
+        log << "---------------------------------------------" << std::endl;
+        for (auto& entry : label_map)
+            log << integer_as_hex(entry.second) << " = " << entry.first << ":" << std::endl;
+        log << "---------------------------------------------" << std::endl;
+    }
+
+    // data lines, now that all labels are known.
+    bool listing = !options.listingPath.empty();
+    bool lineTable = !options.linesPath.empty();
+    std::string listingText;
+    data.clear();
+    data.reserve(layout.size());
+    for(auto& [i, offset] : dataLines)
+    {
+        CodeLine line = source.code_line(lines[i].file, lines[i].line);
+        std::string error;
+        if( !encode_data(line, symbols, true, data, error, wide) )
+            return lineError(i, error);
+        assert( data.size()<=layout.size() );
+        if( listing )
+            append_data_listing(listingText, dataStart + offset, std::string_view(data).substr(offset), source.files[lines[i].file].filePath, line, wide);
+    }
+
+    // second pass: handle instructios in line tokens.
+    if( options.verbose )
+        log << "Assembling instructions..." << std::endl;
+    LabelIndex label_index(label_map, MACHINE_CODE_START);
+    instructions.assign(global_instruction_line_number, 0);
+    parallel_for(chunks.size(), options.threads, [&](size_t c){
+        Chunk& chunk = chunks[c];
+        if( listing )
+            chunk.listing.reserve(chunk.count * 64);
+        std::ostringstream error;
+        int index = chunk.base;
+        for(size_t i=chunk.begin; i<chunk.end; ++i)
+        {
+            CodeLine line = source.code_line(lines[i].file, lines[i].line);
+            if( line.tokens.empty() || line.tokens.front().kind!=TokenKind::Mnemonic )
+                continue; // skip to next line
+            uint32_t code = 0;
+            uint32_t wideOperand = 0;
+            const std::string& filePath = source.files[lines[i].file].filePath;
+            if( !encode_line(filePath, line, symbols, code, error, wide ? &wideOperand : nullptr) )
+            {
+                chunk.error = error.str();
+                chunk.errorLine = i;
+                break;
+            }
+            bool twoWords = (code >> 16) & WIDE_OPERAND;
+            assert( twoWords == (instruction_words(line, wide)==2) );
+            if( listing )
+                append_listing(chunk.listing, MACHINE_CODE_START + index*4, code, filePath, line.number, label_index, wide, twoWords ? &wideOperand : nullptr);
+            if( lineTable )
+                append_line_table(chunk.lineTable, MACHINE_CODE_START + index*4, filePath, line.number, wide);
+            instructions[index++] = code;
+            if( twoWords )
+                instructions[index++] = wideOperand;
+        }
+    });
+    std::string lineTableText;
+    for(const Chunk& chunk : chunks)
+    {
+        if( chunk.errorLine != SIZE_MAX )
+        {
+            log << chunk.error;
+            report_include_chain(log, source, sites, lines[chunk.errorLine].site);
+            return false;
+        }
+        listingText += chunk.listing;
+        lineTableText += chunk.lineTable;
+    }
+    if( options.summary && !data.empty() )
+    {
+        std::string address;
+        append_address(address, dataStart, wide);
+        log << "Data assembled: " << data.size() << " bytes at 0x" << address << std::endl;
+    }
+    int instructionCount = 0;
+    for(const Chunk& chunk : chunks)
+        instructionCount += chunk.instructions;
+    if( options.summary )
+        log << "Instructions assembled: " << instructionCount << ",  size = "<< instructions.size()*sizeof(int) <<" bytes" << std::endl;
+
+    if( listing && !write_text_file(options.listingPath, listingText, log) )
+        return false;
+    if( !options.mapPath.empty() && !write_text_file(options.mapPath, make_symbol_map(label_map, wide), log) )
+        return false;
+    if( lineTable && !write_text_file(options.linesPath, lineTableText, log) )
+        return false;
+    return true;
+}
+
+// the program file of instructions and data, as written by xasm: raw machine code if there is no data on the 16-bit
+// machine; otherwise an image, see image.h.
+inline std::string make_program(const std::vector<int>& instructions, const std::string& data, int bits = 16)
+{
+    std::string code(reinterpret_cast<const char*>(instructions.data()), instructions.size()*sizeof(int));
+    if( data.empty() && bits==16 )
+        return code;
+    std::vector<ImageSegment> segments;
+    if( !data.empty() )
+        segments.push_back({uint32_t(bits==32 ? DATA_START_32 : DATA_START), data});
+    segments.push_back({uint32_t(MACHINE_CODE_START), std::move(code)});
+    return make_image(segments, bits);
+}
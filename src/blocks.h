@@ -0,0 +1,115 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "ref.h"
+
+// The basic blocks of the machine code of a program, found before it runs, for the counters of Machine and for
+// BlockCoverage: a block starts at the code start, at the label of a jump or call, and after a jump, call, RET or HLT,
+// and ends before the next start. A block runs from the instruction it is entered at to its last one, so the entries
+// of the blocks count every instruction: the runs of an instruction are the entries of its block up to it.
+// A jump to a register can enter a block in its middle; that entry is at the instruction it enters.
+// The blocks are of the code as it is loaded: a program that changes its code runs other instructions than they say.
+struct CodeBlocks
+{
+    // an instruction word of the code
+    struct Slot
+    {
+        bool        instruction = false;    // false for the wide operand word of an instruction
+        bool        leader = false;         // first instruction of a block
+        bool        conditional = false;    // a conditional jump
+        Opcode      opcode{};
+        uint8_t     size = 4;               // bytes of the instruction: 8 with a wide operand
+        uint32_t    remaining = 0;          // instructions from this one to the end of its block
+        uint32_t    last = 0;               // slot of the last instruction of its block
+        uint32_t    fallThrough = 0;        // address after the instruction
+    };
+
+    uint32_t            start = 0;          // address of slot 0
+    std::vector<Slot>   slots;
+
+    CodeBlocks() = default;
+
+    // the blocks of the size bytes of code, loaded at start. wide: the code is of the 32-bit machine, whose
+    // instructions can have a wide operand, see WIDE_OPERAND.
+    CodeBlocks(const char* code, uint32_t start, size_t size, bool wide) : start(start), slots(size/4)
+    {
+        auto word = [&](uint32_t slot){
+            uint32_t instruction = 0;
+            std::memcpy(&instruction, code + size_t(slot)*4, 4);
+            return instruction;
+        };
+        std::vector<bool> leader(slots.size() + 1, false);
+        std::vector<uint32_t> order;        // slots of the instructions
+        std::vector<bool> transfer;         // of each instruction in order: it jumps, calls, returns or halts
+        leader[0] = true;
+        for(uint32_t slot=0; slot<slots.size(); )
+        {
+            uint32_t instruction = word(slot);
+            Slot& s = slots[slot];
+            s.instruction = true;
+            s.opcode = Opcode(instruction >> 24);
+            bool flag = (instruction >> 23) & 1;
+            // a label operand: 16-bit, or sign-extended on the 32-bit machine, as the machine reads it
+            uint32_t target = wide ? uint32_t(int32_t(int16_t(instruction))) : uint16_t(instruction);
+            if( wide && ((instruction >> 16) & WIDE_OPERAND) )
+            {
+                s.size = 8;
+                target = slot+1<slots.size() ? word(slot+1) : 0;
+            }
+            Condition condition;
+            s.conditional = jump_condition(s.opcode, condition);
+            s.fallThrough = start + slot*4 + s.size;
+            bool jump = s.conditional || s.opcode==Opcode::JMP || s.opcode==Opcode::CLL;
+            if( jump && flag && target>=start && target<start + slots.size()*4 && (target-start)%4==0 )
+                leader[(target-start)/4] = true;
+            order.push_back(slot);
+            transfer.push_back(jump || s.opcode==Opcode::RET || s.opcode==Opcode::HLT);
+            slot += s.size/4;
+            if( transfer.back() )
+                leader[std::min<size_t>(slot, slots.size())] = true;
+        }
+        // from the last instruction back: the instructions to the end of its block, and the last one of it
+        uint32_t remaining = 0;
+        uint32_t last = 0;
+        for(size_t k=order.size(); k-- > 0; )
+        {
+            Slot& s = slots[order[k]];
+            if( transfer[k] || k+1==order.size() || leader[order[k+1]] )
+                remaining = 0, last = order[k];
+            s.remaining = ++remaining;
+            s.last = last;
+            s.leader = leader[order[k]];
+        }
+    }
+
+    // the slot of the instruction at address; -1 if there is none there.
+    int64_t slot(uint32_t address) const
+    {
+        uint32_t slot = (address - start)/4;
+        if( address<start || (address-start)%4 || slot>=slots.size() || !slots[slot].instruction )
+            return -1;
+        return slot;
+    }
+
+    // runs of each instruction, from the entries of the blocks at each slot.
+    std::vector<uint64_t> execution_counts(const std::vector<uint64_t>& entries) const
+    {
+        std::vector<uint64_t> counts(slots.size(), 0);
+        uint64_t running = 0;
+        for(size_t slot=0; slot<slots.size(); ++slot)
+        {
+            const Slot& s = slots[slot];
+            if( !s.instruction )
+                continue;
+            if( s.leader )
+                running = 0;
+            running += entries[slot];
+            counts[slot] = running;
+        }
+        return counts;
+    }
+};
@@ -0,0 +1,402 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <stdexcept>
+#include <string_view>
+#include <type_traits>
+
+#include "lexer.h"
+#include "machine.h"
+
+// The compile-time assembler, for a host that builds a program of the 16-bit machine into its executable instead of
+// loading a program file:
+//   constexpr auto code = xie::assemble([]{ return R"(
+//           MOV RA, 10
+//       loop:
+//           DEC RA
+//           CMP RA, 0
+//           JNE loop
+//           HLT
+//       )"; });
+//   Machine16 machine;
+//   machine.load(xie::program(code), error);
+// code is a std::array of the machine words, as xasm would write them. The source is given by a lambda that returns it,
+// so that it is a constant inside assemble(), and the array can have the size of the code; xie::assemble<words>(source)
+// takes the source itself, and needs the number of words.
+// The lines are lexed by lex_line(), the labels are found in a first pass and the instructions encoded in a second,
+// as xasm does. An error throws std::invalid_argument, which is a compile error in a constant expression; the compiler
+// points at the throw, whose message is the error.
+// Only instructions are assembled: directives (#include, #define, ...) and data directives are errors. An operand
+// value is a number (see string_to_number()), a label, or a sum of them, e.g. `label+2`; not other expressions.
+namespace xie
+{
+    // tokens of a line: a label, a mnemonic, 3 operands and their commas.
+    struct LineTokens
+    {
+        static constexpr size_t MAX_SIZE = 7;
+
+        Token   tokens[MAX_SIZE] = {};
+        size_t  size = 0;
+
+        constexpr void push_back(const Token& token)
+        {
+            if( size==MAX_SIZE )
+                throw std::invalid_argument("too many operands");
+            tokens[size++] = token;
+        }
+    };
+
+    template<size_t Capacity>
+    class LabelTable
+    {
+    public:
+        constexpr void add(std::string_view name, int address)
+        {
+            int found = 0;
+            if( find(name, found) )
+                throw std::invalid_argument("label defined twice");
+            if( size_==Capacity )
+                throw std::invalid_argument("too many labels");
+            names_[size_] = name;
+            addresses_[size_] = address;
+            ++ size_;
+        }
+
+        constexpr bool find(std::string_view name, int& address) const
+        {
+            for(size_t i=0; i<size_; ++i)
+            {
+                if( names_[i]==name )
+                {
+                    address = addresses_[i];
+                    return true;
+                }
+            }
+            return false;
+        }
+
+    private:
+        std::array<std::string_view, Capacity>  names_ = {};
+        std::array<int, Capacity>               addresses_ = {};
+        size_t                                  size_ = 0;
+    };
+
+    // the next line of source from pos, without its line break; pos moves past it.
+    constexpr std::string_view next_line(std::string_view source, size_t& pos)
+    {
+        size_t end = source.find('\n', pos);
+        if( end==std::string_view::npos )
+            end = source.size();
+        std::string_view line = source.substr(pos, end-pos);
+        pos = end+1;
+        return line;
+    }
+
+    // lex a line; return the index of its mnemonic in tokens, or tokens.size if it has none. the label of the line, if
+    // any, is in label.
+    constexpr size_t lex_code_line(std::string_view line, LexState& state, LineTokens& tokens, std::string_view& label)
+    {
+        if( const char* error = lex_line(line, state, tokens) )
+            throw std::invalid_argument(error);
+        size_t first = 0;
+        label = {};
+        if( tokens.size>0 && tokens.tokens[0].kind==TokenKind::Label )
+            label = tokens.tokens[first++].text;
+        if( first==tokens.size )
+            return first;
+        switch( tokens.tokens[first].kind )
+        {
+            case TokenKind::Mnemonic:   return first;
+            case TokenKind::Directive:  throw std::invalid_argument("directives are not supported");
+            case TokenKind::Label:      throw std::invalid_argument("only one label allowed at line start");
+            default:                    throw std::invalid_argument("not an instruction");
+        }
+    }
+
+    // instructions and labels of source.
+    struct CodeSize
+    {
+        size_t  words = 0;
+        size_t  labels = 0;
+    };
+
+    constexpr CodeSize code_size(std::string_view source)
+    {
+        CodeSize size;
+        LexState state;
+        for(size_t pos=0; pos<source.size(); )
+        {
+            LineTokens tokens;
+            std::string_view label;
+            size_t first = lex_code_line(next_line(source, pos), state, tokens, label);
+            size.labels += !label.empty();
+            size.words += first<tokens.size;
+        }
+        return size;
+    }
+
+    // a number, as string_to_number() reads it: decimal, 0x hex, 0b binary, or quoted chars.
+    constexpr bool parse_number(std::string_view text, int& value)
+    {
+        value = 0;
+        if( text.size()>2 && (text.front()=='\'' || text.front()=='"') && text.back()==text.front() )
+        {
+            std::string_view chars = text.substr(1, text.size()-2);
+            if( chars.size()>sizeof(int) )
+                return false;
+            for(size_t i=0; i<chars.size(); ++i)
+                value |= int(uint32_t((unsigned char)(chars[i])) << (8*i));
+            return true;
+        }
+        int base = 10;
+        if( text.size()>2 && text[0]=='0' && (text[1]=='x' || text[1]=='X' || text[1]=='b' || text[1]=='B') )
+        {
+            base = text[1]=='x' || text[1]=='X' ? 16 : 2;
+            text.remove_prefix(2);
+        }
+        bool negative = base==10 && !text.empty() && text.front()=='-';
+        if( base==10 && !text.empty() && (text.front()=='+' || text.front()=='-') )
+            text.remove_prefix(1);
+        if( text.empty() )
+            return false;
+        int64_t n = 0;
+        for(char c : text)
+        {
+            int digit = c>='0' && c<='9' ? c-'0' : c>='a' && c<='f' ? c-'a'+10 : c>='A' && c<='F' ? c-'A'+10 : base;
+            if( digit>=base )
+                return false;
+            n = n*base + digit;
+            if( n > (negative ? -int64_t(INT32_MIN) : int64_t(UINT32_MAX)) )
+                return false;
+        }
+        value = int(uint32_t(negative ? -n : n));
+        return true;
+    }
+
+    // a number or label, or a sum of them, e.g. `label+2`, `-3`.
+    template<class Labels>
+    constexpr bool parse_value(std::string_view text, const Labels& labels, int& value)
+    {
+        value = 0;
+        text = trim(text);
+        int sign = 1;
+        if( !text.empty() && (text.front()=='+' || text.front()=='-') )
+        {
+            sign = text.front()=='-' ? -1 : 1;
+            text.remove_prefix(1);
+        }
+        for(size_t pos=0; ; )
+        {
+            size_t end = pos;
+            if( end<text.size() && (text[end]=='\'' || text[end]=='"') )
+                end = std::min(text.find(text[end], end+1), text.size()-1) + 1;     // quoted chars may be + or -
+            while( end<text.size() && text[end]!='+' && text[end]!='-' )
+                ++ end;
+            std::string_view term = trim(text.substr(pos, end-pos));
+            int n = 0;
+            if( term.empty() || (!parse_number(term, n) && !labels.find(term, n)) )
+                return false;
+            value += sign*n;
+            if( end==text.size() )
+                return true;
+            sign = text[end]=='-' ? -1 : 1;
+            pos = end+1;
+        }
+    }
+
+    constexpr int register_operand(const Token& token)
+    {
+        if( token.kind!=TokenKind::Register )
+            throw std::invalid_argument("invalid register");
+        return int(*findRegister(token.text));
+    }
+
+    // naked reg but PC and SR (flag 0), or num or label (flag 1).
+    template<class Labels>
+    constexpr int naked_operand(const Token& token, const Labels& labels, bool& flag)
+    {
+        if( token.kind==TokenKind::Register )
+        {
+            Register reg = *findRegister(token.text);
+            if( reg==Register::PC || reg==Register::SR )
+                throw std::invalid_argument("operand must be register or number");
+            flag = false;
+            return int(reg);
+        }
+        int value = 0;
+        bool valueKind = token.kind==TokenKind::Identifier || token.kind==TokenKind::Number || token.kind==TokenKind::String;
+        if( !valueKind || !parse_value(token.text, labels, value) )
+            throw std::invalid_argument(token.kind==TokenKind::Identifier ? "unrecognized label" : "operand must be register or number");
+        flag = true;
+        return value;
+    }
+
+    // [reg] (flag 0), or [num] or [label] (flag 1); with indexed, also [reg+imm], [reg-imm] and [reg+], see IndexedOperand.
+    template<class Labels>
+    constexpr int memory_operand(const Token& token, const Labels& labels, bool& flag, bool indexed)
+    {
+        if( token.kind!=TokenKind::Memory || token.text.empty() )
+            throw std::invalid_argument("memory location needed");
+        flag = false;
+        if( const Register* reg = findRegister(token.text) )
+            return int(*reg);
+        size_t sign = token.text.find_first_of("+-");
+        const Register* reg = sign==std::string_view::npos ? nullptr : findRegister(trim(token.text.substr(0, sign)));
+        if( indexed && reg )
+        {
+            std::string_view rest = trim(token.text.substr(sign));
+            IndexedOperand index{ uint8_t(*reg), rest=="+", 0 };
+            int offset = 0;
+            if( *reg==Register::PC || *reg==Register::SR )
+                throw std::invalid_argument("invalid memory location");
+            if( !index.postIncrement )
+            {
+                if( !parse_value(rest, labels, offset) || offset<IndexedOperand::MIN_OFFSET || offset>IndexedOperand::MAX_OFFSET )
+                    throw std::invalid_argument("invalid memory location");
+                index.offset = int8_t(offset);
+            }
+            return index.encode();
+        }
+        int value = 0;
+        if( !parse_value(token.text, labels, value) )
+            throw std::invalid_argument("invalid memory location");
+        flag = true;
+        return value;
+    }
+
+    // encode the instruction of a line whose mnemonic is tokens[first], as encode_line() does.
+    template<class Labels>
+    constexpr uint32_t encode_instruction(const LineTokens& tokens, size_t first, const Labels& labels)
+    {
+        const InstructionData& instr = *findInstruction(tokens.tokens[first].text);
+        // operands, without the separating commas; a comma between two operands is optional.
+        Token ops[3] = {};
+        size_t count = 0;
+        bool commaAllowed = false;
+        for(size_t i=first+1; i<tokens.size; ++i)
+        {
+            const Token& token = tokens.tokens[i];
+            if( token.kind==TokenKind::Comma )
+            {
+                if( !commaAllowed )
+                    throw std::invalid_argument("misplaced comma");
+                commaAllowed = false;
+            }
+            else
+            {
+                if( count==3 )
+                    throw std::invalid_argument("too many operands");
+                ops[count++] = token;
+                commaAllowed = true;
+            }
+        }
+        if( count>0 && !commaAllowed )
+            throw std::invalid_argument("misplaced comma");
+        if( count!=size_t(instr.operandCount) )
+            throw std::invalid_argument(instr.operandCount==0 ? "instruction cannot have operands" :
+                                        instr.operandCount==1 ? "only one operand allowed for instruction" :
+                                        instr.operandCount==2 ? "instruction needs 2 operands" : "instruction needs 3 operands");
+
+        bool flag = false;
+        int operand1 = 0;
+        int operand2 = 0;
+        Condition condition{};
+        if( instr.operandCount==1 )
+        {
+            if( jump_condition(instr.opcode, condition) || instr.opcode==Opcode::JMP || instr.opcode==Opcode::CLL )
+            {
+                // label, [label], or [reg].
+                const Register* reg = ops[0].kind==TokenKind::Memory ? findRegister(ops[0].text) : nullptr;
+                if( reg )
+                    operand2 = int(*reg);
+                else if( ops[0].kind==TokenKind::Register || !parse_value(ops[0].text, labels, operand2) )
+                    throw std::invalid_argument("unrecognized label");
+                else
+                    flag = true;
+            }
+            else if( instr.opcode==Opcode::DPL )
+                operand2 = memory_operand(ops[0], labels, flag, false);
+            else if( instr.opcode==Opcode::PSH )
+                operand2 = naked_operand(ops[0], labels, flag);
+            else
+                operand2 = register_operand(ops[0]);       // INC, DEC, NOT, POP, BSW, CID, FAV, FFL
+        }
+        else if( instr.operandCount==2 )
+        {
+            operand1 = register_operand(ops[0]);
+            if( instr.operand2Memory && ops[1].kind!=TokenKind::Memory )
+                throw std::invalid_argument("invalid operand2, needing `[` and `]`");
+            operand2 = instr.operand2Memory ? memory_operand(ops[1], labels, flag, instr.indexed()) : naked_operand(ops[1], labels, flag);
+        }
+        else if( instr.block() )
+        {
+            operand1 = register_operand(ops[0]);
+            operand2 = BlockOperand{uint8_t(register_operand(ops[1])), uint8_t(register_operand(ops[2]))}.encode();
+        }
+        else if( instr.operandCount==3 )
+        {
+            // CMV cc, reg, reg/num
+            if( ops[0].kind!=TokenKind::Identifier || !findCondition(ops[0].text, condition) )
+                throw std::invalid_argument("invalid condition");
+            operand1 = register_operand(ops[1]);
+            int value = int16_t(naked_operand(ops[2], labels, flag));
+            if( flag && (value<ConditionalOperand::MIN_IMMEDIATE || value>ConditionalOperand::MAX_IMMEDIATE) )
+                throw std::invalid_argument("number out of range");
+            operand2 = ConditionalOperand{condition, int16_t(value)}.encode();
+        }
+        return assemble_machine_code(uint8_t(instr.opcode), flag, uint8_t(operand1), uint16_t(operand2));
+    }
+
+    // assemble source of Words instructions, with up to Labels labels.
+    template<size_t Words, size_t Labels = 64>
+    constexpr std::array<uint32_t, Words> assemble(std::string_view source)
+    {
+        // first pass: the labels
+        LabelTable<Labels> labels;
+        LexState state;
+        int address = MACHINE_CODE_START;
+        for(size_t pos=0; pos<source.size(); )
+        {
+            LineTokens tokens;
+            std::string_view label;
+            size_t first = lex_code_line(next_line(source, pos), state, tokens, label);
+            if( !label.empty() )
+                labels.add(label, address);
+            address += first<tokens.size ? 4 : 0;
+        }
+        if( size_t(address - MACHINE_CODE_START)/4 != Words )
+            throw std::invalid_argument("the instructions of source are not Words");
+
+        // second pass: the instructions
+        std::array<uint32_t, Words> code = {};
+        size_t words = 0;
+        state = LexState{};
+        for(size_t pos=0; pos<source.size(); )
+        {
+            LineTokens tokens;
+            std::string_view label;
+            size_t first = lex_code_line(next_line(source, pos), state, tokens, label);
+            if( first<tokens.size )
+                code[words++] = encode_instruction(tokens, first, labels);
+        }
+        return code;
+    }
+
+    // assemble the source that source() returns, into an array of its size.
+    template<class Source>
+    constexpr auto assemble(Source source)
+    {
+        static_assert(std::is_invocable_r_v<std::string_view, Source>, "give the source as a lambda: xie::assemble([]{ return R\"(...)\"; })");
+        constexpr CodeSize size = code_size(source());
+        return assemble<size.words, size.labels>(source());
+    }
+
+    // the program of code, for Machine::load().
+    template<size_t Words>
+    std::string_view program(const std::array<uint32_t, Words>& code)
+    {
+        return std::string_view(reinterpret_cast<const char*>(code.data()), Words*sizeof(uint32_t));
+    }
+}
@@ -0,0 +1,161 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "machine.h"
+#include "blocks.h"
+
+// Basic-block coverage of a program, for xsim --coverage.
+// The blocks are found in the loaded code before the run, see CodeBlocks. The run then goes a block at a time: it counts
+// the entry of a block and runs its instructions with Machine::run(), so the cost is one count per block, not per
+// instruction. At the end of a block that is a conditional jump, it counts whether the jump was taken.
+// A jump to a register can enter a block in its middle; the entry is counted there, and the rest of the block is run.
+// Code run outside the loaded code is run an instruction at a time, and is not counted.
+// The counts are mapped to source lines by the debug line table of xasm --lines, and written as an lcov tracefile.
+
+struct LineTableEntry
+{
+    std::string     file;
+    int             line = 0;
+};
+
+// the debug line table of xasm --lines: source line by instruction address. return false if it cannot be read.
+inline bool load_line_table(const std::string& path, std::map<uint32_t, LineTableEntry>& table)
+{
+    std::ifstream f(path);
+    if( !f.is_open() )
+        return false;
+    std::string text;
+    while( std::getline(f, text) )
+    {
+        std::istringstream fields(text);
+        uint32_t address = 0;
+        LineTableEntry source;
+        if( !(fields >> std::hex >> address >> std::dec >> source.line) )
+            continue;
+        std::getline(fields >> std::ws, source.file);
+        table[address] = std::move(source);
+    }
+    return true;
+}
+
+template<class Word>
+class BlockCoverage
+{
+public:
+    // find the blocks of the code machine has loaded.
+    explicit BlockCoverage(Machine<Word>& machine)
+        : blocks_(reinterpret_cast<const char*>(machine.ram().access_byte(MACHINE_CODE_START)), uint32_t(MACHINE_CODE_START),
+                  machine.codeSize(), MachineTraits<Word>::WIDE),
+          entries_(blocks_.slots.size(), 0), taken_(blocks_.slots.size(), 0), notTaken_(blocks_.slots.size(), 0)
+    {
+    }
+
+    // run core 0 of machine until it halts, counting the blocks it runs.
+    void run(Machine<Word>& machine)
+    {
+        using UWord = std::make_unsigned_t<Word>;
+        RegisterFile<Word>& regs = machine.registers();
+        while( !machine.halted(0) )
+        {
+            int64_t slot = blocks_.slot(uint32_t(UWord(regs.PC)));
+            if( slot<0 )
+            {
+                machine.step(0);
+                continue;
+            }
+            const CodeBlocks::Slot& entry = blocks_.slots[slot];
+            ++ entries_[slot];
+            if( machine.run(entry.remaining)==entry.remaining && !machine.halted(0) )
+            {
+                if( blocks_.slots[entry.last].conditional )
+                    ++ (uint32_t(UWord(regs.PC))==blocks_.slots[entry.last].fallThrough ? notTaken_ : taken_)[entry.last];
+            }
+        }
+    }
+
+    // blocks, and the blocks run.
+    int blocks() const      { return int(std::count_if(blocks_.slots.begin(), blocks_.slots.end(), [](const CodeBlocks::Slot& s){ return s.leader; })); }
+    int blocks_hit() const
+    {
+        std::vector<uint64_t> counts = blocks_.execution_counts(entries_);
+        int hit = 0;
+        for(size_t slot=0; slot<blocks_.slots.size(); ++slot)
+            hit += blocks_.slots[slot].leader && counts[slot]>0;
+        return hit;
+    }
+
+    // write an lcov tracefile of lines and conditional jumps, by the debug line table. instructions not in the table
+    // are not written.
+    bool write_lcov(const std::string& path, const std::map<uint32_t, LineTableEntry>& table, std::ostream& summary) const
+    {
+        struct Branch { int line; uint64_t taken, notTaken; bool run; };
+        std::map<std::string, std::map<int, uint64_t>> lines;        // by file and line: the most runs of its instructions
+        std::map<std::string, std::vector<Branch>> branches;
+        std::vector<uint64_t> counts = blocks_.execution_counts(entries_);
+        for(size_t slot=0; slot<blocks_.slots.size(); ++slot)
+        {
+            auto source = table.find(uint32_t(MACHINE_CODE_START + slot*4));
+            if( !blocks_.slots[slot].instruction || source==table.end() )
+                continue;
+            uint64_t& count = lines[source->second.file][source->second.line];
+            count = std::max(count, counts[slot]);
+            if( blocks_.slots[slot].conditional )
+                branches[source->second.file].push_back({source->second.line, taken_[slot], notTaken_[slot], counts[slot]>0});
+        }
+
+        std::ofstream f(path);
+        if( !f.is_open() )
+            return false;
+        int linesFound = 0, linesHit = 0, branchesFound = 0, branchesHit = 0;
+        f << "TN:" << std::endl;
+        for(auto& [file, fileLines] : lines)
+        {
+            f << "SF:" << file << std::endl;
+            int found = 0, hit = 0;
+            for(auto& [line, count] : fileLines)
+            {
+                f << "DA:" << line << "," << count << std::endl;
+                ++ found;
+                hit += count>0;
+            }
+            int branchFound = 0, branchHit = 0;
+            int block = 0;
+            for(const Branch& branch : branches[file])
+            {
+                uint64_t counts[2] = {branch.taken, branch.notTaken};
+                for(int i=0; i<2; ++i)
+                {
+                    f << "BRDA:" << branch.line << "," << block << "," << i << ",";
+                    if( branch.run )
+                        f << counts[i];
+                    else
+                        f << "-";
+                    f << std::endl;
+                    ++ branchFound;
+                    branchHit += counts[i]>0;
+                }
+                ++ block;
+            }
+            f << "BRF:" << branchFound << std::endl << "BRH:" << branchHit << std::endl;
+            f << "LF:" << found << std::endl << "LH:" << hit << std::endl;
+            f << "end_of_record" << std::endl;
+            linesFound += found; linesHit += hit; branchesFound += branchFound; branchesHit += branchHit;
+        }
+        summary << "Coverage: blocks " << blocks_hit() << "/" << blocks() << ", lines " << linesHit << "/" << linesFound
+                << ", branch directions " << branchesHit << "/" << branchesFound << std::endl;
+        return bool(f);
+    }
+
+private:
+    CodeBlocks              blocks_;
+    std::vector<uint64_t>   entries_;           // by slot: runs of its block that started there
+    std::vector<uint64_t>   taken_, notTaken_;  // by slot: of a conditional jump
+};
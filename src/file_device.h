@@ -0,0 +1,241 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <string_view>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define XIE_HAS_MMAP 1
+#endif
+
+// The host file device of FOP, FMP, FAV and FFL, for a program to stream a file through a window of RAM:
+//   FOP reg, [mem]         open the host file named by the xstring at mem; create it if reg is not 0.
+//   FMP reg1, reg2, reg3   map the window: the reg3 bytes of RAM at reg1 show the file from its start.
+//   FAV reg                advance the window reg bytes in the file.
+//   FFL reg                flush: write the first reg bytes of the window to the file.
+// The file is memory-mapped where the platform supports it, and read and written with a stream otherwise; the window
+// is copied in bulk between the file and RAM. The window is loaded by FMP and FAV, and written only by FFL: a change to
+// the window that is not flushed is lost when it advances. bytes of the window past the end of the file read as 0;
+// flushing them makes the file longer.
+// The files are in a root directory: a name is a relative path in it, without `..`, and cannot lead out of it by a
+// symbolic link either.
+// One file is open at a time. The cores of a machine share the device; each instruction is atomic.
+class FileDevice
+{
+public:
+    // the device of the files in root, which must be a directory.
+    explicit FileDevice(const std::filesystem::path& root)
+    {
+        std::error_code ec;
+        root_ = std::filesystem::canonical(root, ec);
+        if( ec || !std::filesystem::is_directory(root_, ec) )
+            root_.clear();      // no files
+    }
+    ~FileDevice() { close(); }
+
+    FileDevice(const FileDevice&) = delete;
+    FileDevice& operator=(const FileDevice&) = delete;
+
+    // open the file of name for reading and writing, or for reading only if it cannot be written; with create, it is
+    // created if it does not exist. the file open before is closed, and the window unmapped. return false if it cannot
+    // be opened, or name is not a file in the root directory.
+    bool open(std::string_view name, bool create)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        close();
+        std::filesystem::path path = resolve(name);
+        if( path.empty() )
+            return false;
+#ifdef XIE_HAS_MMAP
+        writable_ = true;
+        fd_ = ::open(path.c_str(), O_RDWR | (create ? O_CREAT : 0), 0666);
+        if( fd_<0 )
+        {
+            writable_ = false;
+            fd_ = ::open(path.c_str(), O_RDONLY);
+        }
+        struct stat st;
+        if( fd_<0 || ::fstat(fd_, &st)!=0 || !S_ISREG(st.st_mode) || !map_file(uint64_t(st.st_size)) )
+        {
+            close();
+            return false;
+        }
+#else
+        stream_.open(path, std::ios::in | std::ios::out | std::ios::binary);
+        if( !stream_.is_open() && create )
+        {
+            std::ofstream(path, std::ios::app);     // create it
+            stream_.open(path, std::ios::in | std::ios::out | std::ios::binary);
+        }
+        writable_ = stream_.is_open();
+        if( !writable_ )
+            stream_.open(path, std::ios::in | std::ios::binary);
+        if( !stream_.is_open() )
+            return false;
+        stream_.seekg(0, std::ios::end);
+        size_ = uint64_t(stream_.tellg());
+#endif
+        open_ = true;
+        return true;
+    }
+
+    // close the file, and unmap the window: the machine is reset, and its RAM is no longer the window.
+    void reset()
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        close();
+    }
+
+    // map the window to the size bytes of RAM at window, from the start of the file. window must stay valid while it is
+    // mapped. return the bytes of the file in the window, or -1 if no file is open.
+    int64_t map(char* window, uint32_t size)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if( !open_ )
+            return -1;
+        window_ = window;
+        windowSize_ = size;
+        position_ = 0;
+        return load();
+    }
+
+    // move the window bytes forward in the file, and load it. return the bytes of the file in the window, or -1 if
+    // there is no window.
+    int64_t advance(uint64_t bytes)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if( !window_ )
+            return -1;
+        position_ += bytes;
+        return load();
+    }
+
+    // write the first bytes of the window to the file, which grows to hold them. return the bytes of the file in the
+    // window, or -1 if there is no window, or the file cannot be written.
+    int64_t flush(uint32_t bytes)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if( !window_ || bytes>windowSize_ || !writable_ )
+            return -1;
+        uint64_t end = position_ + bytes;
+#ifdef XIE_HAS_MMAP
+        if( end>size_ && (::ftruncate(fd_, off_t(end))!=0 || !map_file(end)) )
+            return -1;
+        std::memcpy(data_ + position_, window_, bytes);
+#else
+        stream_.clear();
+        stream_.seekp(std::streamoff(position_));
+        if( !stream_.write(window_, bytes).flush() )
+            return -1;
+        size_ = std::max(size_, end);
+#endif
+        return in_window();
+    }
+
+private:
+    // the path of name in the root directory; empty if name is empty or absolute, has a `..`, or leads out of the root
+    // by a symbolic link.
+    std::filesystem::path resolve(std::string_view name) const
+    {
+        std::filesystem::path relative(name);
+        if( root_.empty() || name.empty() || relative.has_root_path() )
+            return {};
+        for(const std::filesystem::path& part : relative)
+        {
+            if( part==".." )
+                return {};
+        }
+        std::error_code ec;
+        std::filesystem::path path = std::filesystem::weakly_canonical(root_ / relative, ec);
+        if( ec || std::mismatch(root_.begin(), root_.end(), path.begin(), path.end()).first!=root_.end() )
+            return {};
+        return path;
+    }
+
+    // bytes of the file in the window.
+    int64_t in_window() const
+    {
+        return int64_t(position_ < size_ ? std::min<uint64_t>(size_ - position_, windowSize_) : 0);
+    }
+
+    // copy the file at the position into the window, and zero the rest of it.
+    int64_t load()
+    {
+        int64_t bytes = in_window();
+#ifdef XIE_HAS_MMAP
+        if( bytes>0 )
+            std::memcpy(window_, data_ + position_, size_t(bytes));
+#else
+        stream_.clear();
+        stream_.seekg(std::streamoff(position_));
+        if( bytes>0 && !stream_.read(window_, bytes) )
+            bytes = stream_.gcount();
+#endif
+        std::memset(window_ + bytes, 0, windowSize_ - size_t(bytes));
+        return bytes;
+    }
+
+#ifdef XIE_HAS_MMAP
+    // map the whole file, of size bytes, again.
+    bool map_file(uint64_t size)
+    {
+        if( data_ )
+            ::munmap(data_, size_t(size_));
+        data_ = nullptr;
+        size_ = size;
+        if( size==0 )
+            return true;
+        void* p = ::mmap(nullptr, size_t(size), PROT_READ | (writable_ ? PROT_WRITE : 0), MAP_SHARED, fd_, 0);
+        if( p==MAP_FAILED )
+        {
+            size_ = 0;
+            return false;
+        }
+        data_ = static_cast<char*>(p);
+        return true;
+    }
+#endif
+
+    void close()
+    {
+#ifdef XIE_HAS_MMAP
+        if( data_ )
+            ::munmap(data_, size_t(size_));
+        if( fd_>=0 )
+            ::close(fd_);
+        data_ = nullptr;
+        fd_ = -1;
+#else
+        stream_.close();
+#endif
+        open_ = false;
+        size_ = 0;
+        window_ = nullptr;
+        windowSize_ = 0;
+        position_ = 0;
+    }
+
+    std::filesystem::path   root_;          // canonical; empty if there is none
+    std::mutex      mutex_;
+#ifdef XIE_HAS_MMAP
+    int             fd_ = -1;
+    char*           data_ = nullptr;        // the mapped file
+#else
+    std::fstream    stream_;
+#endif
+    bool            open_ = false;
+    bool            writable_ = false;
+    uint64_t        size_ = 0;              // of the file
+    char*           window_ = nullptr;      // RAM
+    uint32_t        windowSize_ = 0;
+    uint64_t        position_ = 0;          // in the file, of the window
+};
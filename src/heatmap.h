@@ -0,0 +1,194 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "machine.h"
+#include "accesses.h"
+
+// RAM traffic of a program, run beside the machine by xsim --heatmap: bytes fetched, read and written per line of RAM,
+// by kind of access (see AccessKind), and the peak stack depth of core 0. The counts are written as CSV and as a PPM
+// image, and summed per region of the memory layout.
+template<class Word>
+class MemoryHeatmap
+{
+public:
+    static constexpr int KINDS = 5;     // of AccessKind
+
+    // line: bytes per counted line of RAM, a power of 2.
+    explicit MemoryHeatmap(int line = 16)
+        : lineBits_(log2(line)), counts_((size_t(MachineTraits<Word>::RAM_SIZE) >> lineBits_) * KINDS, 0) {}
+
+    // record the accesses of the instruction core 0 of machine runs next; call it before each step.
+    void record(Machine<Word>& machine)
+    {
+        finish(machine);
+        RegisterFile<Word>& regs = machine.registers();
+        if( machine.halted(0) )
+            return;
+        DecodedInstruction d = decode_instruction(machine.ram(), uint32_t(std::make_unsigned_t<Word>(regs.PC)));
+        MemoryAccess accesses[MAX_ACCESSES];
+        int n = instruction_accesses(d, regs, machine.ram(), accesses);
+        for(int i=0; i<n; ++i)
+            add(accesses[i]);
+        pendingInput_ = d.opcode==Opcode::KBD;
+        ++ instructions_;
+    }
+
+    // record what the last instruction did that was not known before it ran: the input of KBD, and the stack depth.
+    void finish(Machine<Word>& machine)
+    {
+        if( pendingInput_ )
+        {
+            short count = *machine.ram().access_short(INPUT_START);
+            add({uint32_t(INPUT_START + 2), uint32_t(std::max<short>(count, 0)), AccessKind::WRITE});
+            pendingInput_ = false;
+        }
+        uint32_t sp = uint32_t(std::make_unsigned_t<Word>(machine.registers().SP));
+        if( sp < lowestSP_ )
+            lowestSP_ = sp;
+    }
+
+    // bytes below the stack bottom that the stack of core 0 reached.
+    uint32_t peak_stack_depth() const { return lowestSP_ < uint32_t(STACK_START) ? uint32_t(STACK_START) - lowestSP_ : 0; }
+
+    // the lines with traffic: address, then bytes of each AccessKind.
+    bool write_csv(const std::string& path) const
+    {
+        std::ofstream f(path);
+        if( !f.is_open() )
+            return false;
+        f << "address,fetch,read,write,stack_read,stack_write" << std::endl;
+        for(size_t line=0; line<lines(); ++line)
+        {
+            const uint64_t* c = &counts_[line*KINDS];
+            if( std::all_of(c, c+KINDS, [](uint64_t n){ return n==0; }) )
+                continue;
+            f << integer_as_hex(Word(line << lineBits_));
+            for(int k=0; k<KINDS; ++k)
+                f << ',' << c[k];
+            f << '\n';
+        }
+        return bool(f);
+    }
+
+    // an image of RAM from address 0 up to the last line with traffic, 64 lines a row, as a binary PPM: red is writes,
+    // green reads, blue fetches, each on a log scale of its own maximum. a line is a square of pixels.
+    bool write_ppm(const std::string& path) const
+    {
+        constexpr size_t LINES_PER_ROW = 64;
+        size_t used = 0;
+        for(size_t line=0; line<lines(); ++line)
+        {
+            const uint64_t* c = &counts_[line*KINDS];
+            if( std::any_of(c, c+KINDS, [](uint64_t n){ return n!=0; }) )
+                used = line + 1;
+        }
+        size_t rows = std::max<size_t>(1, (used + LINES_PER_ROW - 1) / LINES_PER_ROW);
+        int scale = rows<=64 ? 8 : rows<=512 ? 2 : 1;     // pixels per line
+        uint64_t maxima[3] = {1, 1, 1};
+        auto channels = [this](size_t line, uint64_t (&rgb)[3]){
+            const uint64_t* c = &counts_[line*KINDS];
+            rgb[0] = c[int(AccessKind::WRITE)] + c[int(AccessKind::STACK_WRITE)];
+            rgb[1] = c[int(AccessKind::READ)] + c[int(AccessKind::STACK_READ)];
+            rgb[2] = c[int(AccessKind::FETCH)];
+        };
+        for(size_t line=0; line<used; ++line)
+        {
+            uint64_t rgb[3];
+            channels(line, rgb);
+            for(int i=0; i<3; ++i)
+                maxima[i] = std::max(maxima[i], rgb[i]);
+        }
+
+        std::ofstream f(path, std::ios::binary);
+        if( !f.is_open() )
+            return false;
+        size_t width = LINES_PER_ROW * scale, height = rows * scale;
+        f << "P6\n" << width << " " << height << "\n255\n";
+        std::string row(width*3, '\0');
+        for(size_t r=0; r<rows; ++r)
+        {
+            for(size_t column=0; column<LINES_PER_ROW; ++column)
+            {
+                uint64_t rgb[3] = {0, 0, 0};
+                size_t line = r*LINES_PER_ROW + column;
+                if( line<used )
+                    channels(line, rgb);
+                for(int s=0; s<scale; ++s)
+                {
+                    for(int i=0; i<3; ++i)
+                        row[(column*scale + s)*3 + i] = char(rgb[i] ? 55 + int(200 * std::log1p(double(rgb[i])) / std::log1p(double(maxima[i]))) : 0);
+                }
+            }
+            for(int s=0; s<scale; ++s)
+                f.write(row.data(), std::streamsize(row.size()));
+        }
+        return bool(f);
+    }
+
+    // traffic per region of the memory layout, and the peak stack depth.
+    void report(std::ostream& out) const
+    {
+        struct Region { const char* name; uint32_t begin, end; };
+        const uint32_t ramSize = uint32_t(MachineTraits<Word>::RAM_SIZE);
+        const uint32_t dataStart = uint32_t(MachineTraits<Word>::DATA_START);
+        // the stack grows down from STACK_START towards the code; the stacks of other cores are in the free area.
+        std::vector<Region> regions = {
+            {"data", dataStart, MachineTraits<Word>::WIDE ? ramSize : uint32_t(MACHINE_CODE_START)},
+            {"code+stack", uint32_t(MACHINE_CODE_START), uint32_t(STACK_START)},
+            {"free", uint32_t(STACK_START), uint32_t(DISPLAY_START)},
+            {"display", uint32_t(DISPLAY_START), uint32_t(INPUT_START)},
+            {"input", uint32_t(INPUT_START), MachineTraits<Word>::WIDE ? dataStart : ramSize},
+        };
+        out << "Memory traffic in bytes, over " << instructions_ << " instructions:" << std::endl;
+        out << "  " << std::left << std::setw(12) << "region" << std::setw(10) << "start" << std::right;
+        for(const char* kind : {"fetch", "read", "write", "stack_read", "stack_write"})
+            out << std::setw(12) << kind;
+        out << std::endl;
+        for(const Region& region : regions)
+        {
+            uint64_t sums[KINDS] = {};
+            for(size_t line = region.begin >> lineBits_; line < std::min<size_t>(lines(), region.end >> lineBits_); ++line)
+            {
+                for(int k=0; k<KINDS; ++k)
+                    sums[k] += counts_[line*KINDS + k];
+            }
+            out << "  " << std::left << std::setw(12) << region.name << std::setw(10) << integer_as_hex(Word(region.begin)) << std::right;
+            for(uint64_t sum : sums)
+                out << std::setw(12) << sum;
+            out << std::endl;
+        }
+        out << "Peak stack depth: " << peak_stack_depth() << " bytes, down to " << integer_as_hex(Word(std::min(lowestSP_, uint32_t(STACK_START)))) << std::endl;
+    }
+
+private:
+    static int log2(int n) { int bits = 0; while( (1<<bits) < n ) ++bits; return bits; }
+
+    size_t lines() const { return counts_.size() / KINDS; }
+
+    // count the bytes of an access on the lines it covers; bytes outside RAM are not counted.
+    void add(const MemoryAccess& access)
+    {
+        uint64_t end = std::min<uint64_t>(uint64_t(access.address) + access.size, uint64_t(lines()) << lineBits_);
+        for(uint64_t address = access.address; address < end; )
+        {
+            uint64_t lineEnd = ((address >> lineBits_) + 1) << lineBits_;
+            uint64_t bytes = std::min(lineEnd, end) - address;
+            counts_[size_t(address >> lineBits_)*KINDS + int(access.kind)] += bytes;
+            address += bytes;
+        }
+    }
+
+    int                     lineBits_;
+    std::vector<uint64_t>   counts_;            // bytes, per line and AccessKind
+    uint64_t                instructions_ = 0;
+    uint32_t                lowestSP_ = ~0u;
+    bool                    pendingInput_ = false;
+};
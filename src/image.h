@@ -0,0 +1,89 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Program file written by xasm and loaded by xsim.
+// A program with only machine code is written as the raw instruction words, which are loaded at the code start
+// address. A program that also has a data segment is written as an image of segments:
+//   IMAGE_MAGIC, segment count, then for each segment: address, size in bytes, and the bytes.
+// counts, addresses and sizes are u32, little-endian. The last byte of IMAGE_MAGIC is 0xFF, which is not an opcode,
+// so an image never looks like raw machine code.
+// A program of the 32-bit machine is always written as an image, with IMAGE_MAGIC_32.
+
+constexpr char  IMAGE_MAGIC[4] = {'X', 'I', 'E', '\xFF'};
+constexpr char  IMAGE_MAGIC_32[4] = {'X', 'I', 'E', '\xFE'};
+constexpr int   DATA_START = 0x0000;    // data segment starts here; it must end before the code.
+constexpr int   DATA_START_32 = 0x10000;    // data segment of the 32-bit machine, after the I/O areas up to the core stacks.
+
+struct ImageSegment
+{
+    uint32_t        address;
+    std::string     bytes;
+};
+
+// the word bits of the machine of an image: 16 or 32; 0 if contents is not an image.
+inline int image_bits(std::string_view contents)
+{
+    if( contents.size()<sizeof(IMAGE_MAGIC) )
+        return 0;
+    if( contents.compare(0, sizeof(IMAGE_MAGIC), std::string_view(IMAGE_MAGIC, sizeof(IMAGE_MAGIC)))==0 )
+        return 16;
+    if( contents.compare(0, sizeof(IMAGE_MAGIC_32), std::string_view(IMAGE_MAGIC_32, sizeof(IMAGE_MAGIC_32)))==0 )
+        return 32;
+    return 0;
+}
+
+inline bool is_image(std::string_view contents)
+{
+    return image_bits(contents)!=0;
+}
+
+inline std::string make_image(const std::vector<ImageSegment>& segments, int bits = 16)
+{
+    auto put_u32 = [](std::string& out, uint32_t v){
+        for(int i=0; i<4; ++i)
+            out.push_back(char(v >> (8*i)));
+    };
+    std::string image(bits==32 ? IMAGE_MAGIC_32 : IMAGE_MAGIC, sizeof(IMAGE_MAGIC));
+    put_u32(image, uint32_t(segments.size()));
+    for(const ImageSegment& segment : segments)
+    {
+        put_u32(image, segment.address);
+        put_u32(image, uint32_t(segment.bytes.size()));
+        image += segment.bytes;
+    }
+    return image;
+}
+
+// return false if contents is not a complete image.
+inline bool parse_image(std::string_view contents, std::vector<ImageSegment>& segments)
+{
+    size_t pos = sizeof(IMAGE_MAGIC);
+    auto get_u32 = [&contents, &pos](uint32_t& v){
+        if( pos+4 > contents.size() )
+            return false;
+        v = 0;
+        for(int i=0; i<4; ++i)
+            v |= uint32_t((unsigned char)(contents[pos+i])) << (8*i);
+        pos += 4;
+        return true;
+    };
+    segments.clear();
+    uint32_t count = 0;
+    if( !is_image(contents) || !get_u32(count) )
+        return false;
+    for(uint32_t i=0; i<count; ++i)
+    {
+        ImageSegment segment;
+        uint32_t size = 0;
+        if( !get_u32(segment.address) || !get_u32(size) || size > contents.size()-pos )
+            return false;
+        segment.bytes = contents.substr(pos, size);
+        pos += size;
+        segments.push_back(std::move(segment));
+    }
+    return pos==contents.size();
+}
@@ -0,0 +1,177 @@
+#pragma once
+
+#include <string_view>
+#include <vector>
+
+#include "ref.h"
+
+enum class TokenKind : uint8_t
+{
+    Mnemonic,       // instruction name, e.g. `MOV`
+    Register,       // register name, e.g. `RA`
+    Number,         // number literal, e.g. `42`, `-3`, `0x3000`, `0b0101`, `'a'`
+    String,         // double-quoted text, e.g. `"xlib.xasm"`; text includes the quotes
+    Label,          // label definition `name:`; text excludes the `:`
+    Memory,         // bracketed operand `[...]`; text is the trimmed contents without brackets
+    Identifier,     // any other word, e.g. a label reference
+    Directive,      // `#word` or `# word`; text is the word
+    Comma,
+};
+
+struct Token
+{
+    TokenKind           kind;
+    std::string_view    text;       // view into the source text
+};
+
+// comment state carried from line to line by lex_line().
+struct LexState
+{
+    bool    inComment = false;      // inside a `/* ... */` opened on an earlier line
+};
+
+//==============================================================================================================================
+//==============================================================================================================================
+
+constexpr bool is_blank(char c)
+{
+    return c==' ' || c=='\t' || c=='\r' || c=='\v' || c=='\f' || c=='\n';
+}
+
+constexpr bool is_digit(char c)
+{
+    return c>='0' && c<='9';
+}
+
+// a word ends at blanks, commas, brackets, quotes and comments.
+constexpr size_t word_end(std::string_view line, size_t pos)
+{
+    while( pos<line.size() )
+    {
+        char c = line[pos];
+        if( is_blank(c) || c==',' || c=='[' || c==']' || c=='"' )
+            break;
+        if( c=='/' && pos+1<line.size() && (line[pos+1]=='/' || line[pos+1]=='*') )
+            break;
+        if( c=='*' && pos+1<line.size() && line[pos+1]=='/' )
+            break;
+        ++pos;
+    }
+    return pos;
+}
+
+constexpr std::string_view trim(std::string_view str)
+{
+    while( !str.empty() && is_blank(str.front()) )
+        str.remove_prefix(1);
+    while( !str.empty() && is_blank(str.back()) )
+        str.remove_suffix(1);
+    return str;
+}
+
+constexpr TokenKind classify_word(std::string_view word)
+{
+    char c = word.front();
+    if( word.back()==':' )
+        return TokenKind::Label;
+    if( is_digit(c) || c=='\'' || ((c=='-' || c=='+') && word.size()>1 && is_digit(word[1])) )
+        return TokenKind::Number;
+    if( word.size()<=3 )
+    {
+        // all instruction and register names are 2 or 3 letters.
+        if( findInstruction(word) )
+            return TokenKind::Mnemonic;
+        if( findRegister(word) )
+            return TokenKind::Register;
+    }
+    return TokenKind::Identifier;
+}
+
+// split a line (without its line break) into tokens appended to `tokens`, skipping `//` and `/* */` comments.
+// return nullptr, or a description of a malformed comment.
+// Tokens is std::vector<Token>, or a fixed-size list for the compile-time assembler, see constexpr_assembler.h.
+template<class Tokens>
+constexpr const char* lex_line(std::string_view line, LexState& state, Tokens& tokens)
+{
+    size_t pos = 0;
+    bool openedHere = false;    // the open `/*` is on this line
+    while( pos<line.size() )
+    {
+        if( state.inComment )
+        {
+            size_t close = line.find("*/", pos);
+            size_t open = line.find("/*", pos);
+            if( open<close )
+                return openedHere ? "`/*` following `/*`" : "`/*` following earlier line's `/*`";
+            if( close==std::string_view::npos )
+                return nullptr;     // the rest of the line is comment.
+            state.inComment = false;
+            pos = close+2;
+            continue;
+        }
+
+        char c = line[pos];
+        if( is_blank(c) )
+        {
+            ++pos;
+            continue;
+        }
+        char next = pos+1<line.size() ? line[pos+1] : '\0';
+        if( c=='/' && next=='/' )
+            return nullptr;
+        if( c=='/' && next=='*' )
+        {
+            state.inComment = true;
+            openedHere = true;
+            pos += 2;
+            continue;
+        }
+        if( c=='*' && next=='/' )
+            return "`*/` without earlier matching `/*`";
+
+        size_t end = pos;
+        TokenKind kind = TokenKind::Identifier;
+        std::string_view text;
+        if( c==',' )
+        {
+            end = pos+1;
+            kind = TokenKind::Comma;
+            text = line.substr(pos, 1);
+        }
+        else if( c=='[' && line.find(']', pos)!=std::string_view::npos )
+        {
+            end = line.find(']', pos)+1;
+            kind = TokenKind::Memory;
+            text = trim(line.substr(pos+1, end-pos-2));
+        }
+        else if( (c=='\'' || c=='"') && line.find(c, pos+1)!=std::string_view::npos )
+        {
+            // quoted text is taken verbatim, comment markers included.
+            end = line.find(c, pos+1)+1;
+            kind = c=='"' ? TokenKind::String : TokenKind::Number;
+            text = line.substr(pos, end-pos);
+        }
+        else if( c=='#' )
+        {
+            size_t begin = pos+1;
+            while( begin<line.size() && is_blank(line[begin]) )
+                ++begin;
+            end = word_end(line, begin);
+            kind = TokenKind::Directive;
+            text = line.substr(begin, end-begin);
+        }
+        else
+        {
+            end = word_end(line, pos);
+            if( end==pos )
+                end = pos+1;    // a lone `]` or `"`.
+            text = line.substr(pos, end-pos);
+            kind = classify_word(text);
+            if( kind==TokenKind::Label )
+                text.remove_suffix(1);
+        }
+        tokens.push_back({kind, text});
+        pos = end;
+    }
+    return nullptr;
+}
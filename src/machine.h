@@ -0,0 +1,998 @@
+#pragma once
+
+#include <cassert>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <cstdint>
+#include <type_traits>
+#include <functional>
+#include <memory>
+#include <algorithm>
+#include <mutex>
+#include <thread>
+
+#include "ref.h"
+#include "blocks.h"
+#include "image.h"
+#include "file_device.h"
+
+// The XIE machine core, over its Word: registers, addresses and values are Words, and the instructions have the same
+// semantics on both machines.
+//   int16_t: the 16-bit machine, with 0x5000 bytes of RAM.
+//   int32_t: the 32-bit machine, with 16MB of RAM; its num/mem/label operands are 32-bit, see WIDE_OPERAND.
+// the memory layout below RAM_SIZE is the same. shorts (LDS/STS, xstring counts) are 16-bit on both machines; LDW/STW,
+// PSH/POP and CLL/RET work on Words. packed byte instructions work on all bytes of a Word, except BSW, on a short.
+
+using Instruction = uint32_t;
+using BYTE = char;
+
+constexpr int MACHINE_CODE_START = 0x1000;  // first machine instruction starts here.
+constexpr int STACK_START = 0x2000;         // stack bottom; the stack grows down.
+constexpr int DISPLAY_START = 0x3000;       // 80x25 chars
+constexpr int INPUT_START = 0x4000;         // xstring of the last KBD line
+
+constexpr Instruction INVALID_INSTRUCTION = 0xFFFFFFFF;    // fetched from outside RAM; its opcode is not an instruction
+
+template<class Word>
+struct MachineTraits
+{
+    static_assert( std::is_same_v<Word, int16_t> || std::is_same_v<Word, int32_t>, "a XIE machine has 16-bit or 32-bit words" );
+
+    static constexpr int    BITS = int(sizeof(Word)) * 8;
+    static constexpr bool   WIDE = sizeof(Word) > 2;    // num/mem/label operands are in a word after the instruction
+    static constexpr int    RAM_SIZE = WIDE ? 0x1000000 : 0x5000;
+    static constexpr int    DATA_START = WIDE ? DATA_START_32 : ::DATA_START;
+
+    // cores of a multi-core machine. core 0 has its stack at STACK_START; the stacks of the other cores are
+    // CORE_STACK_SIZE each, down from CORE_STACKS_END: in the free space between the stack and the display on the
+    // 16-bit machine, and at the end of RAM on the 32-bit one.
+    static constexpr int    MAX_CORES = WIDE ? 16 : 4;
+    static constexpr int    CORE_STACK_SIZE = WIDE ? 0x10000 : 0x400;
+    static constexpr int    CORE_STACKS_END = WIDE ? RAM_SIZE : DISPLAY_START;
+
+    static constexpr int core_stack(int core)
+    {
+        return core==0 ? STACK_START : CORE_STACKS_END - (core-1)*CORE_STACK_SIZE;
+    }
+};
+static_assert( MachineTraits<int16_t>::core_stack(MachineTraits<int16_t>::MAX_CORES-1) - MachineTraits<int16_t>::CORE_STACK_SIZE >= STACK_START );
+
+template<class Word>
+struct RAM
+{
+    RAM(size_t size) : ram(size), data_(ram.data()), size_(ram.size()) {}
+    RAM(const RAM& other) : ram(other.ram), data_(ram.data()), size_(ram.size()) {}
+    RAM& operator=(const RAM& other) { ram = other.ram; data_ = ram.data(); size_ = ram.size(); return *this; }
+
+    // access
+    BYTE* access_byte(int loc)
+    {
+        return data_ + loc;
+    }
+
+    short* access_short(int loc)
+    {
+        BYTE* p = data_ + loc;
+        return reinterpret_cast<short*>(p);
+    }
+
+    int* access_int(int loc)
+    {
+        BYTE* p = data_ + loc;
+        return reinterpret_cast<int*>(p);
+    }
+
+    Word* access_word(int loc)
+    {
+        BYTE* p = data_ + loc;
+        return reinterpret_cast<Word*>(p);
+    }
+
+    // the size bytes at loc; nullptr if they are not all in RAM.
+    BYTE* access_block(int loc, int size)
+    {
+        if( loc<0 || size<0 || size_t(loc)+size > size_ )
+            return nullptr;
+        return data_ + loc;
+    }
+
+    // the short at loc for an atomic instruction; nullptr if it is not in RAM, or not at an even address.
+    short* access_atomic_short(int loc)
+    {
+        if( (loc & 1) || !access_block(loc, 2) )
+            return nullptr;
+        return access_short(loc);
+    }
+
+    // the instruction word at PC; INVALID_INSTRUCTION if it is not in RAM.
+    Instruction fetch_instruction(int PC)
+    {
+        if( PC<0 || size_t(PC)+4 > size_ )
+            return INVALID_INSTRUCTION;
+        return *reinterpret_cast<Instruction*>(data_ + PC);
+    }
+
+    size_t size() const { return size_; }
+
+    void clear() { std::fill(ram.begin(), ram.end(), BYTE(0)); }
+
+private:
+    std::vector<BYTE> ram;
+    // of ram, which keeps its size: every instruction is fetched through them.
+    BYTE*   data_;
+    size_t  size_;
+};
+
+template<class Word>
+struct RegisterFile
+{
+    Word RA, RB, RC, RD, RE, RF;
+    Word PC;
+    Word SP;
+    Word SR;
+    Word ID;    // core id, read with CID; it is not a register operand.
+
+    void print()
+    {
+        std::cout<<"RA=" << integer_as_hex(RA) <<" ";
+        std::cout<<"RB=" << integer_as_hex(RB) <<" ";
+        std::cout<<"RC=" << integer_as_hex(RC) <<" ";
+        std::cout<<"RD=" << integer_as_hex(RD) <<" ";
+        std::cout<<"RE=" << integer_as_hex(RE) <<" ";
+        std::cout<<"RF=" << integer_as_hex(RF) <<" ";
+        std::cout<<"  SP=" << integer_as_hex(SP) <<" ";
+        std::cout<<"SR=" << integer_as_hex(SR) <<" ";
+        std::cout<<"PC=" << integer_as_hex(PC) <<" ";
+    }
+
+    // the register of an operand encoding, by a table rather than a switch: it is looked up for most instructions.
+    Word* getRegister(int operand)
+    {
+        Word RegisterFile::* member = unsigned(operand)<REGISTER_OPERANDS ? REGISTERS[operand] : nullptr;
+        return member ? &(this->*member) : nullptr;
+    }
+
+private:
+    static constexpr unsigned REGISTER_OPERANDS = 0x20;
+    static constexpr Word RegisterFile::* REGISTERS[REGISTER_OPERANDS] = {
+        &RegisterFile::RA, &RegisterFile::RB, &RegisterFile::RC, &RegisterFile::RD, &RegisterFile::RE, &RegisterFile::RF,
+        nullptr, nullptr, nullptr, nullptr, nullptr, nullptr, nullptr, nullptr, nullptr, nullptr,
+        &RegisterFile::SP,     // 0x10
+    };
+    static_assert( int(Register::RF)==5 && int(Register::SP)==0x10 );
+};
+
+// the I/O devices of a machine. on a multi-core machine, its cores call them one at a time. by default, KBD reads a word from std::cin, DPL and DSP write to std::cout, and errors
+// of instructions are written to std::cout.
+struct MachineIO
+{
+    std::function<std::string()>            input = []{ std::string line; std::cin >> line; return line; };   // KBD
+    std::function<void(std::string_view)>   output = [](std::string_view text){ std::cout << text; };     // DPL, DSP
+    std::function<void(std::string_view)>   error = [](std::string_view message){ std::cout << message << std::endl; };
+    std::shared_ptr<FileDevice>             file;       // FOP, FMP, FAV, FFL; without one, they fail
+};
+
+// what a core has run, counted when Machine::set_counting() is on, see stats.h.
+// the runs of the instructions of the loaded code are counted by the entries of their blocks, see CodeBlocks, and the
+// opcodes are derived from them by Machine::counters().
+struct MachineCounters
+{
+    uint64_t    opcodes[256] = {};      // executions, by opcode
+    uint64_t    taken = 0;              // conditional jumps
+    uint64_t    notTaken = 0;
+    int         callDepth = 0;          // calls not returned from
+    int         maxCallDepth = 0;
+    // what the opcodes do not tell of the RAM bytes the instructions move: the instructions with a wide operand, of 8
+    // bytes, and the bytes of the ranges of block instructions, whole, also of BCM and BSC, which can stop early.
+    uint64_t    wideInstructions = 0;
+    uint64_t    blockReadBytes = 0;
+    uint64_t    blockWrittenBytes = 0;
+};
+
+// op applied to each byte of a and b on its own, as unsigned.
+template<class Word, class Op>
+Word packed_bytes(Word a, Word b, Op op)
+{
+    uint32_t result = 0;
+    for(size_t i=0; i<sizeof(Word); ++i)
+        result |= uint32_t(op(uint8_t(uint32_t(a) >> (8*i)), uint8_t(uint32_t(b) >> (8*i)))) << (8*i);
+    return Word(result);
+}
+
+// block instruction reg1, reg2, reg3 on the reg3 bytes at [reg1], see BlockOperand; also FMP, which maps the window of
+// the file device there. addresses and count are unsigned.
+// return true to halt, if an operand is not a register or a range is not in RAM.
+template<class Word>
+bool run_block_instruction(Opcode opc, int operand1, BlockOperand block, RegisterFile<Word>& regs, RAM<Word>& ram, MachineIO& io)
+{
+    using UWord = std::make_unsigned_t<Word>;
+    Word* reg1 = regs.getRegister(operand1);
+    Word* reg2 = regs.getRegister(block.reg);
+    Word* reg3 = regs.getRegister(block.count);
+    if( !reg1 || !reg2 || !reg3 )
+    {
+        io.error("Error: invalid register of block instruction @" + integer_as_hex(regs.PC));
+        return true;
+    }
+    int count = int(UWord(*reg3));
+    BYTE* first = ram.access_block(int(UWord(*reg1)), count);
+    BYTE* second = (opc==Opcode::BCP || opc==Opcode::BCM) ? ram.access_block(int(UWord(*reg2)), count) : first;
+    if( !first || !second )
+    {
+        io.error("Error: block exceeds simulator ram limit @" + integer_as_hex(regs.PC));
+        return true;
+    }
+    switch(opc)
+    {
+        case Opcode::BFL:
+            memset(first, (unsigned char)*reg2, count);
+            break;
+        case Opcode::BCP:
+            memmove(first, second, count);  // the ranges may overlap
+            break;
+        case Opcode::BCM:
+        {
+            // as CMP of the first different bytes, compared as unsigned
+            int result = memcmp(first, second, count);
+            regs.SR = result==0 ? SR_ZERO : result<0 ? (SR_NEGATIVE | SR_CARRY) : 0;
+            break;
+        }
+        case Opcode::BSC:
+        {
+            // reg1 <- address of the first byte equal to reg2, Z=1; or the end of the block, Z=0.
+            const void* found = memchr(first, (unsigned char)*reg2, count);
+            *reg1 = Word(uint32_t(*reg1) + uint32_t(found ? static_cast<const BYTE*>(found) - first : count));
+            regs.SR = found ? SR_ZERO : 0;
+            break;
+        }
+        case Opcode::FMP:
+            // reg2 <- bytes of the file in the window, or -1.
+            *reg2 = io.file ? Word(io.file->map(first, uint32_t(count))) : Word(-1);
+            break;
+        default:
+            break;
+    }
+    regs.PC += 4;
+    return false;
+}
+
+// CAS reg1, reg2, reg3: if the short at [reg1] is reg2, store reg3 there, atomically. reg2 gets the short that was
+// at [reg1]; SR is SR_ZERO if it was swapped, else 0. return true to halt, on invalid operands.
+template<class Word>
+bool run_compare_and_swap(int operand1, BlockOperand block, RegisterFile<Word>& regs, RAM<Word>& ram, MachineIO& io)
+{
+    using UWord = std::make_unsigned_t<Word>;
+    Word* reg1 = regs.getRegister(operand1);
+    Word* reg2 = regs.getRegister(block.reg);
+    Word* reg3 = regs.getRegister(block.count);
+    short* p = reg1 ? ram.access_atomic_short(int(UWord(*reg1))) : nullptr;
+    if( !p || !reg2 || !reg3 )
+    {
+        io.error("Error: invalid operand of CAS @" + integer_as_hex(regs.PC));
+        return true;
+    }
+    short expected = short(*reg2);
+    bool swapped = __atomic_compare_exchange_n(p, &expected, short(*reg3), false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    *reg2 = expected;
+    regs.SR = swapped ? SR_ZERO : 0;
+    regs.PC += 4;
+    return false;
+}
+
+// run the instruction at regs.PC, whose first word is instruction. return true to halt, also with an error if the
+// instruction cannot run: it is not an instruction, an operand is not a register, a memory access or the stack is out
+// of RAM, or it divides by 0. so no program can fault the host.
+// arithmetic wraps around at the Word size.
+// it is inlined into the loops of Machine, so that an instruction costs no call: the speed of the loop was up to 25%
+// apart between builds of the same code, as the call and the dispatch after it moved across cache lines.
+template<class Word>
+inline __attribute__((always_inline)) bool run_instruction(Instruction instruction, RegisterFile<Word>& regs, RAM<Word>& ram, MachineIO& io)
+{
+    using UWord = std::make_unsigned_t<Word>;
+    auto fault = [&](const char* what){
+        io.error(std::string("Error: ") + what + " @" + integer_as_hex(regs.PC));
+        return true;
+    };
+    if( instruction==INVALID_INSTRUCTION )
+        return fault("invalid instruction");
+    int opcode = instruction >> 24;
+    int flag = (instruction >> 23) & 0x0001;
+    int operand1 = (instruction >> 16) & 0x7F;
+    int operand2 = instruction & 0xffff;
+    Opcode opc = (Opcode)opcode;
+    if( opc==Opcode::BFL || opc==Opcode::BCP || opc==Opcode::BCM || opc==Opcode::BSC || opc==Opcode::FMP )
+        return run_block_instruction(opc, operand1, BlockOperand::decode(operand2), regs, ram, io);
+    if( opc==Opcode::CAS )
+        return run_compare_and_swap(operand1, BlockOperand::decode(operand2), regs, ram, io);
+    Word num = short(operand2);
+    Word size = 4;      // of the instruction
+    if constexpr( MachineTraits<Word>::WIDE )
+    {
+        if( operand1 & WIDE_OPERAND )
+        {
+            operand1 &= ~WIDE_OPERAND;
+            if( !ram.access_block(int(UWord(regs.PC)) + 4, 4) )
+                return fault("invalid instruction");
+            num = Word(ram.fetch_instruction(int(UWord(regs.PC)) + 4));
+            size = 8;
+        }
+    }
+    Word* reg1 = regs.getRegister(operand1);
+    Word* reg2 = nullptr;
+    IndexedOperand index{};
+    ConditionalOperand conditional{};
+    if( opc==Opcode::CMV )
+    {
+        conditional = ConditionalOperand::decode(operand2);    // cc, and reg or num
+        operand2 = conditional.value;
+        num = conditional.value;
+    }
+    if( flag==0 )
+    {
+        if( opc==Opcode::LDB || opc==Opcode::STB || opc==Opcode::LDS || opc==Opcode::STS || opc==Opcode::LDW || opc==Opcode::STW || opc==Opcode::FAD || opc==Opcode::FOP )
+            index = IndexedOperand::decode(operand2);   // [reg], [reg+imm] or [reg+]
+        else
+            index.reg = operand2;
+        reg2 = regs.getRegister(index.reg);
+        if( !reg2 )
+            return fault("invalid register");
+        num = *reg2;
+    }
+    if( !reg1 )
+        return fault("invalid register");
+    // the address of a load or store of size bytes; [reg+] increases reg after taking the address.
+    // the lambdas are inlined like run_instruction, so that the operands stay in registers.
+    auto address = [&](int size) __attribute__((always_inline)) -> int {
+        if( flag )
+            return int(UWord(num));
+        if( index.postIncrement )
+            *reg2 += size;
+        return int(UWord(Word(num + index.offset)));
+    };
+    // the size bytes of a load or store; nullptr if they are not in RAM.
+    auto memory = [&](int size) __attribute__((always_inline)) {
+        return ram.access_block(address(size), size);
+    };
+    // the Word of the stack at sp; nullptr if it is not in RAM.
+    auto stack = [&](Word sp) __attribute__((always_inline)) {
+        return reinterpret_cast<Word*>(ram.access_block(int(UWord(sp)), int(sizeof(Word))));
+    };
+    uint16_t cmp_result;
+    Condition condition;
+    switch(opc)
+    {
+        case Opcode::MOV:
+            *reg1 = num;  // perform move
+            break;
+        case Opcode::LDB:
+        {
+            BYTE* p = memory(1);
+            if( !p )
+                return fault("invalid address of LDB");
+            *reg1 = *p;  // perform load from [reg] to reg
+            break;
+        }
+        case Opcode::STB:
+        {
+            BYTE* p = memory(1);
+            if( !p )
+                return fault("invalid address of STB");
+            *p = (char)*reg1;  // store to mem
+            break;
+        }
+        case Opcode::LDS:
+        {
+            short* p = reinterpret_cast<short*>(memory(2));
+            if( !p )
+                return fault("invalid address of LDS");
+            *reg1 = *p;
+            break;
+        }
+        case Opcode::STS:
+        {
+            short* p = reinterpret_cast<short*>(memory(2));
+            if( !p )
+                return fault("invalid address of STS");
+            *p = short(*reg1);
+            break;
+        }
+        case Opcode::LDW:
+        {
+            Word* p = reinterpret_cast<Word*>(memory(int(sizeof(Word))));
+            if( !p )
+                return fault("invalid address of LDW");
+            *reg1 = *p;
+            break;
+        }
+        case Opcode::STW:
+        {
+            Word* p = reinterpret_cast<Word*>(memory(int(sizeof(Word))));
+            if( !p )
+                return fault("invalid address of STW");
+            *p = *reg1;
+            break;
+        }
+
+        case Opcode::ADD:
+            *reg1 = Word(uint32_t(*reg1) + uint32_t(num));
+            break;
+        case Opcode::SUB:
+            *reg1 = Word(uint32_t(*reg1) - uint32_t(num));
+            break;
+        case Opcode::MUL:
+            *reg1 = Word(uint32_t(*reg1) * uint32_t(num));
+            break;
+        case Opcode::DIV:
+            // in 64 bits, so that the most negative Word / -1 wraps around instead of trapping
+            if( num==0 )
+                return fault("division by 0");
+            *reg1 = Word(int64_t(*reg1) / num);
+            break;
+        case Opcode::MOD:
+            if( num==0 )
+                return fault("division by 0");
+            *reg1 = Word(int64_t(*reg1) % num);
+            break;
+        case Opcode::INC:
+            *reg2 = Word(uint32_t(*reg2) + 1);
+            break;
+        case Opcode::DEC:
+            *reg2 = Word(uint32_t(*reg2) - 1);
+            break;
+
+        case Opcode::AND:
+            *reg1 &= num;
+            break;
+        case Opcode::OR_:
+            *reg1 |= num;
+            break;
+        case Opcode::XOR:
+            *reg1 ^= num;
+            break;
+        case Opcode::NOT:
+            (*reg2) = ~(*reg2);
+            break;
+        // a count out of 0..BITS-1, also a negative one, shifts all bits out: SHL gives 0, SHR the sign, 0 or -1
+        case Opcode::SHL:
+            *reg1 = uint32_t(num)<uint32_t(MachineTraits<Word>::BITS) ? Word(uint32_t(*reg1) << num) : Word(0);
+            break;
+        case Opcode::SHR:
+            *reg1 = Word(*reg1 >> std::min(uint32_t(num), uint32_t(MachineTraits<Word>::BITS - 1)));
+            break;
+
+        case Opcode::CMP:
+            if (*reg1 < num)
+                cmp_result = SR_NEGATIVE;
+            else if (*reg1 == num)
+                cmp_result = SR_ZERO;
+            else
+                cmp_result = 0x00;
+            if (UWord(*reg1) < UWord(num))
+                cmp_result |= SR_CARRY;
+            regs.SR = cmp_result;
+            break;
+        case Opcode::CMV:
+            if (condition_holds(conditional.condition, uint16_t(regs.SR)))
+                *reg1 = num;
+            break;
+
+        case Opcode::PAB:
+            *reg1 = packed_bytes(*reg1, num, [](uint8_t a, uint8_t b){ return uint8_t(a + b); });
+            break;
+        case Opcode::PSB:
+            *reg1 = packed_bytes(*reg1, num, [](uint8_t a, uint8_t b){ return uint8_t(a - b); });
+            break;
+        case Opcode::PCE:
+            *reg1 = packed_bytes(*reg1, num, [](uint8_t a, uint8_t b){ return uint8_t(a == b ? 0xff : 0); });
+            break;
+        case Opcode::PCB:
+            *reg1 = packed_bytes(*reg1, num, [](uint8_t a, uint8_t b){ return uint8_t(a < b ? 0xff : 0); });
+            break;
+        case Opcode::PHB:
+        {
+            uint8_t target = uint8_t(num);
+            bool found = false;
+            for(size_t i=0; i<sizeof(Word); ++i)
+                found = found || uint8_t(uint32_t(*reg1) >> (8*i))==target;
+            regs.SR = found ? SR_ZERO : 0;
+            break;
+        }
+        case Opcode::BSW:
+        {
+            // the 2 bytes of the short in reg, so that a short loaded by LDS is swapped on both machines.
+            uint16_t value = uint16_t(*reg2);
+            *reg2 = short(uint16_t((value >> 8) | (value << 8)));
+            break;
+        }
+
+        case Opcode::JMP:
+            regs.PC = num;
+            return false;   // control flow instruction
+        case Opcode::JPE:
+        case Opcode::JPL:
+        case Opcode::JPG:
+        case Opcode::JNE:
+        case Opcode::JLE:
+        case Opcode::JGE:
+        case Opcode::JPB:
+        case Opcode::JBE:
+        case Opcode::JPA:
+        case Opcode::JAE:
+            // conditional jump
+            jump_condition(opc, condition);
+            if( condition_holds(condition, uint16_t(regs.SR)) )
+                regs.PC = num;
+            else
+                regs.PC += size;
+            return false;   // control flow instruction
+
+        case Opcode::CLL:
+        {
+            Word* top = stack(Word(regs.SP - Word(sizeof(Word))));
+            if( !top )
+                return fault("stack exceeds simulator ram limit");
+            regs.SP -= sizeof(Word);
+            *top = regs.PC+size;
+            regs.PC = num;
+            return false;   // control flow instruction
+        }
+        case Opcode::RET:
+        {
+            Word* top = stack(regs.SP);
+            if( !top )
+                return fault("stack exceeds simulator ram limit");
+            regs.PC = *top;
+            regs.SP += sizeof(Word);
+            return false;   // control flow instruction
+        }
+        case Opcode::HLT:
+            return true;
+
+        case Opcode::PSH:
+        {
+            Word* top = stack(Word(regs.SP - Word(sizeof(Word))));
+            if( !top )
+                return fault("stack exceeds simulator ram limit");
+            regs.SP -= sizeof(Word);
+            *top = num;
+            break;
+        }
+        case Opcode::POP:
+        {
+            Word* top = stack(regs.SP);
+            if( !top )
+                return fault("stack exceeds simulator ram limit");
+            *reg2 = *top;
+            regs.SP += sizeof(Word);
+            break;
+        }
+
+        case Opcode::KBD:
+        {
+            std::string kbd_input = io.input();
+            // the input area runs to the end of RAM on the 16-bit machine; longer input is cut.
+            int length = int(std::min<size_t>(kbd_input.length(), std::min<size_t>(ram.size() - INPUT_START - 2, 0x7FFF)));
+            *ram.access_short(INPUT_START) = length;
+            std::copy(kbd_input.begin(), kbd_input.begin() + length, ram.access_byte(INPUT_START + 2));
+            break;
+        }
+        case Opcode::DSP:
+        {
+            std::string display;
+            display.reserve(25*81);
+            for(int i=0; i<25; ++i)
+            {
+                display.append(ram.access_byte(DISPLAY_START + i*80), 80);
+                display += '\n';
+            }
+            io.output(display);
+            break;
+        }
+        case Opcode::FAD:
+        {
+            // atomically add reg1 to the short at mem; reg1 gets the short before the add.
+            short* p = ram.access_atomic_short(address(2));
+            if( !p )
+            {
+                io.error("Error: invalid address of FAD @" + integer_as_hex(regs.PC));
+                return true;
+            }
+            *reg1 = __atomic_fetch_add(p, short(*reg1), __ATOMIC_SEQ_CST);
+            break;
+        }
+        case Opcode::CID:
+            *reg2 = regs.ID;
+            break;
+        case Opcode::DPL:
+        {
+            int loc = int(UWord(num));
+            BYTE* count = ram.access_block(loc, 2);
+            short length = count ? *reinterpret_cast<short*>(count) : short(-1);
+            BYTE* s = length>=0 ? ram.access_block(loc+2, length) : nullptr;
+            if( !s )
+                return fault("invalid xstring of DPL");
+            io.output(std::string_view(s, size_t(length)));
+            break;
+        }
+        case Opcode::FOP:
+        {
+            // reg1 <- 0 if the file named by the xstring at mem is open, else -1; it is created if reg1 is not 0.
+            int loc = address(2);
+            BYTE* count = ram.access_block(loc, 2);
+            int length = count ? std::max<int>(*reinterpret_cast<short*>(count), 0) : 0;
+            BYTE* name = count ? ram.access_block(loc+2, length) : nullptr;
+            *reg1 = io.file && name && io.file->open(std::string_view(name, length), *reg1!=0) ? 0 : -1;
+            break;
+        }
+        case Opcode::FAV:
+            // reg <- bytes of the file in the window, or -1.
+            *reg2 = io.file ? Word(io.file->advance(uint64_t(UWord(*reg2)))) : Word(-1);
+            break;
+        case Opcode::FFL:
+            *reg2 = io.file ? Word(io.file->flush(uint32_t(UWord(*reg2)))) : Word(-1);
+            break;
+
+        // run before the switch
+        case Opcode::BFL:
+        case Opcode::BCP:
+        case Opcode::BCM:
+        case Opcode::BSC:
+        case Opcode::FMP:
+        case Opcode::CAS:
+            assert(false);
+            return fault("invalid instruction");
+    }
+    regs.PC += size;
+    return false;
+}
+
+// a XIE machine of Word, with its RAM, cores and I/O: load a program, then step or run it.
+// A multi-core machine runs the same program on each core, from the start of the code, each core with its own registers
+// and stack (see MachineTraits::core_stack) and its id in ID; run() runs each core on a host thread of its own.
+// Memory ordering: CAS and FAD are atomic and sequentially consistent, and are full fences for the loads and stores of
+// their core. Plain loads and stores are not ordered between cores; one core sees the stores of another in any order,
+// until both have run an atomic instruction since. so a store that other cores wait for should be an atomic one.
+template<class Word>
+class Machine
+{
+public:
+    using Traits = MachineTraits<Word>;
+
+    MachineIO   io;
+
+    // a machine of cores, 1 to Traits::MAX_CORES.
+    explicit Machine(int cores = 1) : ram_(Traits::RAM_SIZE), cores_(std::clamp(cores, 1, Traits::MAX_CORES)) { reset(); }
+
+    // boot state: RAM is 0 but for a blank display, registers are 0, PC is at the code and SP at the stack bottom; the
+    // file device has no file open, and no window in RAM.
+    void reset()
+    {
+        ram_.clear();
+        std::fill(ram_.access_byte(DISPLAY_START), ram_.access_byte(DISPLAY_START + 25*80), ' ');
+        for(size_t i=0; i<cores_.size(); ++i)
+        {
+            Core& core = cores_[i];
+            core.regs = RegisterFile<Word>{};
+            core.regs.PC = MACHINE_CODE_START;
+            core.regs.SP = Word(Traits::core_stack(int(i)));
+            core.regs.ID = Word(i);
+            core.halted = false;
+            core.instructions = 0;
+            core.counters = MachineCounters{};
+            core.blockEntries.clear();
+        }
+        codeSize_ = 0;
+        blocks_ = CodeBlocks();
+        if( io.file )
+            io.file->reset();
+    }
+
+    // reset, then load a program file as written by xasm: raw machine code, or an image of this machine's word size.
+    // return false with a description in error if the program cannot be loaded.
+    bool load(std::string_view program, std::string& error)
+    {
+        reset();
+        std::vector<ImageSegment> segments;
+        int bits = image_bits(program);
+        if( bits==0 )
+            segments.push_back({uint32_t(MACHINE_CODE_START), std::string(program)});
+        else if( bits!=Traits::BITS )
+        {
+            error = "program is for the " + std::to_string(bits) + "-bit machine";
+            return false;
+        }
+        else if( !parse_image(program, segments) )
+        {
+            error = "invalid program image";
+            return false;
+        }
+        for(const ImageSegment& segment : segments)
+        {
+            BYTE* target = ram_.access_block(int(segment.address), int(segment.bytes.size()));
+            if( !target )
+            {
+                error = "File length exceeds simulator ram limit";
+                return false;
+            }
+            std::copy(segment.bytes.begin(), segment.bytes.end(), target);
+            if( segment.address==uint32_t(MACHINE_CODE_START) )
+                codeSize_ = segment.bytes.size();
+        }
+        if( counting_ )
+            find_blocks();
+        return true;
+    }
+
+    // run the instruction at PC of core. return false if the core is halted, by this instruction or before.
+    bool step(int core)
+    {
+        Core& c = cores_[core];
+        if( c.halted )
+            return false;
+        Word pc = c.regs.PC;
+        Instruction instruction = ram_.fetch_instruction(int(std::make_unsigned_t<Word>(pc)));
+        uint32_t blockBytes = counting_ ? block_bytes(c, instruction) : 0;
+        c.halted = run_instruction(instruction, c.regs, ram_, io);
+        ++ c.instructions;
+        if( counting_ )
+            count(c, instruction, pc, blockBytes);
+        return !c.halted;
+    }
+
+    // run an instruction on each running core, in the order of the cores. return false if the machine is halted.
+    bool step()
+    {
+        for(int core=0; core<cores(); ++core)
+            step(core);
+        return !halted();
+    }
+
+    // run up to count instructions on each core, or until the machine halts. return the number of instructions run.
+    uint64_t run(uint64_t count = UINT64_MAX)
+    {
+        if( cores_.size()==1 )
+            return run_core(cores_[0], count, io);
+
+        // the cores take turns on the I/O devices
+        std::mutex ioMutex;
+        MachineIO shared;
+        shared.input = [&]{ std::lock_guard<std::mutex> lock(ioMutex); return io.input(); };
+        shared.output = [&](std::string_view text){ std::lock_guard<std::mutex> lock(ioMutex); io.output(text); };
+        shared.error = [&](std::string_view message){ std::lock_guard<std::mutex> lock(ioMutex); io.error(message); };
+        shared.file = io.file;      // locks itself
+        std::vector<uint64_t> counts(cores_.size());
+        std::vector<std::thread> threads;
+        for(size_t i=1; i<cores_.size(); ++i)
+            threads.emplace_back([&, i]{ counts[i] = run_core(cores_[i], count, shared); });
+        counts[0] = run_core(cores_[0], count, shared);
+        for(auto& thread : threads)
+            thread.join();
+        uint64_t n = 0;
+        for(uint64_t c : counts)
+            n += c;
+        return n;
+    }
+
+    // true when all cores are halted.
+    bool                    halted() const      { return std::all_of(cores_.begin(), cores_.end(), [](const Core& c){ return c.halted; }); }
+    bool                    halted(int core) const { return cores_[core].halted; }
+    void                    set_halted(int core, bool halted) { cores_[core].halted = halted; }   // e.g. to restore a state of a core
+    int                     cores() const       { return int(cores_.size()); }
+    size_t                  codeSize() const    { return codeSize_; }   // bytes of machine code of the loaded program
+    // count what the cores run from now on, in counters(); it costs a count per block of the loaded code that is run,
+    // see CodeBlocks, and a count per instruction out of them and in blocks with a block instruction, whose ranges are
+    // counted. the counts are cleared by a reset.
+    void set_counting(bool counting)
+    {
+        counting_ = counting;
+        if( counting_ && blocks_.slots.size()!=codeSize_/4 )
+            find_blocks();
+    }
+
+    // what core has run while counting was on.
+    MachineCounters counters(int core = 0) const
+    {
+        const Core& c = cores_[core];
+        MachineCounters counters = c.counters;
+        if( c.blockEntries.empty() )
+            return counters;
+        std::vector<uint64_t> runs = blocks_.execution_counts(c.blockEntries);
+        for(size_t slot=0; slot<runs.size(); ++slot)
+        {
+            counters.opcodes[uint8_t(blocks_.slots[slot].opcode)] += runs[slot];
+            counters.wideInstructions += blocks_.slots[slot].size==8 ? runs[slot] : 0;
+        }
+        return counters;
+    }
+    // instructions core has run since the reset. during an instruction, e.g. in io, the instructions run before it.
+    uint64_t                instructions(int core = 0) const { return cores_[core].instructions; }
+
+    RegisterFile<Word>&     registers(int core = 0) { return cores_[core].regs; }
+    RAM<Word>&              ram()               { return ram_; }
+
+    // a register of core 0 by its operand encoding; nullptr for PC and SR, see registers().
+    Word*                   reg(Register r)     { return cores_[0].regs.getRegister(int(r)); }
+
+    // copy size bytes from or to RAM at loc. false, without copying, if they are not all in RAM.
+    bool read(int loc, void* bytes, int size)
+    {
+        BYTE* p = ram_.access_block(loc, size);
+        if( p )
+            std::memcpy(bytes, p, size);
+        return p!=nullptr;
+    }
+    bool write(int loc, const void* bytes, int size)
+    {
+        BYTE* p = ram_.access_block(loc, size);
+        if( p )
+            std::memcpy(p, bytes, size);
+        return p!=nullptr;
+    }
+
+private:
+    struct Core
+    {
+        RegisterFile<Word>  regs{};
+        bool                halted = false;
+        uint64_t            instructions = 0;
+        MachineCounters     counters;
+        std::vector<uint64_t> blockEntries;     // by slot of blocks_: runs of its block from there, when counting
+    };
+
+    // how run_counting() runs from a slot of blocks_: the instructions to the end of its block, and what its last one is.
+    // remaining is 0 for an instruction that is counted on its own: not an instruction, or a block instruction is in
+    // the rest of its block.
+    struct BlockRun
+    {
+        enum End : uint8_t { OTHER, CONDITIONAL, CALL, RETURN };
+        uint32_t    remaining = 0;
+        uint32_t    fallThrough = 0;    // address after the last instruction
+        End         end = OTHER;
+    };
+
+    // find the blocks of the loaded code for counting, and which of them are counted an instruction at a time.
+    void find_blocks()
+    {
+        blocks_ = CodeBlocks(reinterpret_cast<const char*>(ram_.access_byte(MACHINE_CODE_START)), uint32_t(MACHINE_CODE_START),
+                             codeSize_, Traits::WIDE);
+        blockRuns_.assign(blocks_.slots.size(), BlockRun{});
+        bool blockInstruction = false;      // from the slot to the end of its block
+        for(size_t slot=blocks_.slots.size(); slot-- > 0; )
+        {
+            const CodeBlocks::Slot& s = blocks_.slots[slot];
+            if( !s.instruction )
+                continue;
+            if( s.last==slot )
+                blockInstruction = false;
+            blockInstruction = blockInstruction || (s.opcode>=Opcode::BFL && s.opcode<=Opcode::BSC);
+            if( blockInstruction )
+                continue;
+            const CodeBlocks::Slot& last = blocks_.slots[s.last];
+            BlockRun& run = blockRuns_[slot];
+            run.remaining = s.remaining;
+            run.fallThrough = last.fallThrough;
+            run.end = last.conditional ? BlockRun::CONDITIONAL : last.opcode==Opcode::CLL ? BlockRun::CALL
+                    : last.opcode==Opcode::RET ? BlockRun::RETURN : BlockRun::OTHER;
+        }
+        for(Core& core : cores_)
+            core.blockEntries.assign(blocks_.slots.size(), 0);
+    }
+
+    // the range of a block instruction, from its count register before it runs; 0 for other instructions.
+    static uint32_t block_bytes(Core& core, Instruction instruction)
+    {
+        Opcode opc = Opcode(instruction >> 24);
+        if( opc<Opcode::BFL || opc>Opcode::BSC )
+            return 0;
+        Word* count = core.regs.getRegister(BlockOperand::decode(instruction & 0xffff).count);
+        return count ? uint32_t(std::make_unsigned_t<Word>(*count)) : 0;
+    }
+
+    // count instruction, which ran at pc; blockBytes is its range if it is a block instruction.
+    static void count(Core& core, Instruction instruction, Word pc, uint32_t blockBytes)
+    {
+        Opcode opc = Opcode(instruction >> 24);
+        MachineCounters& c = core.counters;
+        ++ c.opcodes[uint8_t(opc)];
+        bool wide = Traits::WIDE && ((instruction >> 16) & WIDE_OPERAND);
+        c.wideInstructions += wide;
+        Condition condition;
+        if( jump_condition(opc, condition) )
+            ++ (core.regs.PC==Word(pc + (wide ? 8 : 4)) ? c.notTaken : c.taken);
+        else if( opc==Opcode::CLL )
+            c.maxCallDepth = std::max(c.maxCallDepth, ++ c.callDepth);
+        else if( opc==Opcode::RET )
+            -- c.callDepth;
+        else if( blockBytes )
+        {
+            c.blockReadBytes += opc==Opcode::BFL ? 0 : opc==Opcode::BCM ? 2*uint64_t(blockBytes) : blockBytes;
+            c.blockWrittenBytes += opc==Opcode::BFL || opc==Opcode::BCP ? blockBytes : 0;
+        }
+    }
+
+    uint64_t run_core(Core& core, uint64_t count, MachineIO& coreIO)
+    {
+        return counting_ ? run_counting(core, count, coreIO) : run_instructions(core, count, coreIO);
+    }
+
+    __attribute__((noinline)) uint64_t run_instructions(Core& core, uint64_t count, MachineIO& coreIO)
+    {
+        // count in n, and store it for the I/O to read: incrementing core.instructions would load it again after
+        // each store to RAM, which could alias it.
+        const uint64_t start = core.instructions;
+        uint64_t n = 0;
+        while( n<count && !core.halted )
+        {
+            core.instructions = start + n;
+            Instruction instruction = ram_.fetch_instruction(int(std::make_unsigned_t<Word>(core.regs.PC)));
+            core.halted = run_instruction(instruction, core.regs, ram_, coreIO);
+            ++ n;
+        }
+        core.instructions = start + n;
+        return n;
+    }
+
+    // run the instruction at PC of core, and count it.
+    __attribute__((noinline)) void run_counted(Core& core, MachineIO& coreIO)
+    {
+        Word pc = core.regs.PC;
+        Instruction instruction = ram_.fetch_instruction(int(std::make_unsigned_t<Word>(pc)));
+        uint32_t blockBytes = block_bytes(core, instruction);
+        core.halted = run_instruction(instruction, core.regs, ram_, coreIO);
+        ++ core.instructions;
+        count(core, instruction, pc, blockBytes);
+    }
+
+    // run_instructions(), counting: a block of the loaded code is run by run_instructions() and counted by its entry,
+    // and by what its last instruction did; other instructions are counted one at a time.
+    uint64_t run_counting(Core& core, uint64_t count, MachineIO& coreIO)
+    {
+        MachineCounters& c = core.counters;
+        const BlockRun* runs = blockRuns_.data();
+        const size_t slots = blockRuns_.size();
+        uint64_t* entries = core.blockEntries.data();
+        uint64_t n = 0;
+        while( n<count && !core.halted )
+        {
+            Word pc = core.regs.PC;
+            uint32_t offset = uint32_t(std::make_unsigned_t<Word>(pc)) - uint32_t(MACHINE_CODE_START);
+            uint32_t slot = offset/4;
+            if( offset%4 || slot>=slots || runs[slot].remaining==0 )
+            {
+                run_counted(core, coreIO);
+                ++ n;
+                continue;
+            }
+            const BlockRun& run = runs[slot];
+            uint64_t ran = run_instructions(core, std::min<uint64_t>(run.remaining, count - n), coreIO);
+            n += ran;
+            if( ran<run.remaining )
+            {
+                // stopped in the block, by count or a fault: count what it ran of it
+                for(uint32_t s=slot; ran>0; --ran, s += blocks_.slots[s].size/4)
+                {
+                    ++ c.opcodes[uint8_t(blocks_.slots[s].opcode)];
+                    c.wideInstructions += blocks_.slots[s].size==8;
+                }
+                continue;
+            }
+            ++ entries[slot];
+            if( run.end==BlockRun::CONDITIONAL )
+                ++ (core.regs.PC==Word(run.fallThrough) ? c.notTaken : c.taken);
+            else if( run.end==BlockRun::CALL )
+                c.maxCallDepth = std::max(c.maxCallDepth, ++ c.callDepth);
+            else if( run.end==BlockRun::RETURN )
+                -- c.callDepth;
+        }
+        return n;
+    }
+
+    RAM<Word>               ram_;
+    std::vector<Core>       cores_;
+    size_t                  codeSize_ = 0;
+    bool                    counting_ = false;
+    CodeBlocks              blocks_;            // of the loaded code, when counting
+    std::vector<BlockRun>   blockRuns_;         // by slot of blocks_
+};
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// number of threads the host can run concurrently, at least 1.
+inline unsigned hardware_threads()
+{
+    unsigned n = std::thread::hardware_concurrency();
+    return n ? n : 1;
+}
+
+// call fo(i) for every i in [0, count), on up to `threads` threads including the calling thread.
+// indices are handed out in increasing order, but calls on different threads run concurrently, so fo must only
+// touch state that belongs to index i (or is read-only).
+// if fo throws, the remaining indices are skipped and the first exception is rethrown on the calling thread.
+template<class FO>
+void parallel_for(size_t count, unsigned threads, FO fo)
+{
+    if( threads<=1 || count<=1 )
+    {
+        for(size_t i=0; i<count; ++i)
+            fo(i);
+        return;
+    }
+
+    std::atomic<size_t> next{0};
+    std::mutex failureMutex;
+    std::exception_ptr failure;
+    auto worker = [&](){
+        try
+        {
+            for(size_t i = next++; i<count; i = next++)
+                fo(i);
+        }
+        catch(...)
+        {
+            next = count;
+            std::lock_guard<std::mutex> lock(failureMutex);
+            if( !failure )
+                failure = std::current_exception();
+        }
+    };
+    std::vector<std::thread> pool;
+    size_t extra = std::min<size_t>(threads, count) - 1;
+    for(size_t t=0; t<extra; ++t)
+        pool.emplace_back(worker);
+    worker();
+    for(auto& thread : pool)
+        thread.join();
+    if( failure )
+        std::rethrow_exception(failure);
+}
@@ -3,45 +3,174 @@
 #include <iostream>
 #include <iomanip>
 #include <fstream>
+#include <sstream>
 #include <vector>
 #include <filesystem>
+#include <random>
+#include <atomic>
+#include <charconv>
+#include <new>
 
 #include "ref.h"
+#include "lexer.h"
+#include "parallel.h"
+#include "source_buffer.h"
 
-struct SourceFile;
+// The loaded source tree is kept compact: the contents of every file stay in its (memory-mapped) SourceBuffer, lines
+// and tokens are offset/size spans into that buffer, and all of them are stored in flat arrays of SourceFile. An
+// #include line refers to the included file by its index, so the nesting of files is an index tree.
+// CodeLine is a light view of one line that is made on demand, see for_each_line().
+
+// a token of a line, as a span of the file buffer.
+struct TokenSpan
+{
+    static constexpr uint32_t MAX_SIZE = (1u<<24) - 1;
+    
+    uint32_t    offset;         // in the file buffer
+    uint32_t    size : 24;
+    uint32_t    kind : 8;       // TokenKind
+};
+
+struct SourceLine
+{
+    uint32_t    offset;         // verbatim text of the line, in the file buffer
+    uint32_t    size;
+    uint32_t    firstToken;     // comment-removed tokens, in SourceFile::tokens; an #include line has no tokens.
+    uint32_t    tokenCount;
+    int32_t     inclusion;      // if this is #include, index of the included file in SourceFile::files; otherwise -1.
+};
+
+// the tokens of a CodeLine.
+class TokenList
+{
+public:
+    TokenList() = default;
+    TokenList(const TokenSpan* spans, size_t count, const char* base) : spans_(spans), count_(count), base_(base) {}
+    
+    size_t  size() const    { return count_; }
+    bool    empty() const   { return count_==0; }
+    Token   front() const   { return (*this)[0]; }
+    Token   operator[](size_t i) const
+    {
+        const TokenSpan& span = spans_[i];
+        return { TokenKind(span.kind), std::string_view(base_+span.offset, span.size) };
+    }
+    
+private:
+    const TokenSpan*    spans_ = nullptr;
+    size_t              count_ = 0;
+    const char*         base_ = nullptr;
+};
 
 struct CodeLine
 {
-    int                         number;         // line number in the file
-    std::string                 original;       // verbatim text of line.
-    std::string                 regularized;    // comment removed text of line. if this is #include, the file content is in `inclusion` below;
-    std::unique_ptr<SourceFile> inclusion;      //   otherwise `inclusion` is empty
-    std::vector<std::string>    tokens;         //== comment-removed, label-removed, tokens. [empty after loading; used in assembling only]
+    int                 number;         // line number in the file
+    std::string_view    original;       // verbatim text of line, in the buffer of the file.
+    bool                labeled = false;    // true if the line starts with a label definition.
+    std::string_view    label;          // leading label of the line without ':', or empty.
+    TokenList           tokens;         // comment-removed and label-removed tokens.
+};
+
+// lines of one file before it is added to a SourceFile; also the contents of an AssemblyCache entry.
+struct FileContents
+{
+    struct Include
+    {
+        uint32_t    line;           // index of the #include line
+        uint32_t    offset;         // included path without quotes, in the file buffer
+        uint32_t    size;
+    };
+    
+    std::vector<SourceLine>     lines;      // inclusion is not set yet.
+    std::vector<TokenSpan>      tokens;     // firstToken of lines index into these.
+    std::vector<Include>        includes;
 };
 
 struct SourceFile
 {
-    std::string                 filePath;   // file path
-    std::vector<CodeLine>       lines;      // contents of this file as individual lines
+    struct File
+    {
+        std::string                         filePath;   // file path
+        std::shared_ptr<const SourceBuffer> buffer;     // contents of the file; lines and tokens are spans of it
+        uint32_t                            firstLine = 0;  // lines of the file are [firstLine, firstLine+lineCount) of `lines`
+        uint32_t                            lineCount = 0;  // 0 for a file skipped as a repeated #include
+    };
+    
+    std::vector<File>           files;      // files[0] is the root file.
+    std::vector<SourceLine>     lines;
+    std::vector<TokenSpan>      tokens;
+    LabelMap                    constants;  // values of #define
+    
+    // add a file without lines, and return its index.
+    uint32_t    add_file(std::string filePath, std::shared_ptr<const SourceBuffer> buffer)
+    {
+        files.push_back({std::move(filePath), std::move(buffer)});
+        return uint32_t(files.size()-1);
+    }
+    
+    // set the lines of files[file]. the #include lines must have their inclusion set.
+    void        set_lines(uint32_t file, FileContents&& contents)
+    {
+        files[file].firstLine = uint32_t(lines.size());
+        files[file].lineCount = uint32_t(contents.lines.size());
+        uint32_t tokenBase = uint32_t(tokens.size());
+        if( tokenBase==0 )
+            tokens = std::move(contents.tokens);
+        else
+            tokens.insert(tokens.end(), contents.tokens.begin(), contents.tokens.end());
+        if( lines.empty() && tokenBase==0 )
+            lines = std::move(contents.lines);
+        else
+        {
+            for(SourceLine& line : contents.lines)
+            {
+                line.firstToken += tokenBase;
+                lines.push_back(line);
+            }
+        }
+    }
+    
+    // the view of lines[index] of files[file].
+    CodeLine    code_line(uint32_t file, uint32_t index) const
+    {
+        const File& f = files[file];
+        const SourceLine& l = lines[index];
+        const char* base = f.buffer->view().data();
+        CodeLine line{ int(index - f.firstLine + 1), std::string_view(base+l.offset, l.size), false, {}, {} };
+        const TokenSpan* spans = tokens.data() + l.firstToken;
+        size_t count = l.tokenCount;
+        if( count && TokenKind(spans->kind)==TokenKind::Label )
+        {
+            line.labeled = true;
+            line.label = std::string_view(base+spans->offset, spans->size);
+            ++spans;
+            --count;
+        }
+        line.tokens = TokenList(spans, count, base);
+        return line;
+    }
 };
 
-// bool fo(std::string& filePath, CodeLine& line);  // false: error.
+// bool fo(const std::string& filePath, const CodeLine& line);  // false: error; the include chain of the line goes to log.
 template<class FO>
-bool do_for_each_line(SourceFile& file, FO fo, int level)
+bool do_for_each_line(const SourceFile& source, uint32_t file, FO fo, int level, std::ostream& log)
 {
-    for(CodeLine& line : file.lines)
+    const SourceFile::File& f = source.files[file];
+    for(uint32_t i=f.firstLine; i<f.firstLine+f.lineCount; ++i)
     {
-        if( ! line.inclusion )
+        const SourceLine& line = source.lines[i];
+        if( line.inclusion<0 )
         {
-            if( !fo(file.filePath, line) )
+            if( !fo(f.filePath, source.code_line(file, i)) )
                 return false;
         }
         else
         {
-            if( ! do_for_each_line(*line.inclusion, fo, level+1) )
+            if( ! do_for_each_line(source, uint32_t(line.inclusion), fo, level+1, log) )
             {
-                std::cout << "["<<level<<"] " << "At: " << file.filePath << ", Line: " << line.number << std::endl
-                    <<"    " << line.original << std::endl;
+                CodeLine include = source.code_line(file, i);
+                log << "["<<level<<"] " << "At: " << f.filePath << ", Line: " << include.number << std::endl
+                    <<"    " << include.original << std::endl;
                 return false;
             }
         }
@@ -49,101 +178,156 @@ bool do_for_each_line(SourceFile& file, FO fo, int level)
     return true;
 }
 
-// bool fo(std::string& filePath, CodeLine& line);  // false: error.
+// bool fo(const std::string& filePath, const CodeLine& line);  // false: error; the include chain of the line goes to log.
 template<class FO>
-bool for_each_line(SourceFile& file, FO fo)
+bool for_each_line(const SourceFile& source, FO fo, std::ostream& log)
 {
-    return do_for_each_line(file, fo, 0);
+    return source.files.empty() || do_for_each_line(source, 0, fo, 0, log);
 }
 
 
+// data directives, which define initialized data in the data segment.
+enum class DataDirective : uint8_t
+{
+    DB,         // bytes:       DB 1, 2, 'a', "text"
+    DW,         // shorts:      DW 0x1234, -1, label
+    DX,         // xstring:     DX "text"   (short length, then the chars)
+    DS,         // zero fill:   DS 16
+    ALIGN,      // zero fill up to a multiple of n bytes: ALIGN 2
+    DD,         // 32-bit:      DD 0x12345678, label
+};
+
+enum class LineKind : uint8_t
+{
+    Empty,          // blank, comment or label only
+    Instruction,
+    Data,           // a data directive
+};
+
 std::string                 upper(const std::string& str);
-int                         string_to_number(const std::string& str);
-std::vector<std::string>    tokenize(const std::string& str);
-bool                        remove_inline_comments(std::string& line);
-bool                        detect_and_remove_label_for_line(std::vector<std::string>& tokens, std::string& label);
+bool                        find_data_directive(std::string_view name, DataDirective& directive);
+bool                        string_to_number(std::string_view str, int& val);
+bool                        eval_expression(std::string_view text, const LabelMap& symbols, int& value, bool allowUnknown = false);
+bool                        parse_include_line(const std::vector<Token>& tokens, std::string_view& includeFilePath);
+bool                        check_line(const CodeLine& line, LineKind& kind, std::string& error);
+
+struct AssemblyCache;
 
 struct Loader
 {
     std::filesystem::path               currentDir;
     std::vector<std::filesystem::path>  extraIncludeDirs;
+    AssemblyCache*                      cache = nullptr;    // optional on-disk cache of lexed source files.
+    unsigned                            threads = 1;        // >1: load files concurrently, see load_parallel().
+    std::ostream*                       log = &std::cout;   // errors, warnings and hints
     
     // load the source code lines from file path and also handle #include recursively.
-    bool    load(const std::string& filePath, SourceFile& file);
+    // then #define, #macro and #rept are handled, see expand().
+    bool    load(const std::string& filePath, SourceFile& source);
 
     // load the source code lines from a string of source code. It should not have #includes.
-    bool    loadFromString(const std::string& sourceCodeContents, SourceFile& file);
+    bool    loadFromString(const std::string& sourceCodeContents, SourceFile& source);
     
 private:
-    bool    recurse_load(const std::string& includePath, SourceFile& file, int level);
+    struct MacroDefinition
+    {
+        std::vector<std::string>    params;
+        uint32_t                    file = 0;       // the body is lines [firstLine, firstLine+lineCount) of source.lines
+        uint32_t                    firstLine = 0;
+        uint32_t                    lineCount = 0;
+        std::vector<std::string>    localLabels;    // labels defined in the body
+        std::string                 site;           // "file:line" of #macro
+    };
+    
+    bool    expand(SourceFile& source, uint32_t file, int level, int depth);
+    bool    add_expansion(SourceFile& source, std::string name, const std::string& text, int level, uint32_t& file);
+    bool    recurse_load(const std::string& includePath, SourceFile& source, int level, uint32_t& file);
+    bool    load_contents(const std::string& filePath, const SourceBuffer& buffer, FileContents& contents, int level, std::ostream& log);
+    bool    load_buffer(const std::string& filePath, const SourceBuffer& buffer, FileContents& contents, int level, std::ostream& log);
     
-    template<class FO>
-    bool load_istream(const std::string& filePath, std::istream& is, SourceFile& file, int level, FO inclusionHandler);
+    std::shared_ptr<const SourceBuffer> open_source(const std::string& includePath, std::filesystem::path& filePath, int level, std::ostream& log) const;
+    bool    load_parallel(const std::string& rootPath, SourceFile& source);
 
     std::map<std::string, bool>    mapIncludedFiles;    // absolute path
+    std::map<std::string, MacroDefinition, std::less<>>    macros;
+    int     expansions = 0;     // number of macro expansions and #rept iterations so far, for unique local labels
+    uint64_t    expandedLines = 0;  // lines added by all expansions so far, at most MAX_EXPANDED_LINES
+    
+    static constexpr uint64_t MAX_EXPANDED_LINES = 1 << 22;
 };
 
 
 //==============================================================================================================================
 //==============================================================================================================================
 
-// str could be "1288", "0x3000", "0X3000", "0b00110011", "0B00110011", "'a'".
-inline int string_to_number(const std::string& str)
+// On-disk cache of lexed source files, shared by repeated xasm runs.
+// An entry is keyed by a hash of the resolved file path and the file contents, and holds the FileContents of that file:
+// its lines and tokens as offsets into the file contents. #include lines only record the included path, which is
+// resolved and loaded (possibly from the cache as well) every time, so an entry never depends on other files.
+// Entries are written to a temporary file and then renamed into place, so that concurrent xasm processes can share a
+// cache directory: a reader sees either a complete entry or no entry.
+struct AssemblyCache
+{
+    std::filesystem::path   dir;
+    std::atomic<int>        hits{0};
+    std::atomic<int>        misses{0};
+
+    static uint64_t key(const std::string& filePath, std::string_view contents);
+
+    // fill contents from the entry of key, and count a hit or a miss. buffer must hold the file contents of the key.
+    bool    lookup(uint64_t key, std::string_view buffer, FileContents& contents);
+
+    // save contents as the entry of key; a failure is a warning to log.
+    void    store(uint64_t key, const FileContents& contents, std::ostream& log);
+
+private:
+    std::filesystem::path   entryPath(uint64_t key) const;
+};
+
+//==============================================================================================================================
+//==============================================================================================================================
+
+// str could be "1288", "-3", "0x3000", "0X3000", "0b00110011", "0B00110011", "'a'".
+// a number is 32-bit: hex and binary up to 32 digits of bits, decimal from -2^31 to 2^32-1; val is its bits, so
+// 0xFFFFFFFF and 4294967295 are -1.
+// return false if str is not a number.
+inline bool string_to_number(std::string_view str, int& val)
 {
-    int val = 0;
+    val = 0;
     if( str.size()>2 )
     {
-        std::string prefix_ = str.substr(0, 2);
-        auto prefix = upper(prefix_);
-        if( prefix=="0X" )
+        char prefix = str[1];
+        if( str[0]=='0' && (prefix=='x' || prefix=='X') )
         {
-            std::string proper = str.substr(2);
-            std::istringstream ss(proper);
-            ss >> std::hex >> val;
-            return val;
+            uint32_t bits = 0;
+            auto r = std::from_chars(str.data()+2, str.data()+str.size(), bits, 16);
+            val = int(bits);
+            return r.ec==std::errc() && r.ptr==str.data()+str.size();
         }
-        else if( prefix=="0B" )
+        else if( str[0]=='0' && (prefix=='b' || prefix=='B') )
         {
-            std::string proper = str.substr(2);
-            int term = 1;
-            for (int i=0; i<proper.length(); i++)
-            {
-                int ind = (int)(proper.size()-1-i);
-                char bit = proper[ind];
-                if( bit=='1' )
-                    val += term;
-                else if( bit != '0' )
-                {
-                    // there is something wrong
-                }
-                term *= 2;
-            }
-            return val;
+            uint32_t bits = 0;
+            auto r = std::from_chars(str.data()+2, str.data()+str.size(), bits, 2);
+            val = int(bits);
+            return r.ec==std::errc() && r.ptr==str.data()+str.size();
         }
         else if(( str.front() == '\'' && str.back() == '\'') || ( str.front() == '"' && str.back() == '"'))
         {
-            std::string proper = str.substr(1, str.size()-2);
-            for(int i=0; i<proper.size(); ++i)
+            std::string_view proper = str.substr(1, str.size()-2);
+            for(size_t ind=0; ind<proper.size(); ++ind)
             {
-                int ind = int(proper.size()-1-i);
                 unsigned int ch = (unsigned char)(proper[ind]);
                 val |= (ch << (8*ind));
             }
-            return val;
+            return true;
         }
     }
-    val = stoi(str);
-    return val;
-}
-
-inline std::vector<std::string> tokenize(const std::string& str)
-{
-    std::vector<std::string> tokens;
-    std::istringstream stream{str};
-    std::string token;
-    while (stream >> token)
-        tokens.push_back(token);
-    return tokens;
+    if( !str.empty() && str.front()=='+' )
+        str.remove_prefix(1);
+    int64_t n = 0;
+    auto r = std::from_chars(str.data(), str.data()+str.size(), n, 10);
+    val = int(uint32_t(n));
+    return !str.empty() && r.ec==std::errc() && r.ptr==str.data()+str.size() && n>=INT32_MIN && n<=int64_t(UINT32_MAX);
 }
 
 inline std::string upper(const std::string& str)
@@ -154,294 +338,1028 @@ inline std::string upper(const std::string& str)
     return s;
 }
 
-// from the line, remove `//` and beyond; or replace well-formed `/*` and `*/` pairs with ' ', then return true.
-// if it finds non-well formed `/*` following `/*` sequence, it returns false.
-inline bool remove_inline_comments(std::string& line)
+inline bool is_symbol_char(char c)
 {
-    if( line.empty() )
+    return (c>='a' && c<='z') || (c>='A' && c<='Z') || (c>='0' && c<='9') || c=='_' || c=='@' || c=='.' || c=='$';
+}
+
+// evaluate a constant expression of numbers (see string_to_number), symbols, parentheses, unary - and +, and the
+// binary operators * / % (first) and + - (then), e.g. "label+2", "N*2", "(N+1)*'a'".
+// the arithmetic wraps around at 32 bits, also INT_MIN / -1.
+// return false if the expression is malformed, divides by zero, or has a symbol not in symbols; with allowUnknown,
+// unknown symbols count as 0 instead.
+inline bool eval_expression(std::string_view text, const LabelMap& symbols, int& value, bool allowUnknown)
+{
+    size_t pos = 0;
+    auto skipBlanks = [&](){
+        while( pos<text.size() && is_blank(text[pos]) )
+            ++pos;
+    };
+    auto term = [&](auto& expression, auto& self, int& v) -> bool {
+        skipBlanks();
+        if( pos>=text.size() )
+            return false;
+        char c = text[pos];
+        if( c=='-' || c=='+' )
+        {
+            ++pos;
+            if( !self(expression, self, v) )
+                return false;
+            v = c=='-' ? int(0u - uint32_t(v)) : v;
+            return true;
+        }
+        if( c=='(' )
+        {
+            ++pos;
+            if( !expression(expression, v) )
+                return false;
+            skipBlanks();
+            if( pos>=text.size() || text[pos]!=')' )
+                return false;
+            ++pos;
+            return true;
+        }
+        size_t begin = pos;
+        if( c=='\'' )
+        {
+            size_t end = text.find('\'', pos+1);
+            if( end==std::string_view::npos )
+                return false;
+            pos = end+1;
+        }
+        else
+        {
+            while( pos<text.size() && is_symbol_char(text[pos]) )
+                ++pos;
+        }
+        std::string_view word = text.substr(begin, pos-begin);
+        if( word.empty() )
+            return false;
+        if( is_digit(c) || c=='\'' )
+            return string_to_number(word, v);
+        auto it = symbols.find(word);
+        if( it==symbols.end() )
+        {
+            v = 0;
+            return allowUnknown;
+        }
+        v = it->second;
         return true;
-    
-    // check for // or /*
-    size_t locCommentStart = line.find("/*");
-    size_t locInlineCommentStart = line.find("//");
-    if( std::string::npos != locInlineCommentStart && (std::string::npos == locCommentStart || locInlineCommentStart<locCommentStart) )
+    };
+    auto product = [&](auto& expression, int& v) -> bool {
+        if( !term(expression, term, v) )
+            return false;
+        for(;;)
+        {
+            skipBlanks();
+            if( pos>=text.size() || (text[pos]!='*' && text[pos]!='/' && text[pos]!='%') )
+                return true;
+            char op = text[pos++];
+            int rhs = 0;
+            if( !term(expression, term, rhs) )
+                return false;
+            if( op=='*' )
+                v = int(uint32_t(v) * uint32_t(rhs));
+            else if( rhs==0 )
+                return false;
+            else
+                v = int(uint32_t(op=='/' ? int64_t(v)/rhs : int64_t(v)%rhs));
+        }
+    };
+    auto expression = [&](auto& self, int& v) -> bool {
+        if( !product(self, v) )
+            return false;
+        for(;;)
+        {
+            skipBlanks();
+            if( pos>=text.size() || (text[pos]!='+' && text[pos]!='-') )
+                return true;
+            char op = text[pos++];
+            int rhs = 0;
+            if( !product(self, rhs) )
+                return false;
+            v = int(op=='+' ? uint32_t(v) + uint32_t(rhs) : uint32_t(v) - uint32_t(rhs));
+        }
+    };
+    int v = 0;
+    if( !expression(expression, v) )
+        return false;
+    skipBlanks();
+    if( pos!=text.size() )
+        return false;
+    value = v;
+    return true;
+}
+
+//==============================================================================================================================
+//==============================================================================================================================
+
+inline uint64_t AssemblyCache::key(const std::string& filePath, std::string_view contents)
+{
+    // FNV-1a, 64-bit.
+    uint64_t hash = 0xcbf29ce484222325ull;
+    auto add = [&hash](const char* p, size_t n){
+        for(size_t i=0; i<n; ++i)
+        {
+            hash ^= (unsigned char)(p[i]);
+            hash *= 0x100000001b3ull;
+        }
+    };
+    add(filePath.data(), filePath.size());
+    add("", 1);     // separator, so that path and contents cannot run into each other.
+    add(contents.data(), contents.size());
+    return hash;
+}
+
+inline std::filesystem::path AssemblyCache::entryPath(uint64_t key) const
+{
+    return dir / (integer_as_hex(key) + ".xcache");
+}
+
+namespace cache_io
+{
+    constexpr char   MAGIC[8] = {'X','A','S','M','C','0','0','3'};
+    constexpr char   END_MARK[4] = {'E','N','D','!'};
+
+    inline void put_u32(std::string& out, uint32_t v)
     {
-        // `//` takes effect, remove everything after `//`.
-        line.erase(locInlineCommentStart);
+        for(int i=0; i<4; ++i)
+            out.push_back(char(v >> (8*i)));
     }
-    
-    // remove those `/*` and `*/` pairs in the line.
-    size_t loc = 0;
-    while( loc<line.size() )
+
+    // reads from a complete entry in memory; any read past the end marks the reader bad.
+    struct Reader
     {
-        // each iteration should remove a pair of `/*` and `*/`
-        
-        // check if we can find `/*`
-        loc = line.find("/*", loc);
-        if( std::string::npos != loc )
-        {
-            // `/*` found.
-            size_t loc2a = line.find("*/", loc+2);
-            size_t loc2b = line.find("/*", loc+2);
-            if( loc2a < loc2b )
-            {
-                // `*/` inline.
-                line.replace(loc, loc2a-loc+2, 1, ' ');
-            }
-            else if( loc2b < loc2a )
-            {
-                // `/*` following `/*`.
-                return false;
-            }
-            else
+        const std::string&  data;
+        size_t              pos = 0;
+        bool                good = true;
+
+        uint32_t u32()
+        {
+            if( pos+4 > data.size() )
             {
-                // no `*/` or `/*` found.
-                return true;
+                good = false;
+                return 0;
             }
+            uint32_t v = 0;
+            for(int i=0; i<4; ++i)
+                v |= uint32_t((unsigned char)(data[pos+i])) << (8*i);
+            pos += 4;
+            return v;
+        }
+
+        bool bytes(const char* expected, size_t size)
+        {
+            if( pos+size > data.size() || data.compare(pos, size, expected, size)!=0 )
+                good = false;
+            pos += size;
+            return good;
+        }
+    };
+}
+
+// entry layout: MAGIC, key (2 x u32), line count, lines, token count, tokens, include count, includes, END_MARK.
+// line: offset, size, first token, token count.
+// token: offset, size | kind<<24.
+// include: line index, offset, size.
+// offsets are into the file contents, which are part of the key.
+inline bool AssemblyCache::lookup(uint64_t key, std::string_view buffer, FileContents& contents)
+{
+    std::ifstream ifs(entryPath(key), std::ios::binary);
+    std::string data;
+    if( ifs.is_open() )
+        data.assign(std::istreambuf_iterator<char>(ifs), std::istreambuf_iterator<char>());
+
+    cache_io::Reader r{data};
+    auto inBuffer = [&r, buffer](uint32_t offset, uint32_t size){
+        if( size_t(offset)+size > buffer.size() )
+            r.good = false;
+    };
+    FileContents entry;
+    if( r.bytes(cache_io::MAGIC, sizeof(cache_io::MAGIC)) && r.u32()==uint32_t(key) && r.u32()==uint32_t(key>>32) )
+    {
+        uint32_t lineCount = r.u32();
+        for(uint32_t i=0; r.good && i<lineCount; ++i)
+        {
+            SourceLine line;
+            line.offset = r.u32();
+            line.size = r.u32();
+            line.firstToken = r.u32();
+            line.tokenCount = r.u32();
+            line.inclusion = -1;
+            inBuffer(line.offset, line.size);
+            entry.lines.push_back(line);
+        }
+        uint32_t tokenCount = r.u32();
+        for(uint32_t i=0; r.good && i<tokenCount; ++i)
+        {
+            TokenSpan token;
+            token.offset = r.u32();
+            uint32_t sizeKind = r.u32();
+            token.size = sizeKind & TokenSpan::MAX_SIZE;
+            token.kind = sizeKind >> 24;
+            inBuffer(token.offset, token.size);
+            if( token.kind > uint32_t(TokenKind::Comma) )
+                r.good = false;
+            entry.tokens.push_back(token);
+        }
+        for(const SourceLine& line : entry.lines)
+        {
+            if( uint64_t(line.firstToken)+line.tokenCount > entry.tokens.size() )
+                r.good = false;
+        }
+        uint32_t includeCount = r.u32();
+        for(uint32_t i=0; r.good && i<includeCount; ++i)
+        {
+            FileContents::Include include;
+            include.line = r.u32();
+            include.offset = r.u32();
+            include.size = r.u32();
+            inBuffer(include.offset, include.size);
+            if( include.line >= entry.lines.size() )
+                r.good = false;
+            entry.includes.push_back(include);
+        }
+        r.bytes(cache_io::END_MARK, sizeof(cache_io::END_MARK));
+    }
+    else
+        r.good = false;
+
+    if( !r.good )
+    {
+        ++misses;
+        return false;
+    }
+    ++hits;
+    contents = std::move(entry);
+    return true;
+}
+
+inline void AssemblyCache::store(uint64_t key, const FileContents& contents, std::ostream& log)
+{
+    using cache_io::put_u32;
+    std::string data(cache_io::MAGIC, sizeof(cache_io::MAGIC));
+    data.reserve(32 + contents.lines.size()*16 + contents.tokens.size()*8 + contents.includes.size()*12);
+    put_u32(data, uint32_t(key));
+    put_u32(data, uint32_t(key>>32));
+    put_u32(data, uint32_t(contents.lines.size()));
+    for(const SourceLine& line : contents.lines)
+    {
+        put_u32(data, line.offset);
+        put_u32(data, line.size);
+        put_u32(data, line.firstToken);
+        put_u32(data, line.tokenCount);
+    }
+    put_u32(data, uint32_t(contents.tokens.size()));
+    for(const TokenSpan& token : contents.tokens)
+    {
+        put_u32(data, token.offset);
+        put_u32(data, token.size | (uint32_t(token.kind) << 24));
+    }
+    put_u32(data, uint32_t(contents.includes.size()));
+    for(const FileContents::Include& include : contents.includes)
+    {
+        put_u32(data, include.line);
+        put_u32(data, include.offset);
+        put_u32(data, include.size);
+    }
+    data.append(cache_io::END_MARK, sizeof(cache_io::END_MARK));
+
+    // write a private temporary file, then rename it over the entry, which is atomic for readers.
+    std::error_code ec;
+    std::filesystem::create_directories(dir, ec);
+    std::random_device rd;
+    auto finalPath = entryPath(key);
+    auto tempPath = finalPath;
+    tempPath += ".tmp" + integer_as_hex(uint32_t(rd())) + integer_as_hex(uint32_t(rd()));
+    {
+        std::ofstream ofs(tempPath, std::ios::binary);
+        if( !ofs.is_open() )
+        {
+            log << "Warning: cannot write assembly cache entry: " << tempPath << std::endl;
+            return;
+        }
+        ofs.write(data.data(), data.size());
+        if( !ofs )
+        {
+            ofs.close();
+            std::filesystem::remove(tempPath, ec);
+            log << "Warning: cannot write assembly cache entry: " << tempPath << std::endl;
+            return;
         }
-        else
-            break;
     }
-    return true; //
+    std::filesystem::rename(tempPath, finalPath, ec);
+    if( ec )
+        std::filesystem::remove(tempPath, ec);
 }
 
 //==============================================================================================================================
 //==============================================================================================================================
 
-// load the contents of of the filePath into file.
-inline bool Loader::recurse_load(const std::string& includePath, SourceFile& file, int level)
+// find the source file of includePath and open it: an absolute path is used verbatim; a relative path is looked up in
+// currentDir, then in extraIncludeDirs. filePath receives the absolute path of the opened file.
+// return the contents of the file, or nullptr if it cannot be opened.
+inline std::shared_ptr<const SourceBuffer> Loader::open_source(const std::string& includePath, std::filesystem::path& filePath, int level, std::ostream& log) const
 {
-    std::ifstream ifs;
-    std::filesystem::path filePath = includePath;
+    std::shared_ptr<const SourceBuffer> buffer;
+    filePath = includePath;
     if( filePath.is_absolute() )
     {
         // absolute include path, use it verbatim.
-        ifs.open(filePath);
-        if( !ifs.is_open() )
+        buffer = SourceBuffer::open(filePath);
+        if( !buffer )
         {
-            std::cout << "["<<level<<"] " << "Cannot open source file (absolute path): " << filePath << std::endl;
-            return false;
+            log << "["<<level<<"] " << "Cannot open source file (absolute path): " << filePath << std::endl;
+            return nullptr;
         }
     }
     else
     {
         // 1. currentDir
         filePath = std::filesystem::absolute(this->currentDir / includePath);
-        ifs.open(filePath);
-        if( !ifs.is_open() )
+        buffer = SourceBuffer::open(filePath);
+        if( !buffer )
         {
             // 2. try includeDirs
             for(const auto& dir : extraIncludeDirs)
             {
                 filePath = std::filesystem::absolute(dir / includePath);
-                ifs.open(filePath);
-                if( ifs.is_open() )
+                buffer = SourceBuffer::open(filePath);
+                if( buffer )
                 {
                     break;
                 }
             }
         }
         
-        if( !ifs.is_open() )
+        if( !buffer )
         {
-            std::cout << "["<<level<<"] " << "Cannot open source file: " << includePath << "\n"
+            log << "["<<level<<"] " << "Cannot open source file: " << includePath << "\n"
                 << "    tried current directory: " << "\n"
                 << "      " << currentDir << "\n";
             if( !extraIncludeDirs.empty() )
             {
-                std::cout << "    and additional include directories: \n";
+                log << "    and additional include directories: \n";
                 for(size_t i=0; i<extraIncludeDirs.size(); ++i)
-                    std::cout << "      [0]: " << extraIncludeDirs[i] << "\n";
+                    log << "      [0]: " << extraIncludeDirs[i] << "\n";
             }
-            return false;
+            return nullptr;
         }
     }
+    return buffer;
+}
+
+// print where an #include line of a file is, as a step of an include chain.
+inline void print_include_site(std::ostream& log, int level, const std::string& filePath, const SourceBuffer& buffer, const FileContents& contents, const FileContents::Include& include)
+{
+    const SourceLine& line = contents.lines[include.line];
+    log << "["<<level<<"] " << "At: " << filePath << ", Line: " << include.line+1 << std::endl
+        <<"    " << buffer.view().substr(line.offset, line.size) << std::endl;
+}
+
+// load the contents of of the includePath, and its #includes, into source. file receives the index of the file in source.
+inline bool Loader::recurse_load(const std::string& includePath, SourceFile& source, int level, uint32_t& file)
+{
+    std::filesystem::path filePath;
+    auto buffer = open_source(includePath, filePath, level, *log);
+    if( !buffer )
+        return false;
     
     // the file has been opened.
+    file = source.add_file(filePath.string(), buffer);
     if( mapIncludedFiles.find(filePath.string()) != mapIncludedFiles.end() )
     {
         // the file has been included before. do not process it, or we have duplicated labels and machine codes.
-        std::cout << "Hint: ["<<level<<"] " << "Source was already included: " << filePath << std::endl;
-        file.filePath = filePath;
-        file.lines.clear();
+        *log << "Hint: ["<<level<<"] " << "Source was already included: " << filePath << std::endl;
         return true;    // skip the lines in this file.
     }
     mapIncludedFiles[filePath.string()] = true;
 
-    // load ifstream as istream.
-    return load_istream(filePath.string(), ifs, file, level,
-                        // if load_istream encounters #include, this function below will be called to handle that.
-                        [this](const std::string& includePath, SourceFile& file, int level){
-                            return this->recurse_load(includePath, file, level);
-                        }
-    );
+    FileContents contents;
+    if( !load_contents(filePath.string(), *buffer, contents, level, *log) )
+        return false;
+    for(const FileContents::Include& include : contents.includes)
+    {
+        uint32_t included = 0;
+        if( !recurse_load(std::string(buffer->view().substr(include.offset, include.size)), source, level+1, included) )
+        {
+            print_include_site(*log, level, filePath.string(), *buffer, contents, include);
+            return false;
+        }
+        contents.lines[include.line].inclusion = int32_t(included);
+    }
+    source.set_lines(file, std::move(contents));
+    return true;
 }
 
-template<class FO>
-inline bool Loader::load_istream(const std::string& filePath, std::istream& is, SourceFile& file, int level, FO inclusionHandler)
+// lex a file like load_buffer(), going through the cache if there is one.
+inline bool Loader::load_contents(const std::string& filePath, const SourceBuffer& buffer, FileContents& contents, int level, std::ostream& log)
 {
-    file.filePath = filePath;
-    file.lines.clear();
+    if( !cache )
+        return load_buffer(filePath, buffer, contents, level, log);
     
-    std::string original, regularized;
-    bool multiline_comment_open = false;
-    int number = 1;
-    while( std::getline(is, original) )
+    uint64_t key = AssemblyCache::key(filePath, buffer.view());
+    if( cache->lookup(key, buffer.view(), contents) )
+        return true;
+    if( !load_buffer(filePath, buffer, contents, level, log) )
+        return false;   // do not cache a file with errors.
+    cache->store(key, contents, log);
+    return true;
+}
+
+// load filePath with its #includes like recurse_load(), but load and lex the files on `threads` threads.
+// the include graph is discovered wave by wave: the files of a wave are loaded concurrently, and the files they include
+// that were not seen before form the next wave. the loaded files are then stitched into the source tree in the order
+// of sequential loading, so the tree is the same as recurse_load() makes, including which repeated #include is skipped.
+inline bool Loader::load_parallel(const std::string& rootPath, SourceFile& source)
+{
+    struct Include
     {
-        regularized = original;
-        
-        //==== Take care of comments. regularized line will contain comment-removed text.
-        // in-line comments take precedence to be removed.
-        if( ! remove_inline_comments(regularized) )
+        std::string             resolved;   // absolute path of the included file; empty if it cannot be opened
+        std::shared_ptr<const SourceBuffer> buffer;
+        std::string             log;        // why it cannot be opened
+    };
+    struct Unit
+    {
+        std::string             resolved;   // absolute path
+        std::shared_ptr<const SourceBuffer> buffer;
+        int                     level = 0;  // include depth of first discovery, for messages
+        bool                    ok = false;
+        std::string             log;        // messages of loading this file
+        FileContents            contents;
+        std::vector<Include>    includes;   // indexed like contents.includes
+    };
+
+    auto loadUnit = [this](Unit& unit){
+        std::ostringstream log;
+        if( !load_contents(unit.resolved, *unit.buffer, unit.contents, unit.level, log) )
         {
-            // `/*` following `/*`.
-            std::cout << "["<<level<<"] " << "Syntax error: `/*` following `/*`: " << filePath << ", Line: " << number << std::endl
-                <<"    " << original << std::endl;
+            unit.log = log.str();
+            return;
+        }
+
+        // resolve the included files.
+        for(const FileContents::Include& include : unit.contents.includes)
+        {
+            std::ostringstream includeLog;
+            std::filesystem::path includedPath;
+            auto buffer = open_source(std::string(unit.buffer->view().substr(include.offset, include.size)), includedPath, unit.level+1, includeLog);
+            if( buffer )
+                unit.includes.push_back({includedPath.string(), buffer, {}});
+            else
+                unit.includes.push_back({{}, nullptr, includeLog.str()});
+        }
+        unit.log = log.str();
+        unit.ok = true;
+    };
+
+    // discover and load.
+    std::map<std::string, std::unique_ptr<Unit>> units;   // by absolute path
+    Unit* root = nullptr;
+    {
+        std::filesystem::path filePath;
+        auto buffer = open_source(rootPath, filePath, 0, *log);
+        if( !buffer )
             return false;
+        auto& unit = units[filePath.string()];
+        unit = std::make_unique<Unit>();
+        unit->resolved = filePath.string();
+        unit->buffer = buffer;
+        root = unit.get();
+    }
+    std::vector<Unit*> wave{root};
+    while( !wave.empty() )
+    {
+        parallel_for(wave.size(), threads, [&](size_t i){ loadUnit(*wave[i]); });
+        std::vector<Unit*> next;
+        for(Unit* unit : wave)
+        {
+            for(Include& include : unit->includes)
+            {
+                if( include.resolved.empty() || units.find(include.resolved)!=units.end() )
+                    continue;
+                auto& included = units[include.resolved];
+                included = std::make_unique<Unit>();
+                included->resolved = include.resolved;
+                included->buffer = std::move(include.buffer);
+                included->level = unit->level+1;
+                next.push_back(included.get());
+            }
         }
-        
-        // multi-line comments are processed here.
-        if( multiline_comment_open )
+        wave.swap(next);
+    }
+
+    // stitch.
+    auto stitch = [this, &units, &source](auto& self, Unit& unit, int level, uint32_t& file) -> bool {
+        *log << unit.log;
+        if( !unit.ok )
+            return false;
+        file = source.add_file(unit.resolved, unit.buffer);
+        for(size_t i=0; i<unit.includes.size(); ++i)
         {
-            size_t loc2a = regularized.find("*/");
-            size_t loc2b = regularized.find("/*");
-            if( loc2b < loc2a )
+            const Include& include = unit.includes[i];
+            uint32_t included = 0;
+            bool ok = true;
+            if( include.resolved.empty() )
             {
-                // `/*` following earlier `/*`.
-                std::cout << "["<<level<<"] " << "Syntax error: `/*` following earlier line's `/*`: " << filePath << ", Line: " << number << std::endl
-                    <<"    " << original << std::endl;
-                return false;
+                *log << include.log;
+                ok = false;
             }
-            else if( loc2a < loc2b )
+            else if( mapIncludedFiles.find(include.resolved) != mapIncludedFiles.end() )
             {
-                // `*/`
-                regularized.replace(0, loc2a+2, 1, ' ');
-                multiline_comment_open = false;
+                // the file has been included before. do not process it, or we have duplicated labels and machine codes.
+                *log << "Hint: ["<<level+1<<"] " << "Source was already included: " << std::filesystem::path(include.resolved) << std::endl;
+                included = source.add_file(include.resolved, units[include.resolved]->buffer);
             }
             else
             {
-                // neither of `/*` and `*/`: this is a commented line
-                regularized.clear();
+                mapIncludedFiles[include.resolved] = true;
+                ok = self(self, *units[include.resolved], level+1, included);
             }
-        }
-        if( ! multiline_comment_open )
-        {
-            if( std::string::npos != regularized.find("*/") )
+            if( !ok )
             {
-                // `*/`, this is illegal.
-                std::cout << "["<<level<<"] " << "Syntax error: `*/` without earlier matching `/*`: " << filePath << ", Line: " << number << std::endl
-                    <<"    " << original << std::endl;
+                print_include_site(*log, level, unit.resolved, *unit.buffer, unit.contents, unit.contents.includes[i]);
                 return false;
             }
-
-            size_t locCommentStart = regularized.find("/*");
-            if( std::string::npos != locCommentStart )
-            {
-                // has `/*`: this is multiple line comment opening.
-                regularized.erase(locCommentStart);
-                multiline_comment_open = true;
-            }
+            unit.contents.lines[unit.contents.includes[i].line].inclusion = int32_t(included);
         }
+        source.set_lines(file, std::move(unit.contents));
+        return true;
+    };
+    mapIncludedFiles[root->resolved] = true;
+    uint32_t file = 0;
+    return stitch(stitch, *root, 0, file);
+}
 
-        //==== Now regularized is stripped of comments.
+// split the buffer into lines and tokenize them, in a single pass. #include lines only record the included path.
+inline bool Loader::load_buffer(const std::string& filePath, const SourceBuffer& buffer, FileContents& contents, int level, std::ostream& log)
+{
+    contents = FileContents();
+    
+    std::string_view text = buffer.view();
+    if( text.size() > UINT32_MAX )
+    {
+        log << "["<<level<<"] " << "Source file is too large: " << filePath << std::endl;
+        return false;
+    }
+    contents.lines.reserve(std::count(text.begin(), text.end(), '\n') + 1);
+    LexState state;
+    std::vector<Token> scratch;
+    int number = 1;
+    size_t pos = 0;
+    while( pos<text.size() )
+    {
+        size_t end = text.find('\n', pos);
+        if( end==std::string_view::npos )
+            end = text.size();
+        std::string_view original = text.substr(pos, end-pos);
+        SourceLine line{ uint32_t(pos), uint32_t(end-pos), uint32_t(contents.tokens.size()), 0, -1 };
+        pos = end+1;
+        
+        //==== Tokenize; comments are skipped by the lexer.
+        scratch.clear();
+        const char* error = lex_line(original, state, scratch);
+        
         //==== Take care of #include.
-        std::string includeFilePath;    // will be non-empty if this is a valid #include line.
+        std::string_view includeFilePath;   // will be non-empty if this is a valid #include line.
+        if( !error && !parse_include_line(scratch, includeFilePath) )
+            error = "#include";
         
-        // check if this is #include.
-        std::vector<std::string> tokens = tokenize(regularized);
-        if( tokens.size()>=2 )
+        if( !includeFilePath.empty() )
+            contents.includes.push_back({ uint32_t(contents.lines.size()), uint32_t(buffer.offset(includeFilePath)), uint32_t(includeFilePath.size()) });
+        else
         {
-            std::string included;
-            bool syntaxError = false;
-            if( tokens[0]=="#" && tokens[1]=="include" )
+            for(const Token& token : scratch)
             {
-                if( tokens.size()==3 )
-                    included = tokens[2];
-                else
-                    syntaxError = true;
+                if( token.text.size() > TokenSpan::MAX_SIZE )
+                {
+                    error = "token is too long";
+                    break;
+                }
+                contents.tokens.push_back({ uint32_t(buffer.offset(token.text)), uint32_t(token.text.size()), uint32_t(token.kind) });
             }
-            else if( tokens[0]=="#include" )
+            line.tokenCount = uint32_t(contents.tokens.size() - line.firstToken);
+        }
+        if( error )
+        {
+            log << "["<<level<<"] " << "Syntax error: " << error << ": " << filePath << ", Line: " << number << std::endl
+                <<"    " << original << std::endl;
+            return false;
+        }
+        contents.lines.push_back(line);
+        
+        ++number;
+    }
+    return true;
+}
+
+// copy line to out, replacing every whole word (see is_symbol_char) that is in replacements. quoted text is copied
+// verbatim.
+inline void substitute_words(std::string& out, std::string_view line, const std::map<std::string, std::string, std::less<>>& replacements)
+{
+    size_t pos = 0;
+    while( pos<line.size() )
+    {
+        char c = line[pos];
+        size_t end = pos+1;
+        if( (c=='"' || c=='\'') && line.find(c, pos+1)!=std::string_view::npos )
+            end = line.find(c, pos+1)+1;
+        else if( is_symbol_char(c) )
+        {
+            while( end<line.size() && is_symbol_char(line[end]) )
+                ++end;
+            auto it = replacements.find(line.substr(pos, end-pos));
+            if( it!=replacements.end() )
             {
-                if( tokens.size()==2 )
-                    included = tokens[1];
-                else
-                    syntaxError = true;
+                out += it->second;
+                pos = end;
+                continue;
             }
-            if( !included.empty() )
+        }
+        out.append(line, pos, end-pos);
+        pos = end;
+    }
+}
+
+// lex the text of a macro expansion or #rept block, and add it to source as a file.
+inline bool Loader::add_expansion(SourceFile& source, std::string name, const std::string& text, int level, uint32_t& file)
+{
+    auto buffer = SourceBuffer::copy(text);
+    FileContents contents;
+    if( !load_buffer(name, *buffer, contents, level, *log) )
+        return false;
+    file = source.add_file(std::move(name), buffer);
+    source.set_lines(file, std::move(contents));
+    return true;
+}
+
+// handle the directives of the lines of files[file], and of its included files, in source order:
+//   #define NAME expr          NAME is a constant; expr may use earlier constants.
+//   #macro NAME p1, p2 ... #endm
+//                              define a macro; `NAME a, b` then expands to the lines between, with p1, p2 replaced by
+//                              the text of a and b, and each label defined in the lines renamed to a unique `label@N`.
+//   #rept count[, var] ... #endr
+//                              repeat the lines between count times, with var replaced by 0, 1, ... count-1, and the
+//                              labels renamed as for a macro.
+// an expansion is added as a new file with the directive or the macro call as its #include line, and is expanded in
+// turn. the lines of the directives are left without tokens.
+inline bool Loader::expand(SourceFile& source, uint32_t file, int level, int depth)
+{
+    // without `#`, a file has neither directives nor #include lines.
+    if( macros.empty() && source.files[file].buffer->view().find('#')==std::string_view::npos )
+        return true;
+    const uint32_t firstLine = source.files[file].firstLine;
+    const uint32_t endLine = firstLine + source.files[file].lineCount;
+    uint32_t i = firstLine;
+    auto error = [&](uint32_t index, const std::string& message){
+        CodeLine line = source.code_line(file, index);
+        *log << "["<<level<<"] " << "Syntax error: " << message << ": " << source.files[file].filePath << ", Line: " << line.number << std::endl
+            <<"    " << line.original << std::endl;
+        return false;
+    };
+    auto site = [&](uint32_t index){
+        return source.files[file].filePath + ":" + std::to_string(source.code_line(file, index).number);
+    };
+    
+    // find the end of the #macro or #rept block of line i, and the labels defined in it.
+    auto findEnd = [&](bool macro, uint32_t& end, std::vector<std::string>& labels){
+        int nesting = 0;
+        for(end=i+1; end<endLine; ++end)
+        {
+            if( source.lines[end].inclusion>=0 )
+                return error(end, "#include inside #macro or #rept");
+            CodeLine line = source.code_line(file, end);
+            if( line.labeled && std::find(labels.begin(), labels.end(), line.label)==labels.end() )
+                labels.emplace_back(line.label);
+            if( line.tokens.empty() || line.tokens.front().kind!=TokenKind::Directive )
+                continue;
+            std::string_view directive = line.tokens.front().text;
+            if( directive=="macro" )
+                return error(end, "#macro inside #macro or #rept");
+            if( directive=="rept" )
+                ++nesting;
+            else if( directive=="endr" && nesting>0 )
+                --nesting;
+            else if( directive=="endr" || directive=="endm" )
             {
-                if( included.size()>2 && included.front()=='\"' && included.back()=='\"' )
-                    includeFilePath = included.substr(1, included.size()-2);
-                else
-                    syntaxError = true;
+                if( (directive=="endm")!=macro || nesting>0 )
+                    return error(end, "#" + std::string(directive) + " without #" + (directive=="endm" ? "macro" : "rept"));
+                if( line.labeled || line.tokens.size()!=1 )
+                    return error(end, "#" + std::string(directive));
+                return true;
             }
-            if( syntaxError )
+        }
+        return error(i, macro ? "#macro without #endm" : "#rept without #endr");
+    };
+    
+    // count the lines of an expansion; nested #rept blocks multiply, so the total is limited.
+    auto grow = [&](uint64_t lines){
+        expandedLines += lines;
+        if( expandedLines>MAX_EXPANDED_LINES )
+            return error(i, "too many expanded lines, more than " + std::to_string(MAX_EXPANDED_LINES));
+        return true;
+    };
+    
+    // add text as an expansion for line i, and expand it.
+    auto addExpansion = [&](std::string name, const std::string& text){
+        if( depth>=64 )
+            return error(i, "macro expansion is too deep");
+        uint32_t expansion = 0;
+        if( !add_expansion(source, std::move(name), text, level+1, expansion) || !expand(source, expansion, level+1, depth+1) )
+        {
+            CodeLine line = source.code_line(file, i);
+            *log << "["<<level<<"] " << "At: " << source.files[file].filePath << ", Line: " << line.number << std::endl
+                <<"    " << line.original << std::endl;
+            return false;
+        }
+        source.lines[i].inclusion = int32_t(expansion);
+        source.lines[i].tokenCount = 0;
+        return true;
+    };
+    
+    auto bodyText = [&](uint32_t bodyFile, uint32_t begin, uint32_t count, const std::map<std::string, std::string, std::less<>>& replacements, std::string& text){
+        for(uint32_t j=begin; j<begin+count; ++j)
+        {
+            substitute_words(text, source.code_line(bodyFile, j).original, replacements);
+            text += '\n';
+        }
+    };
+    
+    for(; i<endLine; ++i)
+    {
+        if( source.lines[i].inclusion>=0 )
+        {
+            if( !expand(source, uint32_t(source.lines[i].inclusion), level+1, depth) )
             {
-                std::cout << "["<<level<<"] " << "Syntax error: #include: " << filePath << ", Line: " << number << std::endl
-                    <<"    " << original << std::endl;
+                CodeLine include = source.code_line(file, i);
+                *log << "["<<level<<"] " << "At: " << source.files[file].filePath << ", Line: " << include.number << std::endl
+                    <<"    " << include.original << std::endl;
                 return false;
             }
+            continue;
         }
+
+        // only directives and macro calls are expanded.
+        const SourceLine& sourceLine = source.lines[i];
+        uint32_t t = sourceLine.firstToken;
+        if( sourceLine.tokenCount && TokenKind(source.tokens[t].kind)==TokenKind::Label )
+            ++t;
+        if( t>=sourceLine.firstToken+sourceLine.tokenCount
+            || (TokenKind(source.tokens[t].kind)!=TokenKind::Directive && (macros.empty() || TokenKind(source.tokens[t].kind)!=TokenKind::Identifier)) )
+            continue;
+        CodeLine line = source.code_line(file, i);
+        Token first = line.tokens.front();
+        std::string prefix;     // the label of the line, which stays outside an expansion
+        if( line.labeled )
+            prefix = std::string(line.label) + ":\n";
         
-        
-        std::unique_ptr<SourceFile> inclusion;
-        // if we have a valid #include line
-        if( ! includeFilePath.empty() )
+        if( first.kind==TokenKind::Directive && first.text=="define" )
+        {
+            int value = 0;
+            if( line.labeled || line.tokens.size()!=3 || line.tokens[1].kind!=TokenKind::Identifier )
+                return error(i, "#define");
+            if( !eval_expression(line.tokens[2].text, source.constants, value) )
+                return error(i, "invalid constant expression: " + std::string(line.tokens[2].text));
+            if( !source.constants.emplace(line.tokens[1].text, value).second )
+                return error(i, "duplicated constant: " + std::string(line.tokens[1].text));
+            source.lines[i].tokenCount = 0;
+        }
+        else if( first.kind==TokenKind::Directive && first.text=="macro" )
         {
-            inclusion = std::make_unique<SourceFile>();
-            //if( !recurse_load(includeFilePath, *inclusion, level+1) )
-            if( !inclusionHandler(includeFilePath, *inclusion, level+1) )
+            DataDirective directive;
+            MacroDefinition macro;
+            if( line.labeled || line.tokens.size()<2 || line.tokens[1].kind!=TokenKind::Identifier || find_data_directive(line.tokens[1].text, directive) )
+                return error(i, "#macro");
+            // parameters: p1, p2, ...
+            for(size_t t=2; t<line.tokens.size(); ++t)
             {
-                std::cout << "["<<level<<"] " << "At: " << filePath << ", Line: " << number << std::endl
-                    <<"    " << original << std::endl;
+                Token token = line.tokens[t];
+                if( t%2==1 )
+                {
+                    if( token.kind!=TokenKind::Comma || t+1==line.tokens.size() )
+                        return error(i, "#macro parameters");
+                    continue;
+                }
+                if( token.kind!=TokenKind::Identifier || is_digit(token.text[0]) || !std::all_of(token.text.begin(), token.text.end(), is_symbol_char) )
+                    return error(i, "#macro parameters");
+                macro.params.emplace_back(token.text);
+            }
+            uint32_t end = 0;
+            if( !findEnd(true, end, macro.localLabels) )
+                return false;
+            std::string name(line.tokens[1].text);
+            macro.file = file;
+            macro.firstLine = i+1;
+            macro.lineCount = end-i-1;
+            macro.site = site(i);
+            if( !macros.emplace(name, std::move(macro)).second )
+                return error(i, "duplicated macro: " + name);
+            for(; i<=end; ++i)
+                source.lines[i].tokenCount = 0;
+            --i;
+        }
+        else if( first.kind==TokenKind::Directive && first.text=="rept" )
+        {
+            int count = 0;
+            size_t size = line.tokens.size();
+            if( (size!=2 && size!=4) || (size==4 && (line.tokens[2].kind!=TokenKind::Comma || line.tokens[3].kind!=TokenKind::Identifier)) )
+                return error(i, "#rept");
+            if( !eval_expression(line.tokens[1].text, source.constants, count) || count<0 || count>0x10000 )
+                return error(i, "invalid #rept count: " + std::string(line.tokens[1].text));
+            uint32_t end = 0;
+            std::vector<std::string> labels;
+            if( !findEnd(false, end, labels) || !grow(uint64_t(count)*(end-i-1)) )
                 return false;
+            std::string text = prefix;
+            for(int n=0; n<count; ++n)
+            {
+                std::map<std::string, std::string, std::less<>> replacements;
+                for(const std::string& label : labels)
+                    replacements[label] = label + "@" + std::to_string(expansions);
+                if( size==4 )
+                    replacements[std::string(line.tokens[3].text)] = std::to_string(n);
+                ++expansions;
+                bodyText(file, i+1, end-i-1, replacements, text);
             }
+            if( !addExpansion("(#rept at " + site(i) + ")", text) )
+                return false;
+            for(uint32_t j=i+1; j<=end; ++j)
+                source.lines[j].tokenCount = 0;
+            i = end;
+        }
+        else if( first.kind==TokenKind::Directive && (first.text=="endm" || first.text=="endr") )
+            return error(i, "#" + std::string(first.text) + " without #" + (first.text=="endm" ? "macro" : "rept"));
+        else if( first.kind==TokenKind::Identifier && macros.find(first.text)!=macros.end() )
+        {
+            const MacroDefinition& macro = macros.find(first.text)->second;
+            
+            // arguments are separated by commas, and are the verbatim text of their tokens.
+            std::vector<std::string_view> args;
+            const char* begin = nullptr;
+            const char* end = nullptr;
+            for(size_t t=1; t<=line.tokens.size(); ++t)
+            {
+                if( t==line.tokens.size() || line.tokens[t].kind==TokenKind::Comma )
+                {
+                    if( !begin )
+                    {
+                        if( t==line.tokens.size() && t==1 )
+                            break;      // no arguments.
+                        return error(i, "empty macro argument");
+                    }
+                    args.emplace_back(begin, size_t(end-begin));
+                    begin = nullptr;
+                    continue;
+                }
+                Token token = line.tokens[t];
+                const char* tokenBegin = token.text.data();
+                const char* tokenEnd = token.text.data() + token.text.size();
+                if( token.kind==TokenKind::Memory )
+                {
+                    // include the brackets.
+                    while( *tokenBegin!='[' )
+                        --tokenBegin;
+                    while( *tokenEnd!=']' )
+                        ++tokenEnd;
+                    ++tokenEnd;
+                }
+                if( !begin )
+                    begin = tokenBegin;
+                end = tokenEnd;
+            }
+            if( args.size()!=macro.params.size() )
+                return error(i, "wrong number of arguments for macro " + std::string(first.text));
+            
+            std::map<std::string, std::string, std::less<>> replacements;
+            for(const std::string& label : macro.localLabels)
+                replacements[label] = label + "@" + std::to_string(expansions);
+            for(size_t a=0; a<args.size(); ++a)
+                replacements[macro.params[a]] = std::string(args[a]);
+            ++expansions;
+            if( !grow(macro.lineCount) )
+                return false;
+            std::string text = prefix;
+            bodyText(macro.file, macro.firstLine, macro.lineCount, replacements, text);
+            if( !addExpansion("(macro " + std::string(first.text) + " defined at " + macro.site + ")", text) )
+                return false;
         }
-        
-        CodeLine line{ number, original, regularized, std::move(inclusion), {} };
-        file.lines.push_back(std::move(line));
-        
-        ++number;
     }
     return true;
 }
 
-inline bool Loader::load(const std::string& filePath, SourceFile& file)
+inline bool Loader::load(const std::string& filePath, SourceFile& source)
 {
-    return recurse_load(filePath, file, 0);
+    // a huge source or expansion must not abort the host, so running out of memory is an error.
+    try
+    {
+        source = SourceFile();
+        macros.clear();
+        expansions = 0;
+        expandedLines = 0;
+        uint32_t file = 0;
+        if( threads>1 ? !load_parallel(filePath, source) : !recurse_load(filePath, source, 0, file) )
+            return false;
+        return expand(source, 0, 0, 0);
+    }
+    catch(const std::bad_alloc&)
+    {
+        source = SourceFile();
+        *log << "Error: out of memory loading " << filePath << std::endl;
+        return false;
+    }
 }
 
-inline bool Loader::loadFromString(const std::string& sourceCodeContents, SourceFile& file)
-{
-    std::istringstream ss(sourceCodeContents);
-    return load_istream("<<DUMMY_MEMORY>>", ss, file, 0,
-                      // if load_istream encounters #include, this function below will be called to handle that.
-                      [](const std::string& includePath, SourceFile& file, int level){
-                            assert(false);
-                            std::cout << "["<<level<<"] " << "<<DUMMY_MEMORY>> source code cannot handle #include: " << includePath << std::endl;
-                            return false;
-                      }
-    );
+inline bool Loader::loadFromString(const std::string& sourceCodeContents, SourceFile& source)
+{
+    try
+    {
+        const std::string filePath = "<<DUMMY_MEMORY>>";
+        source = SourceFile();
+        auto buffer = SourceBuffer::copy(sourceCodeContents);
+        FileContents contents;
+        if( !load_buffer(filePath, *buffer, contents, 0, *log) )
+            return false;
+        if( !contents.includes.empty() )
+        {
+            const FileContents::Include& include = contents.includes.front();
+            *log << "[1] " << filePath << " source code cannot handle #include: " << buffer->view().substr(include.offset, include.size) << std::endl;
+            print_include_site(*log, 0, filePath, *buffer, contents, include);
+            return false;
+        }
+        macros.clear();
+        expansions = 0;
+        expandedLines = 0;
+        source.set_lines(source.add_file(filePath, buffer), std::move(contents));
+        return expand(source, 0, 0, 0);
+    }
+    catch(const std::bad_alloc&)
+    {
+        source = SourceFile();
+        *log << "Error: out of memory loading source code" << std::endl;
+        return false;
+    }
 }
 
 //==============================================================================================================================
 //==============================================================================================================================
 
-// label must be the first token like "label:"
-// input tokens must have stripped away comments
-// return non-empty label string excluding ':' if this line has a leading label
-// tokens will not include label after calling this function.
-inline bool detect_and_remove_label_for_line(std::vector<std::string>& tokens, std::string& label)
+// tokens are the tokens of a line.
+// return false if the line is a malformed #include; otherwise return true with
+// includeFilePath set to the included path (without quotes) for #include, or empty for other lines.
+inline bool parse_include_line(const std::vector<Token>& tokens, std::string_view& includeFilePath)
+{
+    includeFilePath = {};
+    if( tokens.empty() || tokens[0].kind!=TokenKind::Directive || tokens[0].text!="include" )
+        return true;
+    if( tokens.size()!=2 || tokens[1].kind!=TokenKind::String || tokens[1].text.size()<=2 )
+        return false;
+    includeFilePath = tokens[1].text.substr(1, tokens[1].text.size()-2);
+    return true;
+}
+
+// case-insensitive. return false if name is not a data directive.
+inline bool find_data_directive(std::string_view name, DataDirective& directive)
 {
-    if (tokens.size()>0 && tokens.front().back()==':')
+    static constexpr std::string_view names[] = {"DB", "DW", "DX", "DS", "ALIGN", "DD"};
+    for(size_t i=0; i<std::size(names); ++i)
     {
-        std::string lab = tokens.front();
-        lab.pop_back();
-        if( lab.empty() )
-            return false;   // label cannot be empty: error
-        label = lab;
-        tokens.erase(tokens.begin());
+        if( name.size()==names[i].size() && std::equal(name.begin(), name.end(), names[i].begin(),
+                                                      [](char a, char b){ return toupper((unsigned char)a)==b; }) )
+        {
+            directive = DataDirective(i);
+            return true;
+        }
+    }
+    return false;
+}
+
+// first pass check of a single non-#include line: the leading label must not be empty, and a non-empty line must be
+// an instruction or a data directive.
+// return false with a short description in error if the line is invalid; otherwise kind tells what the line is.
+inline bool check_line(const CodeLine& line, LineKind& kind, std::string& error)
+{
+    if( line.labeled && line.label.empty() )
+    {
+        error = "invalid label";    // label cannot be empty
+        return false;
+    }
+    kind = LineKind::Empty;
+    if( line.tokens.empty() )
         return true;
+    Token token = line.tokens.front();
+    DataDirective directive;
+    if( token.kind==TokenKind::Mnemonic )
+        kind = LineKind::Instruction;
+    else if( token.kind==TokenKind::Identifier && find_data_directive(token.text, directive) )
+        kind = LineKind::Data;
+    else
+    {
+        // other non-empty label-removed lines are not allowed
+        error = "unrecognized instruction: `";
+        if( token.kind==TokenKind::Directive )
+            error += "#";
+        error += std::string(token.text) + "` ";
+        return false;
     }
-    label.clear();  // no label.
     return true;
 }
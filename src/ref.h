@@ -1,9 +1,15 @@
 #pragma once
 
 #include <string>
+#include <string_view>
 #include <map>
+#include <unordered_map>
+#include <array>
 #include <vector>
-#include <sstream>
+#include <type_traits>
+#include <cassert>
+#include <cstdint>
+#include <algorithm>
 
 enum class Opcode : uint8_t
 {
@@ -12,6 +18,8 @@ enum class Opcode : uint8_t
     STB = 0x03,
     LDS = 0x04,
     STS = 0x05,
+    LDW = 0x06,
+    STW = 0x07,
 
     ADD = 0x10,
     SUB = 0x11,
@@ -36,13 +44,41 @@ enum class Opcode : uint8_t
     CLL = 0x35,
     RET = 0x36,
     HLT = 0x37,
+    JNE = 0x38,
+    JLE = 0x39,
+    JGE = 0x3A,
+    JPB = 0x3B,
+    JBE = 0x3C,
+    JPA = 0x3D,
+    JAE = 0x3E,
+    CMV = 0x3F,
     
     PSH = 0x40,
     POP = 0x41,
+
+    BFL = 0x50,
+    BCP = 0x51,
+    BCM = 0x52,
+    BSC = 0x53,
+
+    PAB = 0x60,
+    PSB = 0x61,
+    PCE = 0x62,
+    PCB = 0x63,
+    PHB = 0x64,
+    BSW = 0x65,
     
     KBD = 0x70,
     DSP = 0x71,
-    DPL = 0x72
+    DPL = 0x72,
+    FOP = 0x73,
+    FMP = 0x74,
+    FAV = 0x75,
+    FFL = 0x76,
+
+    CAS = 0x80,
+    FAD = 0x81,
+    CID = 0x82
 };
 
 enum class Register : uint8_t
@@ -63,210 +99,587 @@ enum class Register : uint8_t
 struct InstructionData
 {
     Opcode  opcode;
-    int     operandCount;   // 2, 1, 0
+    int     operandCount;   // 3 (CMV, block), 2, 1, 0
     bool    operand2Memory; // if having operand, is operand2 true for load/store/jump/call/dpl instructions: need memory location (i.e., [])
+                            // true for block instructions, which work on memory ranges.
+    
+    // loads and stores, whose register memory operand can also be [reg+imm] or [reg+], see IndexedOperand.
+    constexpr bool indexed() const { return operandCount==2 && operand2Memory; }
+    // block instructions: reg1, reg2, reg3 with a byte count in reg3, see BlockOperand. CAS has the same form.
+    constexpr bool block() const { return operandCount==3 && operand2Memory; }
+};
+
+// operand1 bit of an instruction of the 32-bit machine whose num/mem/label operand2 (flag 1) is 32-bit: the operand2
+// field is 0, and the operand2 value is the next 32-bit word after the instruction. operand1 is a register of 7 bits,
+// but all registers are below 0x40.
+constexpr uint8_t WIDE_OPERAND = 0x40;
+
+// bits of SR, set by CMP.
+constexpr uint16_t SR_ZERO      = 0x01;     // Z: equal
+constexpr uint16_t SR_NEGATIVE  = 0x02;     // N: less, signed
+constexpr uint16_t SR_CARRY     = 0x04;     // C: below, unsigned
+
+// condition of a conditional jump or move, tested on SR.
+enum class Condition : uint8_t
+{
+    EQ, NE,                 // equal, not equal
+    LT, LE, GT, GE,         // signed
+    B,  BE, A,  AE,         // unsigned: below, below or equal, above, above or equal
 };
 
-inline const std::map<std::string, InstructionData>& getInstructionMap()
+inline constexpr std::string_view CONDITION_NAMES[] = {"EQ", "NE", "LT", "LE", "GT", "GE", "B", "BE", "A", "AE"};
+
+constexpr bool condition_holds(Condition condition, uint16_t sr)
 {
-    static const std::map<std::string, InstructionData> s_instruction_map = {
-        //                  // reg, reg/num/mem
-        {"MOV", {Opcode::MOV, 2, false}},
-        {"LDB", {Opcode::LDB, 2, true }},
-        {"STB", {Opcode::STB, 2, true }},
-        {"LDS", {Opcode::LDS, 2, true }},
-        {"STS", {Opcode::STS, 2, true }},
-        
-        //                  // reg, reg/num
-        {"ADD", {Opcode::ADD, 2, false}},
-        {"SUB", {Opcode::SUB, 2, false}},
-        {"MUL", {Opcode::MUL, 2, false}},
-        {"DIV", {Opcode::DIV, 2, false}},
-        {"MOD", {Opcode::MOD, 2, false}},
-        {"INC", {Opcode::INC, 1, false}},   // (reg only)
-        {"DEC", {Opcode::DEC, 1, false}},   // (reg only)
-        
-        //                  // reg, reg/num
-        {"AND", {Opcode::AND, 2, false}},
-        {"OR_", {Opcode::OR_, 2, false}},
-        {"XOR", {Opcode::XOR, 2, false}},
-        {"NOT", {Opcode::NOT, 1, false}},   // (reg only)
-        {"SHL", {Opcode::SHL, 2, false}},
-        {"SHR", {Opcode::SHR, 2, false}},
-
-        //                  // reg/mem
-        {"CMP", {Opcode::CMP, 2}},   // (reg, reg/num)
-        {"JPE", {Opcode::JPE, 1, true }},
-        {"JPL", {Opcode::JPL, 1, true }},
-        {"JPG", {Opcode::JPG, 1, true }},
-        {"JMP", {Opcode::JMP, 1, true }},
-        {"CLL", {Opcode::CLL, 1, true }},
-        {"RET", {Opcode::RET, 0, true }},
-        {"HLT", {Opcode::HLT, 0, false}},
-
-        {"PSH", {Opcode::PSH, 1, false}},   // reg/num
-        {"POP", {Opcode::POP, 1, false}},   // (reg only)
-        
-        {"KBD", {Opcode::KBD, 0, false}},
-        {"DSP", {Opcode::DSP, 0, false}},
-        {"DPL", {Opcode::DPL, 1, true }}
-    };
-    return s_instruction_map;
+    bool z = sr & SR_ZERO;
+    bool n = sr & SR_NEGATIVE;
+    bool c = sr & SR_CARRY;
+    switch( condition )
+    {
+        case Condition::EQ: return z;
+        case Condition::NE: return !z;
+        case Condition::LT: return n;
+        case Condition::LE: return n || z;
+        case Condition::GT: return !n && !z;
+        case Condition::GE: return !n;
+        case Condition::B:  return c;
+        case Condition::BE: return c || z;
+        case Condition::A:  return !c && !z;
+        case Condition::AE: return !c;
+    }
+    return false;
 }
 
-inline const std::map<std::string, Register>& getRegisterMap()
+// the condition of a conditional jump. false if opcode is not one.
+constexpr bool jump_condition(Opcode opcode, Condition& condition)
 {
-    static const std::map<std::string, Register> s_register_map = {
-        {"RA", Register::RA},
-        {"RB", Register::RB},
-        {"RC", Register::RC},
-        {"RD", Register::RD},
-        {"RE", Register::RE},
-        {"RF", Register::RF},
-        {"SP", Register::SP},
-        {"PC", Register::PC},
-        {"SR", Register::SR},
-    };
-    return s_register_map;
+    switch( opcode )
+    {
+        case Opcode::JPE: condition = Condition::EQ; return true;
+        case Opcode::JNE: condition = Condition::NE; return true;
+        case Opcode::JPL: condition = Condition::LT; return true;
+        case Opcode::JLE: condition = Condition::LE; return true;
+        case Opcode::JPG: condition = Condition::GT; return true;
+        case Opcode::JGE: condition = Condition::GE; return true;
+        case Opcode::JPB: condition = Condition::B;  return true;
+        case Opcode::JBE: condition = Condition::BE; return true;
+        case Opcode::JPA: condition = Condition::A;  return true;
+        case Opcode::JAE: condition = Condition::AE; return true;
+        default: return false;
+    }
 }
 
-//===============================================================================================
-//===============================================================================================
+// operand2 of CMV cc, reg, reg/num:
+//   bits 12-15: the Condition
+//   bits 0-11:  the register (flag 0), or a signed immediate of MIN_IMMEDIATE..MAX_IMMEDIATE (flag 1).
+struct ConditionalOperand
+{
+    static constexpr int    MIN_IMMEDIATE = -2048;
+    static constexpr int    MAX_IMMEDIATE = 2047;
 
-template<class T>
-inline std::string integer_as_hex(T x)
+    Condition   condition;
+    int16_t     value;      // register or immediate
+
+    static constexpr ConditionalOperand decode(uint16_t operand2)
+    {
+        int value = operand2 & 0xfff;
+        return { Condition(operand2 >> 12), int16_t(value >= 0x800 ? value - 0x1000 : value) };
+    }
+    constexpr uint16_t encode() const
+    {
+        return uint16_t((uint16_t(condition) << 12) | (value & 0xfff));
+    }
+};
+
+// operand2 of a load or store with a register memory operand (flag 0):
+//   bits 0-6:  the register, as for [reg]
+//   bit 7:     [reg+]: post-increment; reg is increased by the access size (1 for LDB/STB, 2 for LDS/STS) after access.
+//   bits 8-15: [reg+imm]: the signed offset imm, added to reg for the address; 0 for [reg].
+// so [reg] keeps its encoding.
+struct IndexedOperand
 {
-    std::ostringstream os;
-    os << std::right << std::setfill('0') << std::setw((sizeof(x)*2)) << std::hex;
-    if constexpr( sizeof(T)==1 )
-        os << uint16_t(uint8_t(x));     // it seems uint8_t is not handled correctly by STL.
-    else
-        os << x;
-    return os.str();
+    static constexpr uint16_t   POST_INCREMENT = 0x80;
+    static constexpr int        MIN_OFFSET = -128;
+    static constexpr int        MAX_OFFSET = 127;
+
+    uint8_t     reg;
+    bool        postIncrement;
+    int8_t      offset;
+
+    static constexpr IndexedOperand decode(uint16_t operand2)
+    {
+        return { uint8_t(operand2 & 0x7f), (operand2 & POST_INCREMENT)!=0, int8_t(uint8_t(operand2 >> 8)) };
+    }
+    constexpr uint16_t encode() const
+    {
+        return uint16_t(reg | (postIncrement ? POST_INCREMENT : 0) | (uint8_t(offset) << 8));
+    }
+};
+
+// operand2 of a block instruction reg1, reg2, reg3 (flag 0):
+//   bits 0-6:  reg2: the second address (BCP, BCM), the byte to fill with or search for (BFL, BSC), or the result (FMP)
+//   bits 8-14: reg3: the byte count
+// reg1 is the first address, in operand1.
+struct BlockOperand
+{
+    uint8_t     reg;
+    uint8_t     count;
+
+    static constexpr BlockOperand decode(uint16_t operand2)
+    {
+        return { uint8_t(operand2 & 0x7f), uint8_t((operand2 >> 8) & 0x7f) };
+    }
+    constexpr uint16_t encode() const
+    {
+        return uint16_t((reg & 0x7f) | ((count & 0x7f) << 8));
+    }
+};
+
+struct InstructionInfo
+{
+    std::string_view    name;
+    InstructionData     data;
+};
+
+struct RegisterInfo
+{
+    std::string_view    name;
+    Register            reg;
+};
+
+// The ISA description. The lookup tables below are generated from it at compile time.
+inline constexpr InstructionInfo ISA_INSTRUCTIONS[] = {
+    //                  // reg, reg/num/mem
+    {"MOV", {Opcode::MOV, 2, false}},
+    {"LDB", {Opcode::LDB, 2, true }},
+    {"STB", {Opcode::STB, 2, true }},
+    {"LDS", {Opcode::LDS, 2, true }},
+    {"STS", {Opcode::STS, 2, true }},
+    {"LDW", {Opcode::LDW, 2, true }},   // word: a short on the 16-bit machine, 4 bytes on the 32-bit one
+    {"STW", {Opcode::STW, 2, true }},
+    
+    //                  // reg, reg/num
+    {"ADD", {Opcode::ADD, 2, false}},
+    {"SUB", {Opcode::SUB, 2, false}},
+    {"MUL", {Opcode::MUL, 2, false}},
+    {"DIV", {Opcode::DIV, 2, false}},
+    {"MOD", {Opcode::MOD, 2, false}},
+    {"INC", {Opcode::INC, 1, false}},   // (reg only)
+    {"DEC", {Opcode::DEC, 1, false}},   // (reg only)
+    
+    //                  // reg, reg/num
+    {"AND", {Opcode::AND, 2, false}},
+    {"OR_", {Opcode::OR_, 2, false}},
+    {"XOR", {Opcode::XOR, 2, false}},
+    {"NOT", {Opcode::NOT, 1, false}},   // (reg only)
+    {"SHL", {Opcode::SHL, 2, false}},
+    {"SHR", {Opcode::SHR, 2, false}},
+
+    //                  // reg/mem
+    {"CMP", {Opcode::CMP, 2, false}},   // (reg, reg/num)
+    {"JPE", {Opcode::JPE, 1, true }},
+    {"JNE", {Opcode::JNE, 1, true }},
+    {"JPL", {Opcode::JPL, 1, true }},
+    {"JLE", {Opcode::JLE, 1, true }},
+    {"JPG", {Opcode::JPG, 1, true }},
+    {"JGE", {Opcode::JGE, 1, true }},
+    {"JPB", {Opcode::JPB, 1, true }},   // unsigned
+    {"JBE", {Opcode::JBE, 1, true }},
+    {"JPA", {Opcode::JPA, 1, true }},
+    {"JAE", {Opcode::JAE, 1, true }},
+    {"JMP", {Opcode::JMP, 1, true }},
+    {"CLL", {Opcode::CLL, 1, true }},
+    {"RET", {Opcode::RET, 0, true }},
+    {"HLT", {Opcode::HLT, 0, false}},
+    {"CMV", {Opcode::CMV, 3, false}},   // (cc, reg, reg/num)
+
+    {"PSH", {Opcode::PSH, 1, false}},   // reg/num
+    {"POP", {Opcode::POP, 1, false}},   // (reg only)
+
+    //                  // reg, reg, reg
+    {"BFL", {Opcode::BFL, 3, true }},   // fill
+    {"BCP", {Opcode::BCP, 3, true }},   // copy
+    {"BCM", {Opcode::BCM, 3, true }},   // compare
+    {"BSC", {Opcode::BSC, 3, true }},   // scan for a byte
+
+    //                  // reg, reg/num: each of the 2 bytes on its own
+    {"PAB", {Opcode::PAB, 2, false}},   // add
+    {"PSB", {Opcode::PSB, 2, false}},   // subtract
+    {"PCE", {Opcode::PCE, 2, false}},   // compare equal: byte mask
+    {"PCB", {Opcode::PCB, 2, false}},   // compare below, unsigned: byte mask
+    {"PHB", {Opcode::PHB, 2, false}},   // has byte: SR
+    {"BSW", {Opcode::BSW, 1, false}},   // (reg only) swap bytes
+    
+    {"KBD", {Opcode::KBD, 0, false}},
+    {"DSP", {Opcode::DSP, 0, false}},
+    {"DPL", {Opcode::DPL, 1, true }},
+
+    //                  // host file device, see file_device.h
+    {"FOP", {Opcode::FOP, 2, true }},   // (reg, mem) open the file named by the xstring
+    {"FMP", {Opcode::FMP, 3, true }},   // (reg, reg, reg) map the window
+    {"FAV", {Opcode::FAV, 1, false}},   // (reg only) advance the window
+    {"FFL", {Opcode::FFL, 1, false}},   // (reg only) flush the window
+
+    //                  // atomic, on a short shared by the cores
+    {"CAS", {Opcode::CAS, 3, true }},   // (reg, reg, reg) compare and swap
+    {"FAD", {Opcode::FAD, 2, true }},   // (reg, mem) fetch and add
+    {"CID", {Opcode::CID, 1, false}},   // (reg only) core id
+};
+
+inline constexpr RegisterInfo ISA_REGISTERS[] = {
+    {"RA", Register::RA},
+    {"RB", Register::RB},
+    {"RC", Register::RC},
+    {"RD", Register::RD},
+    {"RE", Register::RE},
+    {"RF", Register::RF},
+    {"SP", Register::SP},
+    {"PC", Register::PC},
+    {"SR", Register::SR},
+};
+
+// pack a name of up to 4 characters into an integer, upper-cased. 0 if the name is empty or longer.
+constexpr uint32_t pack_name(std::string_view name)
+{
+    if( name.empty() || name.size()>4 )
+        return 0;
+    uint32_t key = 0;
+    for(char c : name)
+        key = (key << 8) | uint8_t(c>='a' && c<='z' ? c-'a'+'A' : c);
+    return key;
 }
 
-//===============================================================================================
-//===============================================================================================
+// perfect hash of the packed names of an ISA table: every name has a slot of its own, so a lookup is one multiply,
+// one shift and one compare. the multiplier is searched for at compile time.
+template<int BITS>
+struct NameHash
+{
+    static constexpr size_t SLOTS = size_t(1) << BITS;
+    
+    uint32_t                        multiplier = 0;     // 0 if no perfect hash was found.
+    std::array<uint32_t, SLOTS>     keys{};             // packed name in the slot, or 0
+    std::array<int8_t, SLOTS>       entries{};          // index into the ISA table, or -1
 
-inline std::string findInstructionName(Opcode opc)
+    constexpr size_t slot(uint32_t key) const { return (key * multiplier) >> (32 - BITS); }
+    
+    // index into the ISA table of the name, or -1.
+    constexpr int find(std::string_view name) const
+    {
+        uint32_t key = pack_name(name);
+        size_t s = slot(key);
+        return (key && keys[s]==key) ? entries[s] : -1;
+    }
+};
+
+template<int BITS, class Info, size_t N>
+constexpr NameHash<BITS> make_name_hash(const Info (&table)[N])
 {
-    std::string instruction;
-    auto& instruction_map = getInstructionMap();
-    for(auto& entry : instruction_map)
+    static_assert( N < 128, "entries are indexed by int8_t" );
+    NameHash<BITS> hash;
+    for(uint32_t multiplier = 0x9E3779B1u; multiplier < 0x9E3779B1u + 20000; multiplier += 2)
     {
-        if( entry.second.opcode == opc )
+        hash.multiplier = multiplier;
+        bool perfect = true;
+        for(size_t s=0; s<hash.SLOTS; ++s)
+        {
+            hash.keys[s] = 0;
+            hash.entries[s] = -1;
+        }
+        for(size_t i=0; i<N && perfect; ++i)
         {
-            instruction = entry.first;
-            break;
+            uint32_t key = pack_name(table[i].name);
+            size_t s = hash.slot(key);
+            perfect = key!=0 && hash.keys[s]==0;
+            hash.keys[s] = key;
+            hash.entries[s] = int8_t(i);
         }
+        if( perfect )
+            return hash;
     }
-    return instruction;
+    hash.multiplier = 0;
+    return hash;
 }
 
-inline std::string findRegisterName(Register reg)
+inline constexpr auto INSTRUCTION_HASH = make_name_hash<9>(ISA_INSTRUCTIONS);
+inline constexpr auto REGISTER_HASH = make_name_hash<5>(ISA_REGISTERS);
+static_assert( INSTRUCTION_HASH.multiplier!=0, "no perfect hash for instruction names; names must be unique" );
+static_assert( REGISTER_HASH.multiplier!=0, "no perfect hash for register names; names must be unique" );
+
+// reverse table, from the encoded value of each entry to its index into the ISA table, or -1.
+template<size_t SIZE, class Info, size_t N, class Code>
+constexpr std::array<int8_t, SIZE> make_code_table(const Info (&table)[N], Code code)
+{
+    std::array<int8_t, SIZE> codes{};
+    for(size_t c=0; c<SIZE; ++c)
+        codes[c] = -1;
+    for(size_t i=0; i<N; ++i)
+        codes[code(table[i])] = int8_t(i);
+    return codes;
+}
+
+// by opcode
+inline constexpr auto OPCODE_TABLE = make_code_table<256>(ISA_INSTRUCTIONS, [](const InstructionInfo& info){ return size_t(info.data.opcode); });
+// by 7-bit register operand
+inline constexpr auto REGISTER_TABLE = make_code_table<128>(ISA_REGISTERS, [](const RegisterInfo& info){ return size_t(info.reg); });
+
+// case-insensitive name lookups that do not allocate. nullptr if there is no such name.
+constexpr const InstructionData* findInstruction(std::string_view name)
 {
-    std::string name;
-    auto& register_map = getRegisterMap();
-    for(auto& entry : register_map)
+    int i = INSTRUCTION_HASH.find(name);
+    return i<0 ? nullptr : &ISA_INSTRUCTIONS[i].data;
+}
+
+constexpr const Register* findRegister(std::string_view name)
+{
+    int i = REGISTER_HASH.find(name);
+    return i<0 ? nullptr : &ISA_REGISTERS[i].reg;
+}
+
+// case-insensitive. false if name is not a condition.
+constexpr bool findCondition(std::string_view name, Condition& condition)
+{
+    uint32_t key = pack_name(name);
+    for(size_t i=0; i<std::size(CONDITION_NAMES); ++i)
     {
-        if( entry.second == reg )
+        if( key!=0 && pack_name(CONDITION_NAMES[i])==key )
         {
-            name = entry.first;
-            break;
+            condition = Condition(i);
+            return true;
         }
     }
-    return name;
+    return false;
 }
 
-inline std::string findLabel(const std::map<std::string, int>& label_map, int loc)
+// nullptr if there is no such opcode.
+constexpr const InstructionInfo* findInstruction(Opcode opc)
 {
-    std::string label;
-    for(auto& entry : label_map)
+    int i = OPCODE_TABLE[uint8_t(opc)];
+    return i<0 ? nullptr : &ISA_INSTRUCTIONS[i];
+}
+
+// empty if there is no such instruction/register.
+constexpr std::string_view findInstructionName(Opcode opc)
+{
+    const InstructionInfo* info = findInstruction(opc);
+    return info ? info->name : std::string_view();
+}
+
+constexpr std::string_view findRegisterName(Register reg)
+{
+    int i = uint8_t(reg)<REGISTER_TABLE.size() ? REGISTER_TABLE[uint8_t(reg)] : -1;
+    return i<0 ? std::string_view() : ISA_REGISTERS[i].name;
+}
+
+static_assert( findInstruction("mov")->opcode==Opcode::MOV && findInstructionName(Opcode::DPL)=="DPL" );
+static_assert( ConditionalOperand::decode(ConditionalOperand{Condition::AE, -2048}.encode()).value==-2048 && condition_holds(Condition::BE, SR_ZERO) );
+static_assert( findInstruction("lds")->indexed() && !findInstruction("jmp")->indexed() && !findInstruction("add")->indexed() );
+static_assert( IndexedOperand::decode(IndexedOperand{0x10, false, -2}.encode()).offset==-2 && IndexedOperand{0x02, false, 0}.encode()==0x02 );
+static_assert( findInstruction("bcp")->block() && !findInstruction("cmv")->block() && BlockOperand::decode(BlockOperand{0x12, 0x10}.encode()).count==0x10 );
+static_assert( *findRegister("sp")==Register::SP && findRegisterName(Register::SR)=="SR" && !findRegister("RG") );
+
+// label name -> address. the comparator allows lookups by std::string_view.
+using LabelMap = std::map<std::string, int, std::less<>>;
+
+// address -> label name, for disassembly. if several labels share an address, the first one in LabelMap order is used.
+// labels below immediateStart (e.g. data labels) are only used for memory operands, so that small immediate numbers are
+// not shown as labels.
+class LabelIndex
+{
+public:
+    LabelIndex() = default;
+    explicit LabelIndex(const LabelMap& label_map, int immediateStart = 0) : immediateStart_(immediateStart)
     {
-        if( entry.second == loc )
-        {
-            label = entry.first;
-            break;
-        }
+        labels_.reserve(label_map.size());
+        for(auto& entry : label_map)
+            labels_.emplace(entry.second, entry.first);    // emplace keeps the first label of an address.
+    }
+    
+    // empty if there is no label at loc. the name is a view into the LabelMap the index was made of.
+    std::string_view find(int loc, bool memory = true) const
+    {
+        if( !memory && loc<immediateStart_ )
+            return {};
+        auto it = labels_.find(loc);
+        return it==labels_.end() ? std::string_view() : it->second;
+    }
+
+private:
+    std::unordered_map<int, std::string_view>  labels_;
+    int                                         immediateStart_ = 0;
+};
+
+//===============================================================================================
+//===============================================================================================
+
+// write x as sizeof(T)*2 hex digits, zero-padded, without allocating. return the end of the digits.
+template<class T>
+inline char* format_hex(char* out, T x)
+{
+    auto u = std::make_unsigned_t<T>(x);
+    for(int i=int(sizeof(T))*2-1; i>=0; --i)
+    {
+        out[i] = "0123456789abcdef"[u & 0xf];
+        u >>= 4;
     }
-    return label;
+    return out + sizeof(T)*2;
 }
 
-inline std::string decodeOperand2(uint16_t operand2, bool flag, bool operand2Memory, const std::map<std::string, int>& label_map = {})
+template<class T>
+inline void append_hex(std::string& out, T x)
+{
+    char digits[sizeof(T)*2];
+    out.append(digits, format_hex(digits, x));
+}
+
+template<class T>
+inline std::string integer_as_hex(T x)
+{
+    std::string hex;
+    append_hex(hex, x);
+    return hex;
+}
+
+//===============================================================================================
+//===============================================================================================
+
+// append operand2 to out, as a label, hex number or register name. false if it is not a valid register.
+// indexed: a register operand2 is an IndexedOperand. wide: operand2 is a 32-bit num/mem/label, see WIDE_OPERAND.
+inline bool append_operand2(std::string& out, uint32_t operand2, bool flag, bool operand2Memory, const LabelIndex& labels, bool indexed = false, bool wide = false)
 {
-    std::string operand2Name;
+    if( operand2Memory )
+        out += '[';
     if( flag )
     {
         // num/mem/label
-        operand2Name = findLabel(label_map, (int16_t)operand2);
-        if( operand2Name.empty() )
+        std::string_view label = labels.find(wide ? int(operand2) : int16_t(operand2), operand2Memory);
+        if( !label.empty() )
+            out += label;
+        else
         {
-            operand2Name = "0x";
-            operand2Name += integer_as_hex(operand2);
+            out += "0x";
+            if( wide )
+                append_hex(out, operand2);
+            else
+                append_hex(out, uint16_t(operand2));
+        }
+    }
+    else if( indexed )
+    {
+        // [reg], [reg+imm] or [reg+]
+        IndexedOperand index = IndexedOperand::decode(operand2);
+        std::string_view name = findRegisterName((Register)(index.reg));
+        if( name.empty() || (index.postIncrement && index.offset!=0) )
+            return false;
+        out += name;
+        if( index.postIncrement )
+            out += '+';
+        else if( index.offset!=0 )
+        {
+            out += index.offset<0 ? "-0x" : "+0x";
+            append_hex(out, uint8_t(index.offset<0 ? -index.offset : index.offset));
         }
     }
     else
     {
         // reg
-        assert( operand2 <= uint16_t(0x7f) );
-        Register reg = (Register)(operand2);
-        operand2Name = findRegisterName(reg);
-        assert( !operand2Name.empty() );
+        std::string_view name = operand2 <= uint16_t(0x7f) ? findRegisterName((Register)(operand2)) : std::string_view();
+        if( name.empty() )
+            return false;
+        out += name;
     }
-    if( !operand2Name.empty() && operand2Memory )
-        operand2Name = std::string("[") + operand2Name + "]";
-    return operand2Name;
+    if( operand2Memory )
+        out += ']';
+    return true;
 }
 
 //===============================================================================================
 //===============================================================================================
 
-uint32_t assemble_machine_code(uint8_t opcode, bool flag, uint8_t operand1, uint16_t operand2){
-    uint32_t bin;
-    bin = uint32_t(opcode) << 24;
+constexpr uint32_t assemble_machine_code(uint8_t opcode, bool flag, uint8_t operand1, uint16_t operand2){
+    uint32_t bin = uint32_t(opcode) << 24;
     bin += uint32_t(flag) << 23;
     bin += uint32_t(operand1) << 16;
     bin += operand2;
     return bin;
 }
 
-std::string disasemble_machine_code(int machine_code, const std::map<std::string, int>& label_map = {})
+// append the disassembly of machine_code to out. wideOperand is the word after machine_code, for an instruction with
+// WIDE_OPERAND.
+// return false, with out unchanged, if machine_code is not a valid instruction.
+inline bool append_disassembly(std::string& out, uint32_t machine_code, const LabelIndex& labels = LabelIndex(), uint32_t wideOperand = 0)
 {
     Opcode opcode = static_cast<Opcode>((uint8_t)(machine_code >> 24));
     bool flag = machine_code & (1 << 23);
     uint8_t operand1 = (uint8_t)(machine_code >> 16) & 0x7f;
-    uint16_t operand2 = (uint16_t)(machine_code);
+    uint32_t operand2 = (uint16_t)(machine_code);
+    bool wide = operand1 & WIDE_OPERAND;
     
     // find the instruction
-    std::string instructionName = findInstructionName(opcode);
-    if( !instructionName.empty() )
+    const InstructionInfo* info = findInstruction(opcode);
+    if( !info )
+        return false;
+    if( wide )
     {
-        const InstructionData& data = getInstructionMap().find(instructionName)->second;
-        if( data.operandCount == 0 )
-        {
-            return instructionName;
-        }
-        else if( data.operandCount == 1 )
-        {
-            std::string operand2Name = decodeOperand2(operand2, flag, data.operand2Memory, label_map);
-            if( !operand2Name.empty() )
-                return instructionName + " " + operand2Name;
-        }
-        else if( data.operandCount == 2 )
-        {
-            std::string operand1Name = findRegisterName((Register)(operand1));
-            std::string operand2Name = decodeOperand2(operand2, flag, data.operand2Memory, label_map);
-            if( !operand1Name.empty() && !operand2Name.empty() )
-                return instructionName + " " + operand1Name + ", " + operand2Name;
-        }
-        else
+        if( !flag || operand2!=0 || (info->data.operandCount!=1 && info->data.operandCount!=2) )
+            return false;
+        operand1 &= ~WIDE_OPERAND;
+        operand2 = wideOperand;
+    }
+    size_t size = out.size();
+    out += info->name;
+    bool valid = true;
+    if( info->data.operandCount == 1 )
+    {
+        out += ' ';
+        valid = append_operand2(out, operand2, flag, info->data.operand2Memory, labels, false, wide);
+    }
+    else if( info->data.operandCount == 2 )
+    {
+        std::string_view operand1Name = findRegisterName((Register)(operand1));
+        out += ' ';
+        out += operand1Name;
+        out += ", ";
+        valid = !operand1Name.empty() && append_operand2(out, operand2, flag, info->data.operand2Memory, labels, info->data.indexed(), wide);
+    }
+    else if( info->data.block() )
+    {
+        // reg1, reg2, reg3
+        BlockOperand block = BlockOperand::decode(operand2);
+        std::string_view names[] = { findRegisterName((Register)(operand1)), findRegisterName((Register)(block.reg)),
+                                     findRegisterName((Register)(block.count)) };
+        valid = !flag && (operand2 & 0x8080)==0;
+        for(size_t i=0; i<std::size(names) && valid; ++i)
         {
-            assert(false);
+            valid = !names[i].empty();
+            out += i==0 ? " " : ", ";
+            out += names[i];
         }
     }
-    else
+    else if( info->data.operandCount == 3 )
     {
-        assert(false);
+        // CMV cc, reg, reg/num
+        ConditionalOperand conditional = ConditionalOperand::decode(operand2);
+        std::string_view operand1Name = findRegisterName((Register)(operand1));
+        valid = size_t(conditional.condition) < std::size(CONDITION_NAMES) && !operand1Name.empty();
+        if( valid )
+        {
+            out += ' ';
+            out += CONDITION_NAMES[size_t(conditional.condition)];
+            out += ", ";
+            out += operand1Name;
+            out += ", ";
+            valid = append_operand2(out, uint16_t(conditional.value), flag, false, LabelIndex());
+        }
     }
-    return {};
+    if( !valid )
+        out.resize(size);
+    return valid;
+}
+
+// empty if machine_code is not a valid instruction.
+inline std::string disasemble_machine_code(int machine_code, const LabelIndex& labels = LabelIndex(), uint32_t wideOperand = 0)
+{
+    std::string disassembly;
+    append_disassembly(disassembly, machine_code, labels, wideOperand);
+    return disassembly;
 }
@@ -0,0 +1,276 @@
+#pragma once
+
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "machine.h"
+
+// Record and replay of the I/O of a program on core 0, for xsim --record and --replay.
+// A record logs what a run cannot reproduce by itself, the input of each KBD, with the instructions run before it; and
+// a check of each output of DPL and DSP: its size and a hash of its bytes. A replay runs the program again with the
+// logged input, without reading stdin, and checks that it writes the same output after the same instructions, and
+// halts after as many instructions. KBD writes the same input area from the same input, so RAM is the same too.
+// The reads of the file device are not logged, so the device is off while a run is recorded or replayed: FOP fails.
+//
+// The log: REPLAY_MAGIC, u8 bits of the machine, u64 hash of the program, then records, each u8 type and u64
+// instructions run before the one of the record:
+//   'K' KBD:       u32 size, then the input.
+//   'O' DPL, DSP:  u32 size, u64 hash of the output.
+//   'H' halt:      the last record, with all the instructions run.
+// integers are little-endian; hashes are FNV-1a, 64-bit.
+namespace replay_io
+{
+    constexpr char  REPLAY_MAGIC[4] = {'X', 'R', 'P', '1'};
+
+    inline uint64_t hash(std::string_view bytes)
+    {
+        uint64_t h = 0xcbf29ce484222325ull;
+        for(char c : bytes)
+        {
+            h ^= (unsigned char)c;
+            h *= 0x100000001b3ull;
+        }
+        return h;
+    }
+
+    inline void put_u32(std::string& out, uint32_t v)
+    {
+        for(int i=0; i<4; ++i)
+            out.push_back(char(v >> (8*i)));
+    }
+
+    inline void put_u64(std::string& out, uint64_t v)
+    {
+        put_u32(out, uint32_t(v));
+        put_u32(out, uint32_t(v >> 32));
+    }
+
+    struct Record
+    {
+        char            type = 0;
+        uint64_t        instructions = 0;
+        std::string     input;          // of 'K'
+        uint32_t        size = 0;       // of 'K' and 'O'
+        uint64_t        hash = 0;       // of 'O'
+
+        std::string describe() const
+        {
+            std::string what = type=='K' ? "KBD" : type=='O' ? "output of " + std::to_string(size) + " bytes" : "halt";
+            return what + " after " + std::to_string(instructions) + " instructions";
+        }
+    };
+
+    // parse a log of a machine of bits; return false if it is not complete.
+    inline bool parse(std::string_view log, int bits, uint64_t& programHash, std::vector<Record>& records)
+    {
+        size_t pos = 0;
+        auto get = [&](int bytes, uint64_t& v){
+            if( log.size()-pos < size_t(bytes) )
+                return false;
+            v = 0;
+            for(int i=0; i<bytes; ++i)
+                v |= uint64_t((unsigned char)(log[pos+i])) << (8*i);
+            pos += bytes;
+            return true;
+        };
+        uint64_t logBits = 0;
+        if( log.substr(0, sizeof(REPLAY_MAGIC))!=std::string_view(REPLAY_MAGIC, sizeof(REPLAY_MAGIC)) )
+            return false;
+        pos = sizeof(REPLAY_MAGIC);
+        if( !get(1, logBits) || int(logBits)!=bits || !get(8, programHash) )
+            return false;
+        records.clear();
+        while( pos<log.size() )
+        {
+            Record r;
+            uint64_t type = 0, size = 0;
+            if( !get(1, type) || !get(8, r.instructions) )
+                return false;
+            r.type = char(type);
+            if( r.type=='K' || r.type=='O' )
+            {
+                if( !get(4, size) )
+                    return false;
+                r.size = uint32_t(size);
+            }
+            if( r.type=='K' )
+            {
+                if( log.size()-pos < size )
+                    return false;
+                r.input = log.substr(pos, size);
+                pos += size;
+            }
+            else if( r.type=='O' )
+            {
+                if( !get(8, r.hash) )
+                    return false;
+            }
+            else if( r.type!='H' )
+                return false;
+            records.push_back(std::move(r));
+        }
+        return !records.empty() && records.back().type=='H';
+    }
+}
+
+// logs the I/O of core 0 of a machine to a file, from open() until finish().
+template<class Word>
+class IORecorder
+{
+public:
+    explicit IORecorder(Machine<Word>& machine) : machine_(machine) {}
+    ~IORecorder() { if( log_.is_open() ) machine_.io = io_; }
+
+    // record the I/O of the machine, which has loaded program, to the log at path. false if it cannot be written.
+    bool open(const std::string& path, std::string_view program)
+    {
+        log_.open(path, std::ios::binary);
+        if( !log_.is_open() )
+            return false;
+        std::string header(replay_io::REPLAY_MAGIC, sizeof(replay_io::REPLAY_MAGIC));
+        header.push_back(char(MachineTraits<Word>::BITS));
+        replay_io::put_u64(header, replay_io::hash(program));
+        log_ << header;
+        io_ = machine_.io;
+        machine_.io.input = [this]{
+            std::string input = io_.input();
+            std::string record = begin('K');
+            replay_io::put_u32(record, uint32_t(input.size()));
+            log_ << record << input << std::flush;     // the input is what a failing run needs to be replayed
+            return input;
+        };
+        machine_.io.output = [this](std::string_view text){
+            std::string record = begin('O');
+            replay_io::put_u32(record, uint32_t(text.size()));
+            replay_io::put_u64(record, replay_io::hash(text));
+            log_ << record;
+            io_.output(text);
+        };
+        machine_.io.file = nullptr;
+        return true;
+    }
+
+    // log the end of the run. return false if the log could not be written.
+    bool finish()
+    {
+        log_ << begin('H');
+        log_.close();
+        machine_.io = io_;
+        return !log_.fail();
+    }
+
+private:
+    std::string begin(char type) const
+    {
+        std::string record(1, type);
+        replay_io::put_u64(record, machine_.instructions(0));
+        return record;
+    }
+
+    Machine<Word>&      machine_;
+    MachineIO           io_;        // of the machine before
+    std::ofstream       log_;
+};
+
+// runs core 0 of a machine on the I/O of a log, from open() until finish().
+template<class Word>
+class IOReplayer
+{
+public:
+    explicit IOReplayer(Machine<Word>& machine) : machine_(machine) {}
+    ~IOReplayer() { if( open_ ) machine_.io = io_; }
+
+    // replay the log at path on the machine, which has loaded program. return false with a description in error if the
+    // log cannot be read, or is not of this program.
+    bool open(const std::string& path, std::string_view program, std::string& error)
+    {
+        std::ifstream f(path, std::ios::binary);
+        if( !f.is_open() )
+        {
+            error = "cannot open " + path;
+            return false;
+        }
+        std::string log{ std::istreambuf_iterator<char>(f), std::istreambuf_iterator<char>() };
+        uint64_t programHash = 0;
+        if( !replay_io::parse(log, MachineTraits<Word>::BITS, programHash, records_) )
+        {
+            error = path + " is not a complete log of the " + std::to_string(MachineTraits<Word>::BITS) + "-bit machine";
+            return false;
+        }
+        if( programHash!=replay_io::hash(program) )
+        {
+            error = path + " is a log of another program";
+            return false;
+        }
+        open_ = true;
+        io_ = machine_.io;
+        machine_.io.input = [this]() -> std::string {
+            const replay_io::Record* r = next('K', "KBD");
+            return r ? r->input : std::string();
+        };
+        machine_.io.output = [this](std::string_view text){
+            const replay_io::Record* r = next('O', "output of " + std::to_string(text.size()) + " bytes");
+            if( r && (r->size!=text.size() || r->hash!=replay_io::hash(text)) )
+                diverge(r->describe() + " is not as logged");
+            io_.output(text);
+        };
+        machine_.io.file = nullptr;
+        return true;
+    }
+
+    // check the end of the run against the log, and report it to out. return false if the run was not as logged.
+    bool finish(std::ostream& out)
+    {
+        machine_.io = io_;
+        open_ = false;
+        const replay_io::Record* r = next('H', "halt");
+        if( r && !machine_.halted(0) )
+            diverge("the run did not halt");
+        if( diverged_ )
+        {
+            out << "Replay diverged: " << divergence_ << std::endl;
+            return false;
+        }
+        out << "Replay matched: " << inputs_ << " inputs, " << outputs_ << " outputs, " << machine_.instructions(0) << " instructions" << std::endl;
+        return true;
+    }
+
+private:
+    // the next record, which is expected to be of type, after the instructions run now; nullptr if it is not.
+    const replay_io::Record* next(char type, const std::string& what)
+    {
+        const replay_io::Record* r = used_ < records_.size() ? &records_[used_] : nullptr;
+        if( !r || r->type!=type || r->instructions!=machine_.instructions(0) )
+        {
+            diverge(what + " after " + std::to_string(machine_.instructions(0)) + " instructions, where the log has "
+                    + (r ? r->describe() : std::string("no more records")));
+            return nullptr;
+        }
+        ++ used_;
+        inputs_ += type=='K';
+        outputs_ += type=='O';
+        return r;
+    }
+
+    // keep the first divergence.
+    void diverge(const std::string& message)
+    {
+        if( diverged_ )
+            return;
+        diverged_ = true;
+        divergence_ = message;
+    }
+
+    Machine<Word>&                  machine_;
+    MachineIO                       io_;        // of the machine before
+    std::vector<replay_io::Record>  records_;
+    size_t                          used_ = 0;
+    size_t                          inputs_ = 0, outputs_ = 0;
+    bool                            open_ = false;
+    bool                            diverged_ = false;
+    std::string                     divergence_;
+};
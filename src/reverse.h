@@ -0,0 +1,247 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "machine.h"
+
+// Reverse execution of core 0 of a machine, for the xsim debugger (xsim --debug).
+// Going forward, it takes a checkpoint every interval instructions: the registers, and the pages of RAM that changed
+// since the last checkpoint, found by comparing RAM with a copy of it at the last checkpoint. Going back to an
+// instruction restores the nearest checkpoint before it and runs forward again to it. The runs are deterministic: the
+// input of KBD is recorded, and given again when the instructions that read it are run again; the output and errors
+// of instructions run again are not written again. The host files of the file device cannot be restored, so the
+// device is off while it runs: FOP fails.
+// The cost of going forward is a compare of RAM per interval; the cost of going back is a restore of RAM and up to an
+// interval of instructions.
+template<class Word>
+class ReverseExecution
+{
+public:
+    using Traits = MachineTraits<Word>;
+
+    static constexpr int        PAGE_SIZE = Traits::WIDE ? 4096 : 256;
+    static constexpr uint64_t   DEFAULT_INTERVAL = Traits::WIDE ? 10000000 : 100000;     // instructions
+
+    // the run of core 0 of machine, from its state now; it takes over the I/O of machine.
+    ReverseExecution(Machine<Word>& machine, uint64_t interval = DEFAULT_INTERVAL)
+        : machine_(machine), interval_(std::max<uint64_t>(interval, 1)), io_(machine.io)
+    {
+        RAM<Word>& ram = machine.ram();
+        shadow_.assign(ram.access_byte(0), ram.access_byte(0) + ram.size());
+        Checkpoint first{0, machine.registers(), machine.halted(0), 0, {}};
+        for(uint32_t page=0; page<pages(); ++page)
+            first.pages.push_back({page, page_bytes(shadow_.data(), page)});
+        checkpoints_.push_back(std::move(first));
+
+        machine.io.input = [this]{
+            if( inputsUsed_ < inputs_.size() )
+                return inputs_[inputsUsed_++];
+            inputs_.push_back(io_.input());
+            return inputs_[inputsUsed_++];
+        };
+        machine.io.output = [this](std::string_view text){ if( !replaying_ ) io_.output(text); };
+        machine.io.error = [this](std::string_view message){ if( !replaying_ ) io_.error(message); };
+        machine.io.file = nullptr;
+    }
+
+    ~ReverseExecution() { machine_.io = io_; }
+
+    ReverseExecution(const ReverseExecution&) = delete;
+    ReverseExecution& operator=(const ReverseExecution&) = delete;
+
+    // instructions run since the start: the instruction at PC is the one at this position.
+    uint64_t    position() const    { return position_; }
+    uint64_t    furthest() const    { return furthest_; }       // the furthest position reached
+    size_t      checkpoints() const { return checkpoints_.size(); }
+    // bytes of RAM kept in checkpoints, including the first, which has all of it.
+    size_t      checkpoint_bytes() const
+    {
+        size_t bytes = 0;
+        for(const Checkpoint& c : checkpoints_)
+            for(const Page& page : c.pages)
+                bytes += page.bytes.size();
+        return bytes;
+    }
+
+    // run forward count instructions, or until the core halts.
+    void forward(uint64_t count) { run_to(count > UINT64_MAX - position_ ? UINT64_MAX : position_ + count); }
+
+    // run forward until the instruction at PC is at address, after at least an instruction, or until the core halts.
+    // return true at address.
+    bool forward_to(uint32_t address)
+    {
+        do
+            run_to(position_ + 1);
+        while( !machine_.halted(0) && pc() != address );
+        return !machine_.halted(0);
+    }
+
+    // go back count instructions, or to the start.
+    void reverse_step(uint64_t count) { go_to(position_ - std::min(count, position_)); }
+
+    // go back to the last time the instruction at PC was at address, before the position now. return false, without
+    // moving, if it never was.
+    bool reverse_to(uint32_t address)
+    {
+        return search_back([this, address](uint64_t& found){
+            if( pc()==address )
+                found = position_;
+            run_to(position_ + 1);
+        });
+    }
+
+    // go back to the last instruction before the position now that changed any of the size bytes at address: the
+    // instruction at PC is the one that changed them. return false, without moving, if none did.
+    bool reverse_to_change(uint32_t address, uint32_t size)
+    {
+        RAM<Word>& ram = machine_.ram();
+        if( !ram.access_block(int(address), int(size)) )
+            return false;
+        std::string before(size, '\0');
+        return search_back([&](uint64_t& found){
+            uint64_t at = position_;
+            before.assign(ram.access_byte(int(address)), size);
+            run_to(position_ + 1);
+            if( std::memcmp(before.data(), ram.access_byte(int(address)), size)!=0 )
+                found = at;
+        });
+    }
+
+    // go to position, back or forward; forward stops early if the core halts.
+    void go_to(uint64_t position)
+    {
+        if( position < position_ )
+            restore(checkpoint_before(position));
+        run_to(position);
+    }
+
+private:
+    struct Page
+    {
+        uint32_t        index;
+        std::string     bytes;
+    };
+
+    struct Checkpoint
+    {
+        uint64_t            position;
+        RegisterFile<Word>  regs;
+        bool                halted;
+        size_t              inputsUsed;     // KBD inputs read before it
+        std::vector<Page>   pages;          // that changed since the last checkpoint; all pages in the first one
+    };
+
+    uint32_t pages() const { return uint32_t((shadow_.size() + PAGE_SIZE - 1) / PAGE_SIZE); }
+    uint32_t pc() const { return uint32_t(std::make_unsigned_t<Word>(machine_.registers().PC)); }
+
+    std::string page_bytes(const BYTE* ram, uint32_t page) const
+    {
+        size_t begin = size_t(page) * PAGE_SIZE;
+        return std::string(ram + begin, std::min<size_t>(PAGE_SIZE, shadow_.size() - begin));
+    }
+
+    // run forward to position, or until the core halts. instructions before the furthest position are run again, with
+    // their output muted; a checkpoint is taken every interval instructions past it.
+    void run_to(uint64_t position)
+    {
+        while( position_ < position && !machine_.halted(0) )
+        {
+            replaying_ = position_ < furthest_;
+            uint64_t end = replaying_ ? std::min(position, furthest_) : std::min(position, checkpoints_.back().position + interval_);
+            position_ += machine_.run(end - position_);
+            replaying_ = false;
+            if( position_ > furthest_ )
+            {
+                furthest_ = position_;
+                if( position_ == checkpoints_.back().position + interval_ && !machine_.halted(0) )
+                    take_checkpoint();
+            }
+        }
+    }
+
+    void take_checkpoint()
+    {
+        RAM<Word>& ram = machine_.ram();
+        Checkpoint c{position_, machine_.registers(), false, inputsUsed_, {}};
+        for(uint32_t page=0; page<pages(); ++page)
+        {
+            size_t begin = size_t(page) * PAGE_SIZE;
+            size_t size = std::min<size_t>(PAGE_SIZE, shadow_.size() - begin);
+            if( std::memcmp(ram.access_byte(int(begin)), shadow_.data() + begin, size)==0 )
+                continue;
+            std::memcpy(shadow_.data() + begin, ram.access_byte(int(begin)), size);
+            c.pages.push_back({page, page_bytes(shadow_.data(), page)});
+        }
+        checkpoints_.push_back(std::move(c));
+    }
+
+    // index of the last checkpoint at or before position.
+    size_t checkpoint_before(uint64_t position) const
+    {
+        auto next = std::upper_bound(checkpoints_.begin(), checkpoints_.end(), position,
+                                     [](uint64_t p, const Checkpoint& c){ return p < c.position; });
+        return size_t(next - checkpoints_.begin()) - 1;
+    }
+
+    // set the machine to checkpoint k: each page from the last checkpoint up to k that has it.
+    void restore(size_t k)
+    {
+        const Checkpoint& c = checkpoints_[k];
+        std::vector<bool> restored(pages(), false);
+        for(size_t i=k+1; i-- > 0; )
+        {
+            for(const Page& page : checkpoints_[i].pages)
+            {
+                if( restored[page.index] )
+                    continue;
+                machine_.write(int(size_t(page.index) * PAGE_SIZE), page.bytes.data(), int(page.bytes.size()));
+                restored[page.index] = true;
+            }
+        }
+        machine_.registers() = c.regs;
+        machine_.set_halted(0, c.halted);
+        position_ = c.position;
+        inputsUsed_ = c.inputsUsed;
+    }
+
+    // search the instructions before the position now, from the last interval back: from each checkpoint, call
+    // visit(found) to run each instruction of its interval, which sets found to the position of a match. go to the
+    // last match, and return true; or return to the position now, and return false.
+    template<class Visit>
+    bool search_back(Visit visit)
+    {
+        const uint64_t now = position_;
+        if( now==0 )
+            return false;
+        for(size_t k = checkpoint_before(now-1) + 1; k-- > 0; )
+        {
+            uint64_t end = k+1 < checkpoints_.size() ? std::min(checkpoints_[k+1].position, now) : now;
+            uint64_t found = UINT64_MAX;
+            restore(k);
+            while( position_ < end && !machine_.halted(0) )
+                visit(found);
+            if( found!=UINT64_MAX )
+            {
+                go_to(found);
+                return true;
+            }
+        }
+        go_to(now);
+        return false;
+    }
+
+    Machine<Word>&              machine_;
+    uint64_t                    interval_;
+    MachineIO                   io_;                // of the machine before
+    std::vector<Checkpoint>     checkpoints_;       // by position
+    std::vector<BYTE>           shadow_;            // RAM at the last checkpoint
+    std::vector<std::string>    inputs_;            // of KBD, in order
+    size_t                      inputsUsed_ = 0;
+    uint64_t                    position_ = 0;
+    uint64_t                    furthest_ = 0;
+    bool                        replaying_ = false;
+};
@@ -0,0 +1,496 @@
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <future>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include <pthread.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "xie.h"
+
+// xsim --serve: a long-lived simulator that runs jobs sent over a Unix domain socket, see serve() and xsim_client.
+//
+// Everything on the socket is a frame: u32 payload size, u8 frame type, then the payload. integers are little-endian.
+// A connection carries any number of jobs, one after another; the server answers each job before reading the next.
+// Each job goes to the next free worker, so an idle connection holds no worker. The server takes MAX_CONNECTIONS
+// connections at a time, and answers 'E' to another one and closes it. A frame larger than MAX_FRAME_SIZE ends its
+// connection.
+//   client -> server
+//     'J' job:   u64 instruction budget, u32 input record count, each record as u32 size and bytes, then the program
+//                as xasm writes it. each KBD takes the next record; KBD after the last record gets no input.
+//     'Q' quit:  if the server was started with --allow-quit, it stops accepting connections, finishes its jobs and
+//                exits; else it answers 'E'. SIGINT and SIGTERM stop it the same way.
+//   server -> client, for each job
+//     'O' output of DPL and DSP, in pieces as it is produced.
+//     'E' an error: the program could not be loaded, or the machine stopped on an error, e.g. an access outside RAM.
+//     'X' exit:  u8 status, u64 instructions run, then RA..RF, SP, PC, SR as i32. this frame ends the job.
+
+// a job frame holds a program of at most the RAM of the 32-bit machine, with the headers of its image, and the input
+// records; a connection holds one frame at a time, so the frames of a server take MAX_CONNECTIONS * MAX_FRAME_SIZE.
+constexpr size_t MAX_JOB_INPUT = 0x100000;     // bytes of the input records of a job, with their sizes
+constexpr size_t MAX_FRAME_SIZE = size_t(MachineTraits<int32_t>::RAM_SIZE) + MAX_JOB_INPUT + 0x1000;
+constexpr size_t MAX_CONNECTIONS = 32;
+
+enum class JobStatus : uint8_t
+{
+    HALTED = 0,             // the program ran HLT, or stopped on an error
+    BUDGET = 1,             // the instruction budget ran out first
+    NOT_LOADED = 2,         // the program could not be loaded
+};
+
+struct Job
+{
+    uint64_t                    budget = UINT64_MAX;
+    std::vector<std::string>    inputs;
+    std::string                 program;
+};
+
+struct JobExit
+{
+    JobStatus                   status = JobStatus::NOT_LOADED;
+    uint64_t                    instructions = 0;
+    int32_t                     registers[9] = {};      // RA..RF, SP, PC, SR
+};
+
+inline void put_u32(std::string& out, uint32_t v)
+{
+    for(int i=0; i<4; ++i)
+        out.push_back(char(v >> (8*i)));
+}
+
+inline void put_u64(std::string& out, uint64_t v)
+{
+    put_u32(out, uint32_t(v));
+    put_u32(out, uint32_t(v >> 32));
+}
+
+// reads little-endian integers and byte strings off a payload; every get fails once the payload runs out.
+struct PayloadReader
+{
+    std::string_view    payload;
+    size_t              pos = 0;
+
+    bool get_u32(uint32_t& v)
+    {
+        if( payload.size()-pos < 4 )
+            return false;
+        v = 0;
+        for(int i=0; i<4; ++i)
+            v |= uint32_t((unsigned char)(payload[pos+i])) << (8*i);
+        pos += 4;
+        return true;
+    }
+    bool get_u64(uint64_t& v)
+    {
+        uint32_t low = 0, high = 0;
+        if( !get_u32(low) || !get_u32(high) )
+            return false;
+        v = uint64_t(high) << 32 | low;
+        return true;
+    }
+    bool get_bytes(size_t size, std::string& bytes)
+    {
+        if( payload.size()-pos < size )
+            return false;
+        bytes = payload.substr(pos, size);
+        pos += size;
+        return true;
+    }
+    std::string_view rest() const { return payload.substr(pos); }
+};
+
+inline bool write_all(int fd, const char* data, size_t size)
+{
+    while( size>0 )
+    {
+        ssize_t n = ::send(fd, data, size, MSG_NOSIGNAL);
+        if( n<=0 )
+            return false;
+        data += n;
+        size -= size_t(n);
+    }
+    return true;
+}
+
+inline bool read_all(int fd, char* data, size_t size)
+{
+    while( size>0 )
+    {
+        ssize_t n = ::read(fd, data, size);
+        if( n<=0 )
+            return false;
+        data += n;
+        size -= size_t(n);
+    }
+    return true;
+}
+
+inline bool write_frame(int fd, char type, std::string_view payload)
+{
+    std::string frame;
+    frame.reserve(5 + payload.size());
+    put_u32(frame, uint32_t(payload.size()));
+    frame.push_back(type);
+    frame.append(payload);
+    return write_all(fd, frame.data(), frame.size());
+}
+
+// false at the end of the connection, or if a frame is larger than maxSize.
+inline bool read_frame(int fd, char& type, std::string& payload, size_t maxSize = MAX_FRAME_SIZE)
+{
+    char header[5];
+    if( !read_all(fd, header, sizeof(header)) )
+        return false;
+    PayloadReader reader{std::string_view(header, 4)};
+    uint32_t size = 0;
+    reader.get_u32(size);
+    if( size>maxSize )
+        return false;
+    type = header[4];
+    payload.resize(size);
+    return read_all(fd, payload.data(), size);
+}
+
+inline std::string encode_job(const Job& job)
+{
+    std::string payload;
+    put_u64(payload, job.budget);
+    put_u32(payload, uint32_t(job.inputs.size()));
+    for(const std::string& input : job.inputs)
+    {
+        put_u32(payload, uint32_t(input.size()));
+        payload += input;
+    }
+    payload += job.program;
+    return payload;
+}
+
+inline bool decode_job(std::string_view payload, Job& job)
+{
+    PayloadReader reader{payload};
+    uint32_t count = 0;
+    if( !reader.get_u64(job.budget) || !reader.get_u32(count) )
+        return false;
+    job.inputs.clear();
+    for(uint32_t i=0; i<count; ++i)
+    {
+        uint32_t size = 0;
+        std::string input;
+        if( !reader.get_u32(size) || !reader.get_bytes(size, input) || reader.pos - 12 > MAX_JOB_INPUT )
+            return false;
+        job.inputs.push_back(std::move(input));
+    }
+    job.program = reader.rest();
+    return true;
+}
+
+inline std::string encode_exit(const JobExit& exit)
+{
+    std::string payload(1, char(exit.status));
+    put_u64(payload, exit.instructions);
+    for(int32_t r : exit.registers)
+        put_u32(payload, uint32_t(r));
+    return payload;
+}
+
+inline bool decode_exit(std::string_view payload, JobExit& exit)
+{
+    if( payload.empty() )
+        return false;
+    exit.status = JobStatus(payload[0]);
+    PayloadReader reader{payload, 1};
+    if( !reader.get_u64(exit.instructions) )
+        return false;
+    for(int32_t& r : exit.registers)
+    {
+        uint32_t v = 0;
+        if( !reader.get_u32(v) )
+            return false;
+        r = int32_t(v);
+    }
+    return true;
+}
+
+// a worker of the server. it keeps one machine of each word size, made on its first job of that size, and loads every
+// later job into it, so a job costs the reset of RAM and the run, not the allocation of a machine.
+class ServeWorker
+{
+public:
+    // run the job of a frame of type from the connection fd, and answer it there; false if the client is gone.
+    bool serve_job(int fd, char type, const std::string& payload)
+    {
+        fd_ = fd;
+        Job job;
+        return type=='J' && decode_job(payload, job)
+            ? run_job(job)
+            : write_frame(fd, 'E', "Error: invalid job") && write_frame(fd, 'X', encode_exit(JobExit{}));
+    }
+
+private:
+    static constexpr size_t OUTPUT_CHUNK = 0x1000;     // output is sent when this much has gathered, and at exit
+
+    template<class Word>
+    Machine<Word>& machine(std::unique_ptr<Machine<Word>>& m)
+    {
+        if( !m )
+        {
+            m = std::make_unique<Machine<Word>>();
+            m->io.input = [this]{ return next_input_ < job_->inputs.size() ? job_->inputs[next_input_++] : std::string(); };
+            m->io.output = [this](std::string_view text){
+                output_ += text;
+                if( output_.size()>=OUTPUT_CHUNK )
+                    flush();
+            };
+            m->io.error = [this](std::string_view message){
+                flush();
+                ok_ = ok_ && write_frame(fd_, 'E', message);
+            };
+        }
+        return *m;
+    }
+
+    void flush()
+    {
+        if( !output_.empty() )
+            ok_ = ok_ && write_frame(fd_, 'O', output_);
+        output_.clear();
+    }
+
+    template<class Word>
+    void run(Machine<Word>& m, const Job& job, JobExit& exit)
+    {
+        std::string error;
+        if( !m.load(job.program, error) )
+        {
+            ok_ = ok_ && write_frame(fd_, 'E', "Error: " + error);
+            return;
+        }
+        exit.instructions = m.run(job.budget);
+        exit.status = m.halted() ? JobStatus::HALTED : JobStatus::BUDGET;
+        const RegisterFile<Word>& regs = m.registers();
+        const Word values[9] = {regs.RA, regs.RB, regs.RC, regs.RD, regs.RE, regs.RF, regs.SP, regs.PC, regs.SR};
+        std::copy(values, values+9, exit.registers);
+    }
+
+    // false if the client is gone.
+    bool run_job(const Job& job)
+    {
+        job_ = &job;
+        next_input_ = 0;
+        ok_ = true;
+        JobExit exit;
+        if( image_bits(job.program)==32 )
+            run(machine(machine32_), job, exit);
+        else
+            run(machine(machine16_), job, exit);
+        flush();
+        return ok_ && write_frame(fd_, 'X', encode_exit(exit));
+    }
+
+    std::unique_ptr<Machine16>  machine16_;
+    std::unique_ptr<Machine32>  machine32_;
+    const Job*                  job_ = nullptr;
+    size_t                      next_input_ = 0;
+    std::string                 output_;
+    int                         fd_ = -1;
+    bool                        ok_ = true;     // false once a write to the client failed
+};
+
+// connect to a server at socketPath. return the socket, or -1.
+inline int connect_server(const std::string& socketPath)
+{
+    sockaddr_un address{};
+    if( socketPath.size() >= sizeof(address.sun_path) )
+        return -1;
+    address.sun_family = AF_UNIX;
+    std::strcpy(address.sun_path, socketPath.c_str());
+    int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if( fd>=0 && ::connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address))!=0 )
+    {
+        ::close(fd);
+        fd = -1;
+    }
+    return fd;
+}
+
+// the state of a server, shared by its threads: the jobs read from connections wait here for a worker.
+struct ServeState
+{
+    struct Task
+    {
+        int                 fd = -1;
+        char                type = 0;
+        std::string         payload;
+        std::promise<bool>  sent;       // false if the client is gone
+    };
+
+    std::mutex              mutex;
+    std::condition_variable ready;      // a task is queued, or the server stops
+    std::deque<Task*>       tasks;
+    std::set<int>           connections;
+    bool                    stopping = false;
+    int                     listener = -1;
+
+    // stop accepting connections, and end the open ones after their jobs.
+    void stop()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if( stopping )
+            return;
+        stopping = true;
+        ::shutdown(listener, SHUT_RDWR);    // wakes up accept()
+        for(int fd : connections)
+            ::shutdown(fd, SHUT_RD);        // wakes up read_frame()
+        ready.notify_all();
+    }
+};
+
+// the reader of a connection: it queues each job of the connection for the workers, and waits for its answer before
+// reading the next. a client that stops reading its answers can hold a worker for SEND_TIMEOUT_SECONDS at most.
+inline void serve_connection(std::shared_ptr<ServeState> state, int fd, bool allowQuit)
+{
+    constexpr int SEND_TIMEOUT_SECONDS = 10;
+    timeval timeout{SEND_TIMEOUT_SECONDS, 0};
+    ::setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    ServeState::Task task;
+    task.fd = fd;
+    while( read_frame(fd, task.type, task.payload) )
+    {
+        if( task.type=='Q' )
+        {
+            if( allowQuit )
+            {
+                state->stop();
+                break;
+            }
+            if( !write_frame(fd, 'E', "Error: this server does not take quit; stop it with a signal") )
+                break;
+            continue;
+        }
+        task.sent = std::promise<bool>();
+        std::future<bool> sent = task.sent.get_future();
+        {
+            std::lock_guard<std::mutex> lock(state->mutex);
+            state->tasks.push_back(&task);
+            state->ready.notify_one();
+        }
+        if( !sent.get() )
+            break;
+    }
+    std::lock_guard<std::mutex> lock(state->mutex);
+    state->connections.erase(fd);
+    ::close(fd);
+    state->ready.notify_all();
+}
+
+// serve jobs on socketPath, on `threads` workers, until SIGINT or SIGTERM, or a client sends quit and allowQuit is set.
+// each connection has a thread that reads its jobs, and the workers run the jobs of all connections in the order they
+// come. return the exit code of xsim.
+inline int serve(const std::string& socketPath, unsigned threads, bool allowQuit)
+{
+    sockaddr_un address{};
+    if( socketPath.size() >= sizeof(address.sun_path) )
+    {
+        std::cout << "Error: socket path is too long: " << socketPath << std::endl;
+        return -2;
+    }
+    address.sun_family = AF_UNIX;
+    std::strcpy(address.sun_path, socketPath.c_str());
+    int listener = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    ::unlink(socketPath.c_str());
+    if( listener<0 || ::bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address))!=0 || ::listen(listener, 64)!=0 )
+    {
+        std::cout << "Error: cannot listen on " << socketPath << ": " << std::strerror(errno) << std::endl;
+        return -2;
+    }
+    std::cout << "xsim serving on " << socketPath << " with " << threads << " workers" << std::endl;
+
+    auto state = std::make_shared<ServeState>();
+    state->listener = listener;
+
+    // SIGINT and SIGTERM go to a thread of their own, which stops the server; the other threads block them.
+    sigset_t stopSignals, oldSignals;
+    sigemptyset(&stopSignals);
+    sigaddset(&stopSignals, SIGINT);
+    sigaddset(&stopSignals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &stopSignals, &oldSignals);
+    std::thread signalThread([&]{
+        int received = 0;
+        sigwait(&stopSignals, &received);
+        state->stop();
+    });
+
+    auto worker = [state](){
+        ServeWorker serveWorker;
+        for(;;)
+        {
+            ServeState::Task* task = nullptr;
+            {
+                std::unique_lock<std::mutex> lock(state->mutex);
+                state->ready.wait(lock, [&]{ return !state->tasks.empty() || (state->stopping && state->connections.empty()); });
+                if( state->tasks.empty() )
+                    return;
+                task = state->tasks.front();
+                state->tasks.pop_front();
+            }
+            // the reader reuses the task once the promise is set
+            std::promise<bool> sent = std::move(task->sent);
+            sent.set_value(serveWorker.serve_job(task->fd, task->type, task->payload));
+        }
+    };
+    std::vector<std::thread> pool;
+    for(unsigned t=0; t<std::max(threads, 1u); ++t)
+        pool.emplace_back(worker);
+
+    for(;;)
+    {
+        int fd = ::accept(listener, nullptr, nullptr);
+        std::lock_guard<std::mutex> lock(state->mutex);
+        if( state->stopping )
+        {
+            if( fd>=0 )
+                ::close(fd);
+            break;
+        }
+        if( fd<0 )
+        {
+            if( errno==EINTR || errno==ECONNABORTED )
+                continue;
+            break;
+        }
+        if( state->connections.size()>=MAX_CONNECTIONS )
+        {
+            write_frame(fd, 'E', "Error: the server has " + std::to_string(MAX_CONNECTIONS) + " connections; try again later");
+            ::close(fd);
+            continue;
+        }
+        state->connections.insert(fd);
+        std::thread(serve_connection, state, fd, allowQuit).detach();
+    }
+    state->stop();
+    for(auto& thread : pool)
+        thread.join();      // after all connections are closed
+    pthread_kill(signalThread.native_handle(), SIGTERM);    // wakes up sigwait(), if no signal did
+    signalThread.join();
+    pthread_sigmask(SIG_SETMASK, &oldSignals, nullptr);
+    ::close(listener);
+    ::unlink(socketPath.c_str());
+    return 0;
+}
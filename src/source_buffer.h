@@ -0,0 +1,90 @@
+#pragma once
+
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <string_view>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define XIE_HAS_MMAP 1
+#endif
+
+// read-only contents of a source file. files are memory-mapped where the platform supports it, and read into memory
+// otherwise. lines and tokens of a loaded SourceFile are views into its buffer, so the buffer is shared by them.
+class SourceBuffer
+{
+public:
+    SourceBuffer(const SourceBuffer&) = delete;
+    SourceBuffer& operator=(const SourceBuffer&) = delete;
+
+    ~SourceBuffer()
+    {
+#ifdef XIE_HAS_MMAP
+        if( mapped_ )
+            ::munmap(const_cast<char*>(data_), size_);
+#endif
+    }
+
+    // nullptr if the file cannot be opened.
+    static std::shared_ptr<const SourceBuffer> open(const std::filesystem::path& path)
+    {
+#ifdef XIE_HAS_MMAP
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if( fd<0 )
+            return nullptr;
+        struct stat st;
+        if( ::fstat(fd, &st)!=0 || !S_ISREG(st.st_mode) )
+        {
+            ::close(fd);
+            return nullptr;
+        }
+        std::shared_ptr<SourceBuffer> buffer(new SourceBuffer);
+        if( st.st_size>0 )
+        {
+            void* p = ::mmap(nullptr, size_t(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+            if( p==MAP_FAILED )
+            {
+                ::close(fd);
+                return nullptr;
+            }
+            buffer->data_ = static_cast<const char*>(p);
+            buffer->size_ = size_t(st.st_size);
+            buffer->mapped_ = true;
+        }
+        ::close(fd);
+        return buffer;
+#else
+        std::ifstream ifs(path, std::ios::binary);
+        if( !ifs.is_open() )
+            return nullptr;
+        return copy(std::string{ std::istreambuf_iterator<char>(ifs), std::istreambuf_iterator<char>() });
+#endif
+    }
+
+    static std::shared_ptr<const SourceBuffer> copy(std::string contents)
+    {
+        std::shared_ptr<SourceBuffer> buffer(new SourceBuffer);
+        buffer->owned_ = std::move(contents);
+        buffer->data_ = buffer->owned_.data();
+        buffer->size_ = buffer->owned_.size();
+        return buffer;
+    }
+
+    std::string_view view() const { return {data_, size_}; }
+
+    // offset of a view into this buffer.
+    size_t offset(std::string_view part) const { return size_t(part.data() - data_); }
+
+private:
+    SourceBuffer() = default;
+
+    const char*     data_ = "";
+    size_t          size_ = 0;
+    bool            mapped_ = false;
+    std::string     owned_;
+};
@@ -0,0 +1,173 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "machine.h"
+
+// Runtime statistics of a run, for xsim --stats and --stats-json: instructions, host time, executions per opcode,
+// conditional jumps taken and not taken, calls, returns and the deepest call, RAM bytes fetched, read and written, and
+// I/O bytes. The counters are kept by the machine as its cores run, see Machine::set_counting(): it counts a block of
+// the loaded code at a time, see CodeBlocks.
+// The RAM bytes are exact: the bytes of fetches, loads, stores, the stack and atomics by the opcode counts, as each
+// execution of an opcode moves the same bytes; the rest as counted by the machine, see MachineCounters; and the device
+// areas KBD writes and DSP and DPL read by the I/O bytes.
+
+struct RunStats
+{
+    uint64_t    instructions = 0;
+    double      seconds = 0;            // host time of the run
+    uint64_t    opcodes[256] = {};      // executions, by opcode
+    uint64_t    taken = 0;              // conditional jumps
+    uint64_t    notTaken = 0;
+    int         maxCallDepth = 0;       // calls not returned from, on any core
+    uint64_t    kbdBytes = 0;           // input of KBD, as read
+    uint64_t    dplBytes = 0;           // output of DPL
+    uint64_t    dspBytes = 0;           // output of DSP
+    uint64_t    fetchedBytes = 0;       // of RAM, by instruction fetches
+    uint64_t    readBytes = 0;
+    uint64_t    writtenBytes = 0;
+
+    uint64_t count(Opcode opc) const { return opcodes[uint8_t(opc)]; }
+    double   mips() const { return seconds>0 ? double(instructions) / seconds / 1e6 : 0; }
+
+    void report(std::ostream& out) const
+    {
+        out << "Instructions: " << instructions << " in " << std::fixed << std::setprecision(3) << seconds*1000 << " ms, "
+            << std::setprecision(1) << mips() << " MIPS" << std::defaultfloat << std::endl;
+        out << "Conditional jumps: " << taken << " taken, " << notTaken << " not taken" << std::endl;
+        out << "Calls: " << count(Opcode::CLL) << ", returns: " << count(Opcode::RET) << ", deepest call: " << maxCallDepth << std::endl;
+        out << "RAM bytes: " << fetchedBytes << " fetched, " << readBytes << " read, " << writtenBytes << " written" << std::endl;
+        out << "I/O bytes: KBD " << kbdBytes << ", DPL " << dplBytes << ", DSP " << dspBytes << std::endl;
+        out << "Executions by opcode:" << std::endl;
+        for(auto [name, n] : by_count())
+            out << "  " << std::left << std::setw(6) << name << std::right << std::setw(14) << n << std::endl;
+    }
+
+    bool write_json(const std::string& path) const
+    {
+        std::ofstream f(path);
+        if( !f.is_open() )
+            return false;
+        f << "{\n";
+        f << "  \"instructions\": " << instructions << ",\n";
+        f << "  \"host_seconds\": " << std::setprecision(9) << seconds << ",\n";
+        f << "  \"mips\": " << std::setprecision(6) << mips() << ",\n";
+        f << "  \"opcodes\": {";
+        const char* separator = "";
+        for(auto [name, n] : by_count())
+        {
+            f << separator << "\"" << name << "\": " << n;
+            separator = ", ";
+        }
+        f << "},\n";
+        f << "  \"branches\": {\"taken\": " << taken << ", \"not_taken\": " << notTaken << "},\n";
+        f << "  \"calls\": " << count(Opcode::CLL) << ",\n";
+        f << "  \"returns\": " << count(Opcode::RET) << ",\n";
+        f << "  \"max_call_depth\": " << maxCallDepth << ",\n";
+        f << "  \"ram_bytes\": {\"fetched\": " << fetchedBytes << ", \"read\": " << readBytes << ", \"written\": " << writtenBytes << "},\n";
+        f << "  \"io_bytes\": {\"kbd\": " << kbdBytes << ", \"dpl\": " << dplBytes << ", \"dsp\": " << dspBytes << "}\n";
+        f << "}\n";
+        return bool(f);
+    }
+
+private:
+    // the opcodes run, by name, most run first.
+    std::vector<std::pair<std::string, uint64_t>> by_count() const
+    {
+        std::vector<std::pair<std::string, uint64_t>> counts;
+        for(int opcode=0; opcode<256; ++opcode)
+        {
+            if( opcodes[opcode]==0 )
+                continue;
+            std::string_view name = findInstructionName(Opcode(opcode));
+            counts.push_back({name.empty() ? "0x" + integer_as_hex(uint8_t(opcode)) : std::string(name), opcodes[opcode]});
+        }
+        std::stable_sort(counts.begin(), counts.end(), [](auto& a, auto& b){ return a.second > b.second; });
+        return counts;
+    }
+};
+
+// keeps the RunStats of a machine from its construction: it turns on the counting of the machine, and takes over its
+// I/O, to count its bytes.
+template<class Word>
+class StatsCollector
+{
+public:
+    explicit StatsCollector(Machine<Word>& machine) : machine_(machine), io_(machine.io)
+    {
+        machine.set_counting(true);
+        machine.io.input = [this]{
+            std::string input = io_.input();
+            kbdBytes_.fetch_add(input.size(), std::memory_order_relaxed);
+            return input;
+        };
+        machine.io.output = [this](std::string_view text){
+            outputBytes_.fetch_add(text.size(), std::memory_order_relaxed);
+            io_.output(text);
+        };
+        start_ = std::chrono::steady_clock::now();
+    }
+
+    ~StatsCollector()
+    {
+        machine_.io = io_;
+        machine_.set_counting(false);
+    }
+
+    StatsCollector(const StatsCollector&) = delete;
+    StatsCollector& operator=(const StatsCollector&) = delete;
+
+    // the stats of the run so far, of all cores.
+    RunStats stats() const
+    {
+        RunStats stats;
+        stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_).count();
+        for(int core=0; core<machine_.cores(); ++core)
+        {
+            const MachineCounters& c = machine_.counters(core);
+            for(int opcode=0; opcode<256; ++opcode)
+                stats.opcodes[opcode] += c.opcodes[opcode];
+            stats.taken += c.taken;
+            stats.notTaken += c.notTaken;
+            stats.maxCallDepth = std::max(stats.maxCallDepth, c.maxCallDepth);
+            stats.fetchedBytes += 4*c.wideInstructions;
+            stats.readBytes += c.blockReadBytes;
+            stats.writtenBytes += c.blockWrittenBytes;
+        }
+        for(uint64_t n : stats.opcodes)
+            stats.instructions += n;
+        const uint64_t word = sizeof(Word);
+        stats.fetchedBytes += 4*stats.instructions;
+        stats.readBytes += stats.count(Opcode::LDB) + 2*stats.count(Opcode::LDS)
+                           + word*(stats.count(Opcode::LDW) + stats.count(Opcode::POP) + stats.count(Opcode::RET))
+                           + 2*(stats.count(Opcode::CAS) + stats.count(Opcode::FAD));
+        stats.writtenBytes += stats.count(Opcode::STB) + 2*stats.count(Opcode::STS)
+                              + word*(stats.count(Opcode::STW) + stats.count(Opcode::PSH) + stats.count(Opcode::CLL))
+                              + 2*(stats.count(Opcode::CAS) + stats.count(Opcode::FAD));
+        // DSP writes the whole display
+        stats.kbdBytes = kbdBytes_.load(std::memory_order_relaxed);
+        stats.dspBytes = stats.count(Opcode::DSP) * 25*81;
+        stats.dplBytes = outputBytes_.load(std::memory_order_relaxed) - stats.dspBytes;
+        // KBD writes the count and the input; DSP reads the display, and DPL the count and the output
+        stats.writtenBytes += 2*stats.count(Opcode::KBD) + stats.kbdBytes;
+        stats.readBytes += stats.count(Opcode::DSP) * 25*80 + 2*stats.count(Opcode::DPL) + stats.dplBytes;
+        return stats;
+    }
+
+private:
+    Machine<Word>&                          machine_;
+    MachineIO                               io_;            // of the machine before
+    // the I/O of a multi-core machine is called from the threads of its cores
+    std::atomic<uint64_t>                   kbdBytes_{0};
+    std::atomic<uint64_t>                   outputBytes_{0};
+    std::chrono::steady_clock::time_point   start_;
+};
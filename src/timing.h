@@ -0,0 +1,423 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "machine.h"
+#include "accesses.h"
+
+// A cycle-level timing model of a XIE core, run beside the interpreter by xsim --timing: it runs the machine an
+// instruction at a time, and times each instruction on an in-order pipeline that issues up to one instruction a cycle:
+//   - an instruction waits for its source registers: a load result is ready loadUse cycles after the load,
+//     a MUL result mulLatency cycles after it, a DIV or MOD result divLatency cycles after it, others the next cycle.
+//   - a mispredicted branch costs branchPenalty cycles. conditional jumps are predicted by 2-bit counters indexed by
+//     PC, RET by a return address stack, JMP/CLL to a label always hit; a jump to a register is always mispredicted.
+//   - instruction fetches and data accesses go through set-associative LRU caches; a miss stalls for missPenalty.
+//   - a block instruction takes a cycle per word of its range, and accesses each cache line of it.
+// KBD, DSP and DPL are I/O and are not timed beyond their cycle. The model times core 0 only.
+// Cycles are reported for the program, and per routine: the code run after a CLL to its label, until its RET.
+
+struct CacheConfig
+{
+    int     size = 1024;    // bytes
+    int     ways = 2;
+    int     line = 16;      // bytes
+
+    bool valid() const
+    {
+        auto power_of_2 = [](int n){ return n>0 && (n & (n-1))==0; };
+        return power_of_2(line) && ways>0 && size>=line*ways && power_of_2(size/(line*ways));
+    }
+};
+
+struct TimingConfig
+{
+    int         mulLatency = 3;
+    int         divLatency = 20;
+    int         loadUse = 2;
+    int         branchPenalty = 3;
+    int         missPenalty = 20;
+    int         predictorEntries = 256;
+    CacheConfig icache;
+    CacheConfig dcache;
+
+    // set from a list of key=value, separated by commas, e.g. "mul=4,dcache_size=4096". return false with a
+    // description in error for an unknown key or invalid value.
+    bool parse(std::string_view text, std::string& error)
+    {
+        std::map<std::string_view, int*> keys = {
+            {"mul", &mulLatency}, {"div", &divLatency}, {"load_use", &loadUse}, {"branch", &branchPenalty},
+            {"miss", &missPenalty}, {"predictor", &predictorEntries},
+            {"icache_size", &icache.size}, {"icache_ways", &icache.ways}, {"icache_line", &icache.line},
+            {"dcache_size", &dcache.size}, {"dcache_ways", &dcache.ways}, {"dcache_line", &dcache.line},
+        };
+        while( !text.empty() )
+        {
+            std::string_view item = text.substr(0, text.find(','));
+            text.remove_prefix(std::min(text.size(), item.size()+1));
+            size_t eq = item.find('=');
+            auto key = keys.find(item.substr(0, eq));
+            int value = 0;
+            if( eq==std::string_view::npos || key==keys.end() || !(std::istringstream(std::string(item.substr(eq+1))) >> value) || value<0 )
+            {
+                error = "invalid timing option: " + std::string(item);
+                return false;
+            }
+            *key->second = value;
+        }
+        if( !icache.valid() || !dcache.valid() || predictorEntries<=0 )
+        {
+            error = "cache line and size / (line * ways) must be powers of 2, and there must be predictor entries";
+            return false;
+        }
+        return true;
+    }
+};
+
+// a set-associative cache with LRU replacement; it only keeps tags.
+class Cache
+{
+public:
+    explicit Cache(const CacheConfig& config)
+        : ways_(config.ways), lineBits_(log2(config.line)), sets_(config.size/(config.line*config.ways)),
+          tags_(size_t(sets_)*ways_, INVALID), used_(tags_.size(), 0) {}
+
+    // access the line of address; return true on a hit. a miss fills the line.
+    bool access(uint32_t address)
+    {
+        uint32_t line = address >> lineBits_;
+        size_t set = size_t(line % uint32_t(sets_)) * ways_;
+        ++ clock_;
+        size_t victim = set;
+        for(size_t i=set; i<set+ways_; ++i)
+        {
+            if( tags_[i]==line )
+            {
+                used_[i] = clock_;
+                ++ hits;
+                return true;
+            }
+            if( used_[i]<used_[victim] )
+                victim = i;
+        }
+        tags_[victim] = line;
+        used_[victim] = clock_;
+        ++ misses;
+        return false;
+    }
+
+    // number of misses of accessing [address, address+size).
+    int access_range(uint32_t address, uint32_t size)
+    {
+        int missed = 0;
+        if( size==0 )
+            return 0;
+        for(uint32_t line = address >> lineBits_; line <= (address+size-1) >> lineBits_; ++line)
+            missed += !access(line << lineBits_);
+        return missed;
+    }
+
+    uint64_t    hits = 0;
+    uint64_t    misses = 0;
+
+private:
+    static constexpr uint32_t INVALID = ~0u;
+    static int log2(int n) { int bits = 0; while( (1<<bits) < n ) ++bits; return bits; }
+
+    size_t                  ways_;
+    int                     lineBits_;
+    int                     sets_;
+    std::vector<uint32_t>   tags_;
+    std::vector<uint64_t>   used_;
+    uint64_t                clock_ = 0;
+};
+
+struct TimingStats
+{
+    uint64_t    instructions = 0;
+    uint64_t    cycles = 0;
+    uint64_t    loadUseStalls = 0;      // cycles waiting for a load result
+    uint64_t    mulDivStalls = 0;       // cycles waiting for a MUL, DIV or MOD result
+    uint64_t    branchStalls = 0;       // cycles lost to mispredicted branches
+    uint64_t    icacheStalls = 0;
+    uint64_t    dcacheStalls = 0;
+    uint64_t    branches = 0;           // predicted control transfers
+    uint64_t    mispredictions = 0;
+    uint64_t    icacheMisses = 0;
+    uint64_t    dcacheMisses = 0;
+
+    uint64_t stalls() const { return loadUseStalls + mulDivStalls + branchStalls + icacheStalls + dcacheStalls; }
+};
+
+// labels by address, from a map file of xasm --map. return false if the file cannot be read.
+inline bool load_symbol_map(const std::string& path, std::map<uint32_t, std::string>& symbols)
+{
+    std::ifstream f(path);
+    if( !f.is_open() )
+        return false;
+    std::string line;
+    while( std::getline(f, line) )
+    {
+        std::istringstream fields(line);
+        uint32_t address = 0;
+        std::string label;
+        if( fields >> std::hex >> address >> label )
+            symbols.emplace(address, label);    // the first label of an address names it
+    }
+    return true;
+}
+
+template<class Word>
+class TimingModel
+{
+public:
+    explicit TimingModel(const TimingConfig& config)
+        : config_(config), icache_(config.icache), dcache_(config.dcache), predictor_(size_t(config.predictorEntries), 1)
+    {
+        callStack_.push_back(uint32_t(MACHINE_CODE_START));
+    }
+
+    // names for the routines in the report; without a name, a routine is shown by its address.
+    void set_symbols(std::map<uint32_t, std::string> symbols) { symbols_ = std::move(symbols); }
+
+    // run the next instruction of core 0 of machine, and time it. return false if the machine is halted.
+    bool step(Machine<Word>& machine)
+    {
+        using UWord = std::make_unsigned_t<Word>;
+        RegisterFile<Word>& regs = machine.registers();
+        RAM<Word>& ram = machine.ram();
+        if( machine.halted(0) )
+            return false;
+
+        // decode, before the instruction changes the registers
+        uint32_t pc = uint32_t(UWord(regs.PC));
+        DecodedInstruction d = decode_instruction(ram, pc);
+        MemoryAccess accesses[MAX_ACCESSES];
+        int accessCount = instruction_accesses(d, regs, ram, accesses);
+        const Opcode opc = d.opcode;
+        const bool flag = d.flag;
+        const int operand1 = d.operand1;
+        const int operand2 = d.operand2;
+        const uint32_t size = d.size;
+        const InstructionInfo* info = d.info;
+        auto value = [&regs](int operand){ Word* r = regs.getRegister(operand); return r ? uint32_t(UWord(*r)) : 0u; };
+
+        int sources[3] = {-1, -1, -1};
+        int dest = -1;
+        int latency = 1;
+        bool load = false;          // dest is loaded from memory
+        uint32_t blockCycles = 1;
+        if( info && info->data.block() )
+        {
+            BlockOperand block = BlockOperand::decode(uint16_t(operand2));
+            sources[0] = operand1; sources[1] = block.reg; sources[2] = block.count;
+            if( opc==Opcode::FMP )
+                dest = block.reg;
+            if( opc!=Opcode::CAS )
+                blockCycles = std::max<uint32_t>(1, (value(block.count) + sizeof(Word) - 1) / sizeof(Word));
+            else
+                dest = block.reg, latency = config_.loadUse, load = true;
+        }
+        else if( info && info->data.indexed() )
+        {
+            if( !flag )
+                sources[1] = IndexedOperand::decode(uint16_t(operand2)).reg;
+            bool store = opc==Opcode::STB || opc==Opcode::STS || opc==Opcode::STW;
+            if( store || opc==Opcode::FAD )
+                sources[0] = operand1;
+            if( !store )
+                dest = operand1, latency = config_.loadUse, load = true;
+        }
+        else
+        {
+            int reg2 = flag || (info && info->data.operandCount==0) ? -1 : operand2;
+            if( opc==Opcode::CMV )
+            {
+                reg2 = flag ? -1 : ConditionalOperand::decode(uint16_t(operand2)).value;
+                sources[0] = operand1;
+                sources[2] = int(Register::SR);
+                dest = operand1;
+            }
+            else if( info && info->data.operandCount==2 )
+            {
+                if( opc!=Opcode::MOV )
+                    sources[0] = operand1;
+                dest = opc==Opcode::CMP || opc==Opcode::PHB ? int(Register::SR) : operand1;
+            }
+            else if( opc==Opcode::INC || opc==Opcode::DEC || opc==Opcode::NOT || opc==Opcode::BSW || opc==Opcode::CID || opc==Opcode::POP
+                     || opc==Opcode::FAV || opc==Opcode::FFL )
+                dest = reg2;
+            sources[1] = opc==Opcode::POP || opc==Opcode::CID ? -1 : reg2;
+            if( opc==Opcode::MUL )
+                latency = config_.mulLatency;
+            else if( opc==Opcode::DIV || opc==Opcode::MOD )
+                latency = config_.divLatency;
+            if( opc==Opcode::POP )
+                latency = config_.loadUse, load = true;
+            if( opc==Opcode::PSH || opc==Opcode::POP || opc==Opcode::CLL || opc==Opcode::RET )
+                sources[2] = int(Register::SP);
+        }
+
+        // issue: fetch, wait for the sources, access data
+        TimingStats& routine = routines_[callStack_.back()];
+        TimingStats delta;
+        uint64_t issue = cycle_ + 1;
+        int fetchMisses = icache_.access_range(pc, size);
+        delta.icacheMisses = fetchMisses;
+        delta.icacheStalls = uint64_t(fetchMisses) * config_.missPenalty;
+        issue += delta.icacheStalls;
+        for(int source : sources)
+        {
+            if( source<0 || source>=REGISTERS || ready_[source]<=issue )
+                continue;
+            (loadResult_[source] ? delta.loadUseStalls : delta.mulDivStalls) += ready_[source] - issue;
+            issue = ready_[source];
+        }
+        int dataMisses = 0;
+        for(int i=0; i<accessCount && !d.io(); ++i)
+        {
+            if( accesses[i].kind!=AccessKind::FETCH )
+                dataMisses += dcache_.access_range(accesses[i].address, accesses[i].size);
+        }
+        delta.dcacheMisses = dataMisses;
+        delta.dcacheStalls = uint64_t(dataMisses) * config_.missPenalty;
+        issue += delta.dcacheStalls + (blockCycles - 1);
+        if( dest>=0 && dest<REGISTERS )
+        {
+            ready_[dest] = issue + latency;
+            loadResult_[dest] = load;
+        }
+
+        // execute, then see where control went
+        machine.step(0);
+        uint32_t next = uint32_t(UWord(regs.PC));
+        Condition condition;
+        bool mispredicted = false;
+        if( jump_condition(opc, condition) )
+        {
+            uint8_t& counter = predictor_[(pc >> 2) % predictor_.size()];
+            bool taken = next != pc + size;
+            mispredicted = (counter >= 2) != taken;
+            counter = uint8_t(taken ? std::min(counter+1, 3) : std::max(counter-1, 0));
+            ++ delta.branches;
+        }
+        else if( opc==Opcode::JMP || opc==Opcode::CLL )
+        {
+            mispredicted = !flag;
+            ++ delta.branches;
+        }
+        else if( opc==Opcode::RET )
+        {
+            mispredicted = returnStack_.empty() || returnStack_.back()!=next;
+            if( !returnStack_.empty() )
+                returnStack_.pop_back();
+            ++ delta.branches;
+        }
+        if( opc==Opcode::CLL )
+        {
+            if( returnStack_.size()==RETURN_STACK_SIZE )
+                returnStack_.erase(returnStack_.begin());
+            returnStack_.push_back(pc + size);
+        }
+        if( mispredicted )
+        {
+            ++ delta.mispredictions;
+            delta.branchStalls = uint64_t(config_.branchPenalty);
+            issue += delta.branchStalls;
+        }
+
+        delta.instructions = 1;
+        delta.cycles = issue - cycle_;
+        cycle_ = issue;
+        add(routine, delta);
+        add(total_, delta);
+
+        // the routine of the next instruction
+        if( opc==Opcode::CLL && !machine.halted(0) )
+            callStack_.push_back(next);
+        else if( opc==Opcode::RET && callStack_.size()>1 )
+            callStack_.pop_back();
+        return !machine.halted(0);
+    }
+
+    const TimingStats& total() const { return total_; }
+
+    void report(std::ostream& out) const
+    {
+        auto percent = [](uint64_t part, uint64_t whole){
+            std::ostringstream s;
+            s << std::fixed << std::setprecision(1) << (whole ? 100.0*part/whole : 0.0) << "%";
+            return s.str();
+        };
+        auto cpi = [](const TimingStats& stats){
+            std::ostringstream s;
+            s << std::fixed << std::setprecision(2) << (stats.instructions ? double(stats.cycles)/stats.instructions : 0.0);
+            return s.str();
+        };
+        const TimingStats& t = total_;
+        out << "Cycles: " << t.cycles << ", instructions: " << t.instructions << ", CPI: " << cpi(t) << std::endl;
+        out << "Stall cycles: " << t.stalls() << " = load-use " << t.loadUseStalls << " + mul/div " << t.mulDivStalls
+            << " + branch " << t.branchStalls << " + icache " << t.icacheStalls << " + dcache " << t.dcacheStalls << std::endl;
+        out << "Branches: " << t.branches << ", mispredicted " << t.mispredictions << " (" << percent(t.mispredictions, t.branches) << ")" << std::endl;
+        out << "I-cache: " << icache_.hits << " hits, " << icache_.misses << " misses, hit rate " << percent(icache_.hits, icache_.hits+icache_.misses) << std::endl;
+        out << "D-cache: " << dcache_.hits << " hits, " << dcache_.misses << " misses, hit rate " << percent(dcache_.hits, dcache_.hits+dcache_.misses) << std::endl;
+
+        std::vector<std::pair<uint32_t, const TimingStats*>> routines;
+        for(auto& [address, stats] : routines_)
+            routines.push_back({address, &stats});
+        std::stable_sort(routines.begin(), routines.end(), [](auto& a, auto& b){ return a.second->cycles > b.second->cycles; });
+        out << std::left << std::setw(24) << "Routine" << std::right << std::setw(12) << "Instructions" << std::setw(12) << "Cycles"
+            << std::setw(7) << "CPI" << std::setw(10) << "Load-use" << std::setw(10) << "Mul/div" << std::setw(10) << "Branch"
+            << std::setw(10) << "I-miss" << std::setw(10) << "D-miss" << std::endl;
+        for(auto& [address, stats] : routines)
+        {
+            auto symbol = symbols_.find(address);
+            std::string name = symbol!=symbols_.end() ? symbol->second
+                             : address==uint32_t(MACHINE_CODE_START) ? "(program)" : integer_as_hex(Word(address));
+            const TimingStats& s = *stats;
+            out << std::left << std::setw(24) << name << std::right << std::setw(12) << s.instructions << std::setw(12) << s.cycles
+                << std::setw(7) << cpi(s) << std::setw(10) << s.loadUseStalls << std::setw(10) << s.mulDivStalls
+                << std::setw(10) << s.branchStalls << std::setw(10) << s.icacheMisses << std::setw(10) << s.dcacheMisses << std::endl;
+        }
+    }
+
+private:
+    static constexpr int    REGISTERS = 0x20;   // register operands are below
+    static constexpr size_t RETURN_STACK_SIZE = 8;
+
+    static void add(TimingStats& to, const TimingStats& delta)
+    {
+        to.instructions += delta.instructions;
+        to.cycles += delta.cycles;
+        to.loadUseStalls += delta.loadUseStalls;
+        to.mulDivStalls += delta.mulDivStalls;
+        to.branchStalls += delta.branchStalls;
+        to.icacheStalls += delta.icacheStalls;
+        to.dcacheStalls += delta.dcacheStalls;
+        to.branches += delta.branches;
+        to.mispredictions += delta.mispredictions;
+        to.icacheMisses += delta.icacheMisses;
+        to.dcacheMisses += delta.dcacheMisses;
+    }
+
+    TimingConfig                        config_;
+    Cache                               icache_;
+    Cache                               dcache_;
+    std::vector<uint8_t>                predictor_;         // 2-bit counters: 2 and 3 predict taken
+    std::vector<uint32_t>               returnStack_;
+    uint64_t                            cycle_ = 0;         // issue cycle of the last instruction
+    uint64_t                            ready_[REGISTERS] = {};     // cycle a register's value is ready
+    bool                                loadResult_[REGISTERS] = {};
+    std::vector<uint32_t>               callStack_;         // routines, by address
+    std::map<uint32_t, TimingStats>     routines_;
+    std::map<uint32_t, std::string>     symbols_;
+    TimingStats                         total_;
+};
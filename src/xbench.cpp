@@ -0,0 +1,142 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "xie.h"
+
+using namespace std;
+
+// xbench: the speed of the machines, in millions of instructions per second, on loops of a few instruction mixes.
+// each workload is assembled in-process for the 16-bit and the 32-bit machine, and run to HLT --reps times on one
+// core; the best run counts, as the others lose time to the host. it is run again with the counters of --stats on.
+// the numbers are only comparable between builds of the same type on the same host: run it in a Release build
+// before and after a change to the instruction loop, see Machine::run_instructions().
+// --min fails the run if a workload is slower than that, without counters.
+
+struct Workload
+{
+    const char*     name;
+    const char*     source;     // OUTER is the number of runs of the inner loop
+    uint64_t        innerInstructions;  // of a run of the inner loop
+};
+
+const Workload WORKLOADS[] = {
+    {"alu", R"(
+        MOV RE, 0
+    outer:
+        MOV RA, 0
+        MOV RC, 0x3000
+    loop:
+        LDB RB, [RC]
+        ADD RB, 3
+        MUL RB, 5
+        STB RB, [RC]
+        PSH RB
+        POP RB
+        INC RA
+        CMP RA, 1000
+        JPL [loop]
+        INC RE
+        CMP RE, OUTER
+        JPL [outer]
+        HLT
+    )", 9*1000},
+    {"call", R"(
+        MOV RE, 0
+    outer:
+        MOV RA, 0
+    loop:
+        CLL [add]
+        INC RA
+        CMP RA, 1000
+        JPL [loop]
+        INC RE
+        CMP RE, OUTER
+        JPL [outer]
+        HLT
+    add:
+        ADD RB, RA
+        RET
+    )", 6*1000},
+};
+
+// the best of reps runs of program: instructions per second.
+template<class Word>
+double run_best(const string& program, int reps, bool counting, uint64_t& instructions)
+{
+    Machine<Word> machine;
+    double best = 0;
+    for(int r=0; r<reps; ++r)
+    {
+        string error;
+        if( !machine.load(program, error) )
+        {
+            cout << "Error: " << error << endl;
+            return 0;
+        }
+        machine.set_counting(counting);
+        auto start = chrono::steady_clock::now();
+        instructions = machine.run();
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        best = max(best, seconds>0 ? double(instructions) / seconds : 0);
+    }
+    return best;
+}
+
+int main(int argc, const char** argv)
+{
+    uint64_t instructions = 20000000;
+    int reps = 5;
+    double minimum = 0;
+    for(int i=1; i<argc; ++i)
+    {
+        string arg = argv[i];
+        if( arg.rfind("--instructions=", 0)==0 && atoll(arg.c_str()+15)>0 )
+            instructions = uint64_t(atoll(arg.c_str()+15));
+        else if( arg.rfind("--reps=", 0)==0 && atoi(arg.c_str()+7)>0 )
+            reps = atoi(arg.c_str()+7);
+        else if( arg.rfind("--min=", 0)==0 )
+            minimum = atof(arg.c_str()+6);
+        else
+        {
+            cout << "Usage: " << argv[0] << " [options]" << endl;
+            cout << "   runs loops on the 16-bit and the 32-bit machine, and prints millions of instructions per second." << endl;
+            cout << "   --instructions=<n>  instructions of a run of a workload, about. default is 20000000." << endl;
+            cout << "   --reps=<n>          runs of a workload, of which the best counts. default is 5." << endl;
+            cout << "   --min=<m>           fail if a workload runs less than m million instructions per second." << endl;
+            return -1;
+        }
+    }
+
+    cout << left << setw(12) << "workload" << right << setw(6) << "bits" << setw(14) << "instructions" << setw(10) << "Minstr/s" << setw(16) << "with counters" << endl;
+    int slow = 0;
+    for(const Workload& workload : WORKLOADS)
+    {
+        uint64_t outer = max<uint64_t>(1, min<uint64_t>(instructions / workload.innerInstructions, 0x7FFF));
+        for(int bits : {16, 32})
+        {
+            Assembler assembler;
+            assembler.bits = bits;
+            string program;
+            if( !assembler.assemble("#define OUTER " + to_string(outer) + "\n" + workload.source, program) )
+            {
+                cout << assembler.errors();
+                return -2;
+            }
+            uint64_t n = 0;
+            double plain = bits==16 ? run_best<int16_t>(program, reps, false, n) : run_best<int32_t>(program, reps, false, n);
+            double counting = bits==16 ? run_best<int16_t>(program, reps, true, n) : run_best<int32_t>(program, reps, true, n);
+            cout << left << setw(12) << workload.name << right << setw(6) << bits << setw(14) << n
+                 << fixed << setprecision(1) << setw(10) << plain / 1e6 << setw(16) << counting / 1e6 << endl;
+            if( plain / 1e6 < minimum )
+                ++ slow;
+        }
+    }
+    if( slow )
+        cout << "Error: " << slow << " workloads run less than " << minimum << " million instructions per second" << endl;
+    return slow ? 1 : 0;
+}
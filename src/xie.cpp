@@ -0,0 +1,58 @@
+#include <sstream>
+
+#include "xie.h"
+#include "assembler.h"
+
+template class Machine<int16_t>;
+template class Machine<int32_t>;
+
+// the compile-time assembler encodes as encode_line() does.
+constexpr auto LOOP_CODE = xie::assemble([]{ return R"(
+    loop:   DEC RA          // a comment
+            CMV LT, RB, -3
+            JNE loop
+            LDS RC, [RD+2]
+            HLT
+    )"; });
+static_assert(LOOP_CODE.size()==5);
+static_assert(LOOP_CODE[0]==assemble_machine_code(uint8_t(Opcode::DEC), false, 0, uint16_t(Register::RA)));
+static_assert(LOOP_CODE[1]==assemble_machine_code(uint8_t(Opcode::CMV), true, uint8_t(Register::RB), ConditionalOperand{Condition::LT, -3}.encode()));
+static_assert(LOOP_CODE[2]==assemble_machine_code(uint8_t(Opcode::JNE), true, 0, uint16_t(MACHINE_CODE_START)));
+static_assert(LOOP_CODE[3]==assemble_machine_code(uint8_t(Opcode::LDS), false, uint8_t(Register::RC), IndexedOperand{uint8_t(Register::RD), false, 2}.encode()));
+static_assert(LOOP_CODE[4]==assemble_machine_code(uint8_t(Opcode::HLT), false, 0, 0));
+
+bool Assembler::assemble(const std::string& source, std::string& program)
+{
+    return assemble(false, source, program);
+}
+
+bool Assembler::assemble_file(const std::string& path, std::string& program)
+{
+    return assemble(true, path, program);
+}
+
+// source is a file path if file, else source code.
+bool Assembler::assemble(bool file, const std::string& source, std::string& program)
+{
+    std::ostringstream log;
+    Loader loader;
+    loader.threads = threads;
+    loader.log = &log;
+    for(const std::string& dir : includeDirs)
+        loader.extraIncludeDirs.push_back(dir);
+    AssembleOptions options;
+    options.threads = threads;
+    options.bits = bits;
+    options.log = &log;
+    options.summary = false;
+
+    SourceFile sourceFile;
+    std::vector<int> instructions;
+    std::string data;
+    bool loaded = file ? loader.load(source, sourceFile) : loader.loadFromString(source, sourceFile);
+    bool ok = loaded && ::assemble(sourceFile, instructions, data, options);
+    if( ok )
+        program = make_program(instructions, data, bits);
+    errors_ = log.str();
+    return ok;
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "machine.h"
+#include "constexpr_assembler.h"
+
+// libxie: assemble and run XIE programs in-process, without xasm, xsim or files.
+//   Assembler assembler;
+//   std::string program;
+//   if( assembler.assemble(source, program) )
+//   {
+//       Machine16 machine;
+//       machine.io.output = [&](std::string_view text){ ... };
+//       std::string error;
+//       if( machine.load(program, error) )
+//           machine.run(1000000);
+//   }
+// or, with the program built into the host at compile time, see constexpr_assembler.h:
+//   constexpr auto code = xie::assemble([]{ return R"( ... )"; });
+//   machine.load(xie::program(code), error);
+
+using Machine16 = Machine<int16_t>;
+using Machine32 = Machine<int32_t>;
+
+// built in libxie, so that users do not compile the machines again.
+extern template class Machine<int16_t>;
+extern template class Machine<int32_t>;
+
+// assembles source code into a program, as xasm would write it to a file: source in memory, which cannot #include
+// files, or a source file.
+// an Assembler can be reused; it is not thread-safe, so use one per thread.
+class Assembler
+{
+public:
+    int                         bits = 16;      // of the machine: 16, or 32, like xasm --bits
+    unsigned                    threads = 1;    // to assemble large sources with
+    std::vector<std::string>    includeDirs;    // for #include of a source file, after the current directory
+
+    // false on errors, which are then in errors().
+    bool assemble(const std::string& source, std::string& program);
+    bool assemble_file(const std::string& path, std::string& program);
+
+    // errors of the last assemble(), as xasm would print them.
+    const std::string& errors() const { return errors_; }
+
+private:
+    bool assemble(bool file, const std::string& source, std::string& program);
+
+    std::string     errors_;
+};
@@ -1,270 +1,465 @@
 #include <iostream>
 #include <iomanip>
+#include <filesystem>
 #include <fstream>
+#include <memory>
+#include <optional>
+#include <sstream>
 #include <vector>
 
 #include "ref.h"
 #include "parser.h"
+#include "image.h"
+#include "xie.h"
+#include "timing.h"
+#include "heatmap.h"
+#include "coverage.h"
+#include "reverse.h"
+#include "replay.h"
+#include "stats.h"
+#ifndef _WIN32
+#include "serve.h"
+#endif
 
 using namespace std;
 
 
-using Instruction = uint32_t;
-using BYTE = char;
-int MACHINE_CODE_START = 0x1000; // first machine instruction starts here.
-int RAM_SIZE = 0x5000;
-
-struct RAM
+struct SimOptions
 {
-    RAM(size_t size) : ram(size) {}
+    bool            suppress_debugging_info = false;
+    int             cores = 1;
+    bool            timing = false;     // run the timing model beside the machine, see timing.h
+    TimingConfig    timingConfig;
+    string          mapPath;            // labels for the timing report, from xasm --map
+    string          heatmapPath;        // write the RAM traffic to <path>.csv and <path>.ppm, see heatmap.h
+    int             heatmapLine = 16;   // bytes per line of the heatmap
+    string          coveragePath;       // write the block coverage as an lcov tracefile, see coverage.h
+    string          linesPath;          // debug line table of xasm --lines, for the coverage
+    bool            debug = false;      // run the debugger, see debug_program
+    string          debugPath;          // its commands; stdin if empty
+    uint64_t        checkpointInterval = 0;     // instructions between checkpoints of the debugger; 0 for the default
+    string          recordPath;         // log the I/O of the run, see replay.h
+    string          replayPath;         // run on the I/O of a log, and check the output against it
+    bool            stats = false;      // report the RunStats of the run, see stats.h
+    string          statsJsonPath;      // and write them as JSON
+    string          filesRoot;          // the directory of the file device; off if empty, see file_device.h
+};
 
-    // access
-    BYTE* access_byte(int loc)
+// the position, registers and next instruction of the debugger.
+template<class Word>
+void print_position(Machine<Word>& machine, const ReverseExecution<Word>& reverse)
+{
+    cout << "#" << reverse.position() << " ";
+    if( machine.halted(0) )
     {
-        return ram.data() + loc;
+        cout << "halted" << endl;
+        return;
     }
+    RegisterFile<Word>& regs = machine.registers();
+    RAM<Word>& ram = machine.ram();
+    regs.print(); cout << endl;
+    int pc = int(std::make_unsigned_t<Word>(regs.PC));
+    if( !ram.access_block(pc, MachineTraits<Word>::WIDE ? 8 : 4) )
+        return;
+    int32_t instruction = ram.fetch_instruction(pc);
+    uint32_t wideOperand = MachineTraits<Word>::WIDE ? ram.fetch_instruction(pc + 4) : 0;
+    cout << " Instruction @" << integer_as_hex(regs.PC) << " " << integer_as_hex(instruction) << "  // " << disasemble_machine_code(instruction, LabelIndex(), wideOperand) << endl;
+}
 
-    short* access_short(int loc)
+// run core 0 of machine under the debugger, by commands read from in, a command per line, e.g. "reverse-step 10":
+//   step [n], s             run n instructions, 1 by default.
+//   continue [addr], c      run to the instruction at addr, or until the program halts.
+//   reverse-step [n], rs    go back n instructions, 1 by default.
+//   reverse-continue [addr], rc  go back to the last time the instruction at addr was run, or to the start.
+//   last-change <addr> [n], lc   go back to the instruction that last changed any of the n bytes at addr, a Word by default.
+//   goto <position>         go to the instruction at position, the number of instructions run before it.
+//   mem <addr> [n], x       print the n bytes at addr, 16 by default.
+//   regs, r                 print the position, registers and next instruction.
+//   quit, q
+template<class Word>
+void debug_program(Machine<Word>& machine, istream& in, uint64_t interval)
+{
+    ReverseExecution<Word> reverse(machine, interval ? interval : ReverseExecution<Word>::DEFAULT_INTERVAL);
+    print_position(machine, reverse);
+    for(string line; getline(in, line); )
     {
-        BYTE* p = ram.data() + loc;
-        return reinterpret_cast<short*>(p);
+        istringstream words(line);
+        string command, first, second;
+        words >> command >> first >> second;
+        int a = 0, b = 0;
+        bool hasFirst = string_to_number(first, a);
+        bool hasSecond = string_to_number(second, b);
+        if( command.empty() )
+            continue;
+        if( (!first.empty() && !hasFirst) || (!second.empty() && !hasSecond) || a<0 || b<0 )
+        {
+            cout << "Error: invalid number in " << line << endl;
+            continue;
+        }
+        if( command=="step" || command=="s" )
+            reverse.forward(hasFirst ? uint64_t(a) : 1);
+        else if( command=="continue" || command=="c" )
+        {
+            if( hasFirst )
+                reverse.forward_to(uint32_t(a));
+            else
+                reverse.forward(UINT64_MAX);
+        }
+        else if( command=="reverse-step" || command=="rs" )
+            reverse.reverse_step(hasFirst ? uint64_t(a) : 1);
+        else if( command=="reverse-continue" || command=="rc" )
+        {
+            if( !hasFirst )
+                reverse.go_to(0);
+            else if( !reverse.reverse_to(uint32_t(a)) )
+                cout << "The instruction at " << integer_as_hex(Word(a)) << " was not run" << endl;
+        }
+        else if( (command=="last-change" || command=="lc") && hasFirst )
+        {
+            if( !reverse.reverse_to_change(uint32_t(a), hasSecond ? uint32_t(b) : uint32_t(sizeof(Word))) )
+                cout << "No instruction changed " << integer_as_hex(Word(a)) << endl;
+        }
+        else if( command=="goto" && hasFirst )
+            reverse.go_to(uint64_t(a));
+        else if( command=="mem" || command=="x" )
+        {
+            int size = hasSecond ? b : 16;
+            BYTE* bytes = machine.ram().access_block(a, size);
+            if( !hasFirst || !bytes )
+            {
+                cout << "Error: invalid range in " << line << endl;
+                continue;
+            }
+            cout << integer_as_hex(Word(a)) << ":" << hex << setfill('0');
+            for(int i=0; i<size; ++i)
+                cout << " " << setw(2) << int(uint8_t(bytes[i]));
+            cout << dec << setfill(' ') << endl;
+            continue;
+        }
+        else if( command=="quit" || command=="q" )
+            break;
+        else if( command!="regs" && command!="r" )
+        {
+            cout << "Error: unknown command " << line << endl;
+            continue;
+        }
+        print_position(machine, reverse);
     }
+    cout << "Checkpoints: " << reverse.checkpoints() << ", " << reverse.checkpoint_bytes() << " bytes, over " << reverse.furthest() << " instructions" << endl;
+}
 
-    int* access_int(int loc)
+// load a program into a machine of Word, and run it. return the exit code of xsim.
+template<class Word>
+int run_program(const string& contents, const SimOptions& options)
+{
+    const bool suppress_debugging_info = options.suppress_debugging_info;
+    const int cores = options.cores;
+    if( cores<1 || cores>MachineTraits<Word>::MAX_CORES )
     {
-        BYTE* p = ram.data() + loc;
-        return reinterpret_cast<int*>(p);
+        cout << "Error: the " << MachineTraits<Word>::BITS << "-bit machine has 1 to " << MachineTraits<Word>::MAX_CORES << " cores" << endl;
+        return -1;
     }
-
-    Instruction fetch_instruction(int PC)
+    Machine<Word> machine(cores);
+    string error;
+    if( !machine.load(contents, error) )
     {
-        return * access_int(PC);
+        cout << "Error: " << error << endl;
+        return -3;
+    }
+    if( !options.filesRoot.empty() )
+        machine.io.file = make_shared<FileDevice>(options.filesRoot);
+    RAM<Word>& ram = machine.ram();
+    if( !suppress_debugging_info )
+    {
+        size_t fileLength = machine.codeSize();     // size of the machine code
+        cout << "Bin file read size: " << fileLength << endl;
+        for(int index = 0; index<int(fileLength); index += 4)
+        {
+            int pc = MACHINE_CODE_START + index;
+            cout << " Instruction @" << integer_as_hex(Word(pc)) << " " << integer_as_hex(ram.fetch_instruction(pc)) << endl;
+        }
     }
 
-private:
-    vector<BYTE> ram;
-};
+    IORecorder<Word> recorder(machine);
+    IOReplayer<Word> replayer(machine);
+    if( !options.recordPath.empty() && !recorder.open(options.recordPath, contents) )
+    {
+        cout << "Error: cannot write " << options.recordPath << endl;
+        return -2;
+    }
+    if( !options.replayPath.empty() && !replayer.open(options.replayPath, contents, error) )
+    {
+        cout << "Error: " << error << endl;
+        return -2;
+    }
+    // the exit code after the run: -4 if the replay diverged from its log.
+    auto finish_io = [&]{
+        if( !options.recordPath.empty() && !recorder.finish() )
+            cout << "Error: cannot write " << options.recordPath << endl;
+        if( !options.replayPath.empty() && !replayer.finish(cout) )
+            return -4;
+        return 0;
+    };
 
-struct RegisterFile
-{
-    short RA, RB, RC, RD, RE, RF;
-    short PC;
-    short SP;
-    short SR;
+    optional<StatsCollector<Word>> stats;
+    if( options.stats )
+        stats.emplace(machine);
 
-    void print()
+    // boot our XIE computer
+    TimingModel<Word> model(options.timingConfig);
+    MemoryHeatmap<Word> heatmap(options.heatmapLine);
+    const bool heatmapping = !options.heatmapPath.empty();
+    if( options.debug )
     {
-        cout<<"RA=" << integer_as_hex(RA) <<" ";
-        cout<<"RB=" << integer_as_hex(RB) <<" ";
-        cout<<"RC=" << integer_as_hex(RC) <<" ";
-        cout<<"RD=" << integer_as_hex(RD) <<" ";
-        cout<<"RE=" << integer_as_hex(RE) <<" ";
-        cout<<"RF=" << integer_as_hex(RF) <<" ";
-        cout<<"  SP=" << integer_as_hex(SP) <<" ";
-        cout<<"SR=" << integer_as_hex(SR) <<" ";
-        cout<<"PC=" << integer_as_hex(PC) <<" ";
+        ifstream commands;
+        if( !options.debugPath.empty() )
+        {
+            commands.open(options.debugPath);
+            if( !commands.is_open() )
+            {
+                cout << "Error: cannot open " << options.debugPath << endl;
+                return -2;
+            }
+        }
+        debug_program(machine, options.debugPath.empty() ? cin : commands, options.checkpointInterval);
+        return 0;
     }
-
-    short* getRegister(int operand)
+    else if( !options.coveragePath.empty() )
     {
-        Register reg = (Register)(operand);
-        switch(reg)
+        std::map<uint32_t, LineTableEntry> table;
+        if( !load_line_table(options.linesPath, table) )
         {
-            case Register::RA: return &RA;
-            case Register::RB: return &RB;
-            case Register::RC: return &RC;
-            case Register::RD: return &RD;
-            case Register::RE: return &RE;
-            case Register::RF: return &RF;
-            case Register::SP: return &SP;
-            default: /*cout << "Error: unrecognized operand for register: " << operand << endl;*/ return nullptr;
+            cout << "Error: cannot open " << options.linesPath << endl;
+            return -2;
         }
+        BlockCoverage<Word> coverage(machine);
+        coverage.run(machine);
+        cout << endl;
+        if( !coverage.write_lcov(options.coveragePath, table, cout) )
+            cout << "Error: cannot write " << options.coveragePath << endl;
+        return finish_io();
+    }
+    else if( options.timing || heatmapping )
+    {
+        // the models watch core 0 an instruction at a time, without the trace
+        std::map<uint32_t, std::string> symbols;
+        if( !options.mapPath.empty() && !load_symbol_map(options.mapPath, symbols) )
+            cout << "Error: cannot open " << options.mapPath << endl;
+        model.set_symbols(std::move(symbols));
+        do
+        {
+            if( heatmapping )
+                heatmap.record(machine);
+        }
+        while( options.timing ? model.step(machine) : machine.step(0) );
+        heatmap.finish(machine);
+    }
+    else if( suppress_debugging_info )
+        machine.run();
+    else
+    {
+        // the cores take turns, an instruction each
+        do
+        {
+            for(int core=0; core<machine.cores(); ++core)
+            {
+                if( machine.halted(core) )
+                    continue;
+                RegisterFile<Word>& regs = machine.registers(core);
+                int32_t instruction = ram.fetch_instruction(regs.PC);
+                if( machine.cores()>1 )
+                    cout << "core " << core << ": ";
+                regs.print(); cout<<endl;
+                uint32_t wideOperand = MachineTraits<Word>::WIDE ? ram.fetch_instruction(regs.PC + 4) : 0;
+                cout << " Instruction @" << integer_as_hex(regs.PC) << " " << integer_as_hex(instruction) << "  // " << disasemble_machine_code(instruction, LabelIndex(), wideOperand) << endl;
+                machine.step(core);
+            }
+        }
+        while( !machine.halted() );
     }
-};
 
-bool run_instruction(Instruction instruction, RegisterFile& regs, RAM& ram)
-{
-    int opcode = instruction >> 24;
-    int flag = (instruction >> 23) & 0x0001;
-    int operand1 = (instruction >> 16) & 0x7F;
-    int operand2 = instruction & 0xffff;
-    Opcode opc = (Opcode)opcode;
-    short num = operand2;
-    short* reg1 = regs.getRegister(operand1);
-    short* reg2 = nullptr;
-    if( flag==0 )
+    cout << endl;
+    if( !suppress_debugging_info )
     {
-        reg2 = regs.getRegister(operand2);
-        num = *reg2;
+        for(int i=0; i<5; ++i)
+            cout << dec << *ram.access_short(i*2) << " ";
+        cout << endl;
     }
-    short cmp_result;
-    switch(opc)
+    if( options.timing )
+        model.report(cout);
+    if( stats )
     {
-        case Opcode::MOV:
-            *reg1 = num;  // perform move
-            break;
-        case Opcode::LDB:
-            *reg1 = *ram.access_byte(num);  // perform load from [reg] to reg
-            break;
-        case Opcode::STB:
-            *ram.access_byte(num) = (char)*reg1;  // store to mem
-            break;
-        case Opcode::LDS:
-            *reg1 = *ram.access_short(num);  // perform load from [reg] to reg
-            break;
-        case Opcode::STS:
-            *ram.access_short(num) = *reg1;  // store to mem
-            break;
-            
-        case Opcode::ADD:
-            *reg1 += num;
-            break;
-        case Opcode::SUB:
-            *reg1 -= num;
-            break;
-        case Opcode::MUL:
-            *reg1 *= num;
-            break;
-        case Opcode::DIV:
-            *reg1 /= num;
-            break;
-        case Opcode::MOD:
-            *reg1 %= num;
-            break;
-        case Opcode::INC:
-            (*reg2) ++;
-            break;
-        case Opcode::DEC:
-            (*reg2) --;
-            break;
-            
-        case Opcode::AND:
-            *reg1 &= num;
-            break;
-        case Opcode::OR_:
-            *reg1 |= num;
-            break;
-        case Opcode::XOR:
-            *reg1 ^= num;
-            break;
-        case Opcode::NOT:
-            (*reg2) = ~(*reg2);
-            break;
-        case Opcode::SHL:
-            *reg1 <<= num;
-            break;
-        case Opcode::SHR:
-            *reg1 >>= num;
-            break;
+        RunStats runStats = stats->stats();
+        runStats.report(cout);
+        if( !options.statsJsonPath.empty() && !runStats.write_json(options.statsJsonPath) )
+            cout << "Error: cannot write " << options.statsJsonPath << endl;
+    }
+    if( heatmapping )
+    {
+        heatmap.report(cout);
+        if( !heatmap.write_csv(options.heatmapPath + ".csv") || !heatmap.write_ppm(options.heatmapPath + ".ppm") )
+            cout << "Error: cannot write " << options.heatmapPath << ".csv or .ppm" << endl;
+    }
+    return finish_io();
+}
 
-        case Opcode::CMP:
-            if (*reg1 < num)
-                cmp_result = 0x02;
-            else if (*reg1 == num)
-                cmp_result = 0x01;
-            else
-                cmp_result = 0x00;
-            regs.SR = cmp_result;
-            break;
-        
-        case Opcode::JPE:
-            if ((regs.SR & 0x03) == 0x01)
-                regs.PC = num;
-            else
-                regs.PC += 4;
-            return false;   // control flow instruction
-        case Opcode::JPL:
-            if ((regs.SR & 0x03) == 0x02)
-                regs.PC = num;
-            else
-                regs.PC += 4;
-            return false;   // control flow instruction
-        case Opcode::JPG:
-            if ((regs.SR & 0x03) == 0x00)
-                regs.PC = num;
+int main(int argc, const char** argv)
+{
+#ifndef _WIN32
+    // xsim --serve=<socket_path> [--threads=<n>] [--allow-quit]: run jobs from clients, see serve.h.
+    if( argc>=2 && string(argv[1]).rfind("--serve=", 0)==0 )
+    {
+        unsigned threads = hardware_threads();
+        bool allowQuit = false;
+        for(int i=2; i<argc; ++i)
+        {
+            string arg = argv[i];
+            if( arg.rfind("--threads=", 0)==0 && atoi(arg.c_str()+10)>0 )
+                threads = unsigned(atoi(arg.c_str()+10));
+            else if( arg=="--allow-quit" )
+                allowQuit = true;
             else
-                regs.PC += 4;
-            return false;   // control flow instruction
-        case Opcode::JMP:
-            regs.PC = num;
-            return false;   // control flow instruction
-            
-        case Opcode::CLL:
-            regs.SP -= 2;
-            *ram.access_short(regs.SP) = regs.PC+4;
-            regs.PC = num;
-            return false;   // control flow instruction
-        case Opcode::RET:
-            regs.PC = *ram.access_short(regs.SP);
-            //cout << regs.SP << " " << regs.PC << endl;
-            regs.SP += 2;
-            return false;   // control flow instruction
-        case Opcode::HLT:
-            return true;
-            
-        case Opcode::PSH:
-            regs.SP -= 2;
-            if (flag == 0)
-                *ram.access_short(regs.SP) = *reg2;
-            else if (flag == 1){
-                num = operand2;
-                *ram.access_short(regs.SP) = num;
+            {
+                cout << "Error: unknown option " << arg << endl;
+                return -1;
             }
-            break;
-        case Opcode::POP:
-            *reg2 = *ram.access_short(regs.SP);
-            regs.SP += 2;
-            break;
-            
-        case Opcode::KBD:
+        }
+        return serve(string(argv[1]).substr(8), threads, allowQuit);
+    }
+#endif
+    // options can be anywhere; the other arguments are positional.
+    vector<string> args;
+    SimOptions options;
+    for(int i=1; i<argc; ++i)
+    {
+        string arg = argv[i];
+        string error;
+        if( arg.rfind("--cores=", 0)==0 )
+            options.cores = atoi(arg.c_str()+8);
+        else if( arg=="--timing" || arg.rfind("--timing=", 0)==0 )
         {
-            string kbd_input;
-            cin >> kbd_input;
-            *ram.access_short(0x4000) = kbd_input.length();
-            for (int c_ind = 0; c_ind<kbd_input.length(); c_ind++)
-                *ram.access_byte(0x4002 + c_ind) = kbd_input.at(c_ind);
-            break;
+            options.timing = true;
+            if( arg.size()>9 && !options.timingConfig.parse(string_view(arg).substr(9), error) )
+            {
+                cout << "Error: " << error << endl;
+                return -1;
+            }
         }
-        case Opcode::DSP:
-            for(int i=0; i<25; ++i)
+        else if( arg.rfind("--heatmap=", 0)==0 && arg.size()>10 )
+            options.heatmapPath = arg.substr(10);
+        else if( arg.rfind("--heatmap-line=", 0)==0 )
+        {
+            options.heatmapLine = atoi(arg.c_str()+15);
+            if( options.heatmapLine<=0 || (options.heatmapLine & (options.heatmapLine-1)) )
             {
-                for(int j=0; j<80; ++j)
-                {
-                    cout << *ram.access_byte(0x3000 + i*80 + j);
-                }
-                cout << endl;
+                cout << "Error: heatmap line must be a power of 2" << endl;
+                return -1;
             }
-            break;
-        case Opcode::DPL:
+        }
+        else if( arg.rfind("--coverage=", 0)==0 && arg.size()>11 )
+            options.coveragePath = arg.substr(11);
+        else if( arg.rfind("--lines=", 0)==0 && arg.size()>8 )
+            options.linesPath = arg.substr(8);
+        else if( arg=="--debug" || arg.rfind("--debug=", 0)==0 )
         {
-            short length = *ram.access_short(num);
-            char* s = ram.access_byte(num+2);
-            string str(s, length);
-            cout << str;
-            break;
+            options.debug = true;
+            options.debugPath = arg.substr(min<size_t>(arg.size(), 8));
         }
+        else if( arg.rfind("--checkpoint-interval=", 0)==0 && atoll(arg.c_str()+22)>0 )
+            options.checkpointInterval = uint64_t(atoll(arg.c_str()+22));
+        else if( arg.rfind("--record=", 0)==0 && arg.size()>9 )
+            options.recordPath = arg.substr(9);
+        else if( arg.rfind("--replay=", 0)==0 && arg.size()>9 )
+            options.replayPath = arg.substr(9);
+        else if( arg=="--stats" )
+            options.stats = true;
+        else if( arg.rfind("--stats-json=", 0)==0 && arg.size()>13 )
+        {
+            options.stats = true;
+            options.statsJsonPath = arg.substr(13);
+        }
+        else if( arg.rfind("--files=", 0)==0 && arg.size()>8 )
+            options.filesRoot = arg.substr(8);
+        else if( arg.rfind("--map=", 0)==0 )
+            options.mapPath = arg.substr(6);
+        else
+            args.push_back(arg);
     }
-    regs.PC += 4;
-    return false;
-}
-
-int main(int argc, const char** argv)
-{
-    if( argc != 2 && argc != 3 )
+    if( (options.timing || !options.heatmapPath.empty() || !options.coveragePath.empty() || options.debug) && options.cores!=1 )
+    {
+        cout << "Error: the timing model, the heatmap, the coverage and the debugger watch a single core" << endl;
+        return -1;
+    }
+    if( options.debug && (options.timing || !options.heatmapPath.empty() || !options.coveragePath.empty()) )
     {
-        cout << "Usage: " << argv[0] << " <xasm_binary_filepath> [suppress_debugging_info]" << endl;
+        cout << "Error: --debug runs without --timing, --heatmap and --coverage" << endl;
+        return -1;
+    }
+    if( options.stats && (options.timing || !options.heatmapPath.empty() || !options.coveragePath.empty() || options.debug) )
+    {
+        cout << "Error: --stats runs without --timing, --heatmap, --coverage and --debug" << endl;
+        return -1;
+    }
+    if( (!options.recordPath.empty() || !options.replayPath.empty()) && (options.cores!=1 || options.debug || (!options.recordPath.empty() && !options.replayPath.empty())) )
+    {
+        cout << "Error: --record and --replay run a single core, one of them, and without --debug" << endl;
+        return -1;
+    }
+    if( !options.coveragePath.empty() && (options.timing || !options.heatmapPath.empty() || options.linesPath.empty()) )
+    {
+        cout << "Error: --coverage needs --lines, and runs without --timing and --heatmap" << endl;
+        return -1;
+    }
+    if( !options.filesRoot.empty() && (options.debug || !options.recordPath.empty() || !options.replayPath.empty()) )
+    {
+        // the host files are not in the checkpoints of the debugger or in a record log
+        cout << "Error: --files runs without --debug, --record and --replay" << endl;
+        return -1;
+    }
+    if( !options.filesRoot.empty() && !filesystem::is_directory(options.filesRoot) )
+    {
+        cout << "Error: --files needs a directory: " << options.filesRoot << endl;
+        return -1;
+    }
+    if( args.size() != 1 && args.size() != 2 )
+    {
+        cout << "Usage: " << argv[0] << " <xasm_binary_filepath> [suppress_debugging_info] [options]" << endl;
+        cout << "       " << argv[0] << " --serve=<socket_path> [--threads=<n>] [--allow-quit]" << endl;
+        cout << "   --cores=<n>     run the program on n cores, over the same RAM. default is 1." << endl;
+        cout << "   --timing[=<k=v,...>]  time the program on a pipeline with caches, and report cycles per routine;" << endl;
+        cout << "                   without the trace. keys: mul, div, load_use, branch, miss, predictor," << endl;
+        cout << "                   icache_size, icache_ways, icache_line, dcache_size, dcache_ways, dcache_line." << endl;
+        cout << "   --heatmap=<p>   count RAM traffic per line, by fetch, read, write and stack; write <p>.csv and a" << endl;
+        cout << "                   <p>.ppm image, and report traffic per region and the peak stack depth." << endl;
+        cout << "   --heatmap-line=<n>  bytes per line of the heatmap, a power of 2. default is 16." << endl;
+        cout << "   --coverage=<f>  count the basic blocks and conditional jumps run; write an lcov tracefile to f." << endl;
+        cout << "   --lines=<f>     the debug line table of xasm --lines=<f>, to map the coverage to source lines." << endl;
+        cout << "   --debug[=<f>]   run the program under a debugger that can also go back, by commands from f, or from" << endl;
+        cout << "                   stdin: step, continue, reverse-step, reverse-continue, last-change, goto, mem, regs, quit." << endl;
+        cout << "   --checkpoint-interval=<n>  instructions between the checkpoints of the debugger." << endl;
+        cout << "   --record=<f>    log the KBD input of the run, and a check of its output, to f." << endl;
+        cout << "   --replay=<f>    run on the KBD input logged in f, without reading stdin, and check that the output" << endl;
+        cout << "                   and the instructions run are as logged; exit with -4 if not." << endl;
+        cout << "   --stats         report instructions, MIPS, executions per opcode, jumps, calls, RAM bytes and I/O" << endl;
+        cout << "                   bytes of the run." << endl;
+        cout << "   --stats-json=<f>  --stats, and write them to f as JSON." << endl;
+        cout << "   --files=<d>     turn on the file device of FOP, FMP, FAV and FFL, for the files in directory d;" << endl;
+        cout << "                   without it, they fail." << endl;
+        cout << "   --map=<f>       name the routines of the timing report by the labels of xasm --map=<f>." << endl;
+        cout << "   --serve         run jobs sent by xsim_client over a Unix domain socket, until SIGINT or SIGTERM." << endl;
+        cout << "   --threads=<n>   run jobs on n workers. default is all cores." << endl;
+        cout << "   --allow-quit    let a client stop the server with xsim_client --quit." << endl;
         return -1;
     }
     
-    bool suppress_debugging_info = false;
-    if( argc==3 )
+    if( args.size()==2 )
     {
-        string s = argv[2];
+        string s = args[1];
         if( upper(s)=="TRUE" )
-            suppress_debugging_info = true;
+            options.suppress_debugging_info = true;
     }
 
-    string filepath = argv[1];
+    string filepath = args[0];
 
     ifstream f(filepath, std::ios::binary);
     if( !f.is_open() )
@@ -272,73 +467,11 @@ int main(int argc, const char** argv)
         cout << "Error: cannot open " << filepath << endl;
         return -2;
     } 
-
-    RAM ram(RAM_SIZE);
-    RegisterFile regs;
-    // initialize display
-    const BYTE fill_display = ' ';
-    for(int i=0; i<25*80; ++i)
-       *ram.access_byte(0x3000 + i) = fill_display;
-    
-    f.seekg(0, std::ios_base::end);
-    size_t fileLength = f.tellg();
-    f.clear();
-    f.seekg(0, std::ios_base::beg);
-    if( fileLength > RAM_SIZE-MACHINE_CODE_START )
-    {
-        cout << "Error: File length exceeds simulator ram limit\n";
-        return -3;
-    }
-    f.read(ram.access_byte(MACHINE_CODE_START), fileLength);
+    string contents{ istreambuf_iterator<char>(f), istreambuf_iterator<char>() };
     f.close();
-    if( !suppress_debugging_info )
-    {
-        cout << "Bin file read size: " << fileLength << endl;
-        for(short index = 0; index<fileLength; index += 4)
-        {
-            short pc = MACHINE_CODE_START + index;
-            cout << " Instruction @" << integer_as_hex(pc) << " " << integer_as_hex(ram.fetch_instruction(pc)) << endl;
-        }
-    }
-    /*
-    *ram.access_byte(0x3000) = '0';
-    *ram.access_byte(0x3001) = '1';
-    *ram.access_byte(0x3002) = '2';
-    *ram.access_byte(0x3003) = '3';
-    *ram.access_byte(0x3004) = '4';
-    *ram.access_byte(0x3005) = '5';
-    */
-    /*
-    *ram.access_short(0x4000) = 5;
-    *ram.access_byte(0x4002) = '0';
-    *ram.access_byte(0x4003) = '9';
-    *ram.access_byte(0x4004) = '9';
-    *ram.access_byte(0x4005) = '9';
-    *ram.access_byte(0x4006) = '9';
-    */
-    // boot our XIE computer
-    regs.PC = MACHINE_CODE_START;
-    regs.SP = 0x2000;
 
-    while(true)
-    {
-        int32_t instruction = ram.fetch_instruction(regs.PC);
-        if( !suppress_debugging_info )
-        {
-            regs.print(); cout<<endl;
-            cout << " Instruction @" << integer_as_hex(regs.PC) << " " << integer_as_hex(instruction) << "  // " << disasemble_machine_code(instruction) << endl;
-        }
-        bool halt = run_instruction(instruction, regs, ram);
-        if (halt)
-            break;
-    }
-
-    cout << endl;
-    if( !suppress_debugging_info )
-    {
-        for(int i=0; i<5; ++i)
-            cout << dec << *ram.access_short(i*2) << " ";
-        cout << endl;
-    }
-    return 0;
+    // a raw program is machine code only of the 16-bit machine; an image has segments, e.g. data and code, see image.h.
+    if( image_bits(contents)==32 )
+        return run_program<int32_t>(contents, options);
+    return run_program<int16_t>(contents, options);
 }
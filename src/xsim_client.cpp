@@ -0,0 +1,119 @@
+#include <chrono>
+#include <iostream>
+#include <fstream>
+#include <string>
+
+#include "serve.h"
+
+using namespace std;
+
+// xsim_client: run a program on an xsim --serve server, and print its output as xsim would.
+
+int main(int argc, const char** argv)
+{
+    if( argc<3 )
+    {
+        cout << "Usage: " << argv[0] << " <socket_path> <xasm_binary_filepath> [options]" << endl;
+        cout << "       " << argv[0] << " <socket_path> --quit" << endl;
+        cout << "   --budget=<n>    stop the program after n instructions. default is no limit." << endl;
+        cout << "   --repeat=<n>    run the job n times on one connection, print the output of the first, and the time per job." << endl;
+        cout << "   --registers     print the registers when the program stops." << endl;
+        cout << "   --quit          stop the server, if it runs with --allow-quit." << endl;
+        cout << "Input for KBD is read from stdin, a word per KBD, unless stdin is a terminal." << endl;
+        return -1;
+    }
+
+    int fd = connect_server(argv[1]);
+    if( fd<0 )
+    {
+        cout << "Error: cannot connect to " << argv[1] << endl;
+        return -2;
+    }
+    if( string(argv[2])=="--quit" )
+    {
+        bool sent = write_frame(fd, 'Q', "");
+        ::close(fd);
+        return sent ? 0 : -2;
+    }
+
+    Job job;
+    int repeat = 1;
+    bool printRegisters = false;
+    for(int i=3; i<argc; ++i)
+    {
+        string arg = argv[i];
+        if( arg.rfind("--budget=", 0)==0 )
+            job.budget = stoull(arg.substr(9));
+        else if( arg.rfind("--repeat=", 0)==0 )
+            repeat = max(1, atoi(arg.c_str()+9));
+        else if( arg=="--registers" )
+            printRegisters = true;
+        else
+        {
+            cout << "Error: unknown option " << arg << endl;
+            return -1;
+        }
+    }
+
+    ifstream f(argv[2], std::ios::binary);
+    if( !f.is_open() )
+    {
+        cout << "Error: cannot open " << argv[2] << endl;
+        return -2;
+    }
+    job.program.assign(istreambuf_iterator<char>(f), istreambuf_iterator<char>());
+    if( !isatty(STDIN_FILENO) )
+    {
+        // xsim reads a word from cin for each KBD
+        for(string word; cin >> word; )
+            job.inputs.push_back(word);
+    }
+
+    string payload = encode_job(job);
+    JobExit exit;
+    auto start = chrono::steady_clock::now();
+    for(int r=0; r<repeat; ++r)
+    {
+        if( !write_frame(fd, 'J', payload) )
+        {
+            cout << "Error: server closed the connection" << endl;
+            return -2;
+        }
+        char type = 0;
+        string frame;
+        do
+        {
+            if( !read_frame(fd, type, frame) )
+            {
+                cout << "Error: server closed the connection" << endl;
+                return -2;
+            }
+            if( r==0 && type=='O' )
+                cout << frame;
+            else if( r==0 && type=='E' )
+                cout << frame << endl;
+        }
+        while( type!='X' );
+        if( !decode_exit(frame, exit) )
+        {
+            cout << "Error: invalid reply from server" << endl;
+            return -2;
+        }
+    }
+    auto elapsed = chrono::duration<double, micro>(chrono::steady_clock::now() - start).count();
+    ::close(fd);
+
+    cout << endl;
+    if( exit.status==JobStatus::BUDGET )
+        cout << "Instruction budget used up after " << exit.instructions << " instructions" << endl;
+    if( printRegisters )
+    {
+        const char* names[9] = {"RA", "RB", "RC", "RD", "RE", "RF", "SP", "PC", "SR"};
+        for(int i=0; i<9; ++i)
+            cout << names[i] << "=" << integer_as_hex(exit.registers[i]) << " ";
+        cout << "instructions=" << exit.instructions << endl;
+    }
+    if( repeat>1 )
+        cerr << repeat << " jobs, " << elapsed/repeat << " us per job" << endl;
+    return int(exit.status);
+}
@@ -0,0 +1,379 @@
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "xie.h"
+#include "parallel.h"
+
+using namespace std;
+
+// xtest: assemble and run the xlib tests in-process, on all cores, and check them against their golden files.
+//
+// A test is <test_dir>/test_*.xasm; its golden file is <test_dir>/golden/test_*.golden, lines of:
+//   // a comment
+//   bits <n>            16 or 32, the machine to assemble and run the test for. default is 16.
+//   cores <n>           cores to run the test on. default is 1.
+//   input <words>       input of KBD, a word per KBD, like xsim reads stdin.
+//   budget <n>          instructions a core can run before the test fails. default is 10000000.
+//   reg <name> <hex>    a register of core 0 after the run: RA..RF, SP, PC or SR.
+//   ram <addr> <hex>    bytes of RAM after the run, at hex address addr.
+//   output              the last line: the rest of the file is the output of DPL and DSP, and of errors.
+// --update writes the golden files from the runs: the same options and registers and RAM addresses, with the values
+// of the run. a new golden file checks RA..RF, and the 10 bytes at address 0 that xsim prints; a test of the 32-bit
+// machine needs a golden file with bits 32 first.
+// the file device is on, in a new directory of each test that is deleted after it runs: a test starts without files,
+// and tests that run at once do not share them.
+
+struct Golden
+{
+    int                             bits = 16;
+    int                             cores = 1;
+    vector<string>                  inputs;
+    uint64_t                        budget = 10000000;
+    vector<pair<string, uint32_t>>  registers;
+    vector<pair<uint32_t, string>>  ram;
+    string                          output;
+};
+
+// return false with a description in error if text is not a golden file.
+bool parse_golden(const string& text, Golden& golden, string& error)
+{
+    istringstream in(text);
+    for(string line; getline(in, line); )
+    {
+        istringstream words(line);
+        string key;
+        words >> key;
+        bool ok = true;
+        if( key.empty() || key.rfind("//", 0)==0 )
+            continue;
+        else if( key=="bits" )
+            ok = bool(words >> golden.bits) && (golden.bits==16 || golden.bits==32);
+        else if( key=="cores" )
+            ok = bool(words >> golden.cores);
+        else if( key=="budget" )
+            ok = bool(words >> golden.budget);
+        else if( key=="input" )
+        {
+            for(string word; words >> word; )
+                golden.inputs.push_back(word);
+        }
+        else if( key=="reg" )
+        {
+            string name;
+            uint32_t value = 0;
+            ok = bool(words >> name >> hex >> value);
+            golden.registers.push_back({name, value});
+        }
+        else if( key=="ram" )
+        {
+            uint32_t address = 0;
+            string bytes;
+            ok = bool(words >> hex >> address >> bytes) && bytes.size()%2==0;
+            golden.ram.push_back({address, bytes});
+        }
+        else if( key=="output" )
+        {
+            size_t pos = size_t(in.tellg());
+            golden.output = pos<text.size() ? text.substr(pos) : string();
+            return true;
+        }
+        else
+            ok = false;
+        if( !ok )
+        {
+            error = "invalid line: " + line;
+            return false;
+        }
+    }
+    error = "no output line";
+    return false;
+}
+
+string golden_text(const string& name, const Golden& golden)
+{
+    ostringstream out;
+    out << "// golden file of " << name << ".xasm, see xtest.cpp" << endl;
+    if( golden.bits!=16 )
+        out << "bits " << golden.bits << endl;
+    if( golden.cores!=1 )
+        out << "cores " << golden.cores << endl;
+    if( !golden.inputs.empty() )
+    {
+        out << "input";
+        for(const string& input : golden.inputs)
+            out << " " << input;
+        out << endl;
+    }
+    if( golden.budget!=Golden().budget )
+        out << "budget " << golden.budget << endl;
+    for(auto& [name, value] : golden.registers)
+        out << "reg " << name << " " << hex << setw(golden.bits/4) << setfill('0') << value << dec << endl;
+    for(auto& [address, bytes] : golden.ram)
+        out << "ram " << hex << setw(4) << setfill('0') << address << dec << " " << bytes << endl;
+    out << "output" << endl << golden.output;
+    return out.str();
+}
+
+string hex_bytes(const char* bytes, size_t size)
+{
+    static const char digits[] = "0123456789abcdef";
+    string text;
+    for(size_t i=0; i<size; ++i)
+    {
+        text += digits[(unsigned char)bytes[i] >> 4];
+        text += digits[(unsigned char)bytes[i] & 15];
+    }
+    return text;
+}
+
+struct TestResult
+{
+    string          name;
+    bool            passed = false;
+    string          message;        // why it failed
+    Golden          actual;         // the golden file of the run
+    double          ms = 0;
+};
+
+// a new, empty directory in the temp directory, for the files of test name; empty if none can be made.
+filesystem::path make_files_dir(const string& name)
+{
+    random_device random;
+    error_code ec;
+    filesystem::path temp = filesystem::temp_directory_path(ec);
+    for(int tries=0; !ec && tries<100; ++tries)
+    {
+        filesystem::path dir = temp / ("xtest_" + name + "_" + to_string(random()));
+        if( filesystem::create_directory(dir, ec) )
+            return dir;
+    }
+    return {};
+}
+
+// run program as golden says, with the file device in files, and put what it did in result.actual: the same options,
+// registers and RAM addresses.
+template<class Word>
+bool run_test(const string& program, const Golden& golden, const filesystem::path& files, TestResult& result)
+{
+    Golden& actual = result.actual;
+    Machine<Word> machine(golden.cores);
+    string error;
+    if( golden.cores<1 || golden.cores>MachineTraits<Word>::MAX_CORES || !machine.load(program, error) )
+    {
+        result.message = error.empty() ? "invalid number of cores" : error;
+        return false;
+    }
+    size_t nextInput = 0;
+    machine.io.input = [&]{ return nextInput<golden.inputs.size() ? golden.inputs[nextInput++] : string(); };
+    machine.io.output = [&](string_view text){ actual.output += text; };
+    machine.io.error = [&](string_view message){ actual.output += message; actual.output += '\n'; };
+    machine.io.file = make_shared<FileDevice>(files);
+    machine.run(golden.budget);
+    if( !machine.halted() )
+    {
+        result.message = "did not halt in " + to_string(golden.budget) + " instructions";
+        return false;
+    }
+
+    RegisterFile<Word>& regs = machine.registers();
+    for(auto& [name, expected] : golden.registers)
+    {
+        const char* names[9] = {"RA", "RB", "RC", "RD", "RE", "RF", "SP", "PC", "SR"};
+        Word* values[9] = {&regs.RA, &regs.RB, &regs.RC, &regs.RD, &regs.RE, &regs.RF, &regs.SP, &regs.PC, &regs.SR};
+        auto found = find(begin(names), end(names), name);
+        if( found==end(names) )
+        {
+            result.message = "unknown register " + name;
+            return false;
+        }
+        actual.registers.push_back({name, uint32_t(make_unsigned_t<Word>(*values[found - begin(names)]))});
+    }
+    for(auto& [address, expected] : golden.ram)
+    {
+        const BYTE* bytes = machine.ram().access_block(int(address), int(expected.size()/2));
+        if( !bytes )
+        {
+            result.message = "RAM range not in RAM";
+            return false;
+        }
+        actual.ram.push_back({address, hex_bytes(bytes, expected.size()/2)});
+    }
+    return true;
+}
+
+// the first difference of the run from golden; empty if none.
+string compare(const Golden& golden, const Golden& actual)
+{
+    for(size_t i=0; i<golden.registers.size(); ++i)
+    {
+        if( golden.registers[i]!=actual.registers[i] )
+            return "reg " + golden.registers[i].first + " is " + integer_as_hex(actual.registers[i].second) + ", not " + integer_as_hex(golden.registers[i].second);
+    }
+    for(size_t i=0; i<golden.ram.size(); ++i)
+    {
+        if( golden.ram[i]!=actual.ram[i] )
+            return "ram " + integer_as_hex(golden.ram[i].first) + " is " + actual.ram[i].second + ", not " + golden.ram[i].second;
+    }
+    if( golden.output!=actual.output )
+    {
+        size_t at = size_t(mismatch(golden.output.begin(), golden.output.end(), actual.output.begin(), actual.output.end()).first - golden.output.begin());
+        size_t line = size_t(count(golden.output.begin(), golden.output.begin() + at, '\n')) + 1;
+        return "output differs at line " + to_string(line) + ", byte " + to_string(at);
+    }
+    return "";
+}
+
+TestResult run_test_file(const filesystem::path& source, const filesystem::path& goldenPath, const vector<string>& includeDirs, bool update)
+{
+    auto start = chrono::steady_clock::now();
+    TestResult result;
+    result.name = source.stem().string();
+    Golden golden;
+    bool exists = false;
+    {
+        ifstream f(goldenPath, ios::binary);
+        exists = f.is_open();
+        string text{ istreambuf_iterator<char>(f), istreambuf_iterator<char>() };
+        string error;
+        if( exists && !parse_golden(text, golden, error) )
+            result.message = goldenPath.string() + ": " + error;
+    }
+    if( !exists && update )
+    {
+        // check what xsim prints
+        for(const char* name : {"RA", "RB", "RC", "RD", "RE", "RF"})
+            golden.registers.push_back({name, 0});
+        golden.ram.push_back({uint32_t(DATA_START), string(20, '0')});
+    }
+    else if( !exists )
+        result.message = "no golden file " + goldenPath.string();
+
+    Assembler assembler;
+    assembler.bits = golden.bits;
+    assembler.includeDirs = includeDirs;
+    string program;
+    if( result.message.empty() && !assembler.assemble_file(source.string(), program) )
+        result.message = "cannot assemble:\n" + assembler.errors();
+    if( result.message.empty() )
+    {
+        Golden& actual = result.actual;
+        actual.bits = golden.bits;
+        actual.cores = golden.cores;
+        actual.inputs = golden.inputs;
+        actual.budget = golden.budget;
+        filesystem::path files = make_files_dir(result.name);
+        bool ran = false;
+        if( files.empty() )
+            result.message = "cannot make a directory for the files of the test";
+        else
+        {
+            ran = golden.bits==32 ? run_test<int32_t>(program, golden, files, result) : run_test<int16_t>(program, golden, files, result);
+            error_code ec;
+            filesystem::remove_all(files, ec);
+        }
+        if( ran && update )
+        {
+            ofstream f(goldenPath, ios::binary);
+            f << golden_text(result.name, actual);
+            if( !f )
+                result.message = "cannot write " + goldenPath.string();
+        }
+        else if( ran )
+            result.message = compare(golden, actual);
+    }
+    result.passed = result.message.empty();
+    result.ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+    return result;
+}
+
+int main(int argc, const char** argv)
+{
+    vector<string> args;
+    bool update = false;
+    unsigned threads = hardware_threads();
+    for(int i=1; i<argc; ++i)
+    {
+        string arg = argv[i];
+        if( arg=="--update" )
+            update = true;
+        else if( arg.rfind("--jobs=", 0)==0 && atoi(arg.c_str()+7)>0 )
+            threads = unsigned(atoi(arg.c_str()+7));
+        else if( arg.rfind("--", 0)==0 )
+        {
+            cout << "Error: unknown option " << arg << endl;
+            return -1;
+        }
+        else
+            args.push_back(arg);
+    }
+    if( args.empty() )
+    {
+        cout << "Usage: " << argv[0] << " [options] <test_dir> [include_dirs] [test names]" << endl;
+        cout << "   runs <test_dir>/test_*.xasm, or the tests named, and checks them against <test_dir>/golden/*.golden." << endl;
+        cout << "   include_dirs: use ; to separate multiple directories, e.g: dir_1;dir_2" << endl;
+        cout << "   --jobs=<n>      run n tests at a time. default is all cores." << endl;
+        cout << "   --update        write the golden files from the runs, instead of checking them." << endl;
+        return -1;
+    }
+
+    filesystem::path testDir = args[0];
+    vector<string> includeDirs;
+    if( args.size()>1 )
+    {
+        istringstream dirs(args[1]);
+        for(string dir; getline(dirs, dir, ';'); )
+        {
+            if( !dir.empty() )
+                includeDirs.push_back(dir);
+        }
+    }
+    vector<filesystem::path> tests;
+    error_code ec;
+    for(const auto& entry : filesystem::directory_iterator(testDir, ec))
+    {
+        string name = entry.path().stem().string();
+        bool named = args.size()<=2 || find(args.begin()+2, args.end(), name)!=args.end();
+        if( entry.path().extension()==".xasm" && name.rfind("test_", 0)==0 && named )
+            tests.push_back(entry.path());
+    }
+    if( ec || tests.empty() )
+    {
+        cout << "Error: no tests in " << testDir << endl;
+        return -2;
+    }
+    sort(tests.begin(), tests.end());
+    if( update )
+        filesystem::create_directories(testDir / "golden", ec);
+
+    auto start = chrono::steady_clock::now();
+    vector<TestResult> results(tests.size());
+    parallel_for(tests.size(), threads, [&](size_t i){
+        filesystem::path golden = testDir / "golden" / (tests[i].stem().string() + ".golden");
+        results[i] = run_test_file(tests[i], golden, includeDirs, update);
+    });
+    double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+
+    int failed = 0;
+    for(const TestResult& result : results)
+    {
+        cout << (result.passed ? (update ? "UPDATED " : "PASS    ") : "FAIL    ") << left << setw(28) << result.name << right
+             << fixed << setprecision(2) << setw(9) << result.ms << " ms" << endl;
+        if( !result.passed )
+        {
+            cout << "        " << result.message << endl;
+            ++ failed;
+        }
+    }
+    cout << results.size() - failed << (update ? " updated, " : " passed, ") << failed << " failed, in " << fixed << setprecision(2) << ms << " ms on "
+         << min<size_t>(threads, results.size()) << " threads" << endl;
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,32 @@
+#!/bin/sh
+
+# xasm --cache: the second assembly of a program takes its files from the cache and writes the same binary, and an
+# entry that is cut short or overwritten is a miss, which the assembly replaces.
+# usage: test_cache.sh <xasm> <xsim> <xsim_client>, in a scratch directory.
+xasm=$1
+dir=$(cd "$(dirname "$0")" && pwd)
+fail() { echo "FAIL: $*"; exit 1; }
+
+# assemble cache.xasm, with abs.xasm of xlib, through the cache into $1; expect the hits and misses in $2.
+assemble()
+{
+    "$xasm" --cache=cache "$dir/cache.xasm" "$1" "$dir/../xlib" > "$1.txt" || fail "cannot assemble cache.xasm: $(cat "$1.txt")"
+    grep -q "^Assembly cache: $2: \"cache\"$" "$1.txt" || fail "the cache of $1 is not $2: $(cat "$1.txt")"
+}
+
+rm -rf cache
+assemble cold.bin "0 hit(s), 2 miss(es)"
+[ $(ls cache | wc -l) -eq 2 ] || fail "the cache does not have 2 entries: $(ls cache)"
+assemble warm.bin "2 hit(s), 0 miss(es)"
+cmp -s cold.bin warm.bin || fail "the binary from the cache is not the binary without it"
+
+# cut one entry short, and overwrite the other with bytes of the same size
+first=$(ls cache | head -n 1)
+second=$(ls cache | tail -n 1)
+head -c 40 "cache/$first" > cut && mv cut "cache/$first"
+tr '\000-\377' 'x' < "cache/$second" > overwritten && mv overwritten "cache/$second"
+assemble corrupt.bin "0 hit(s), 2 miss(es)"
+cmp -s cold.bin corrupt.bin || fail "the binary with corrupt entries is not the binary without them"
+assemble again.bin "2 hit(s), 0 miss(es)"
+cmp -s cold.bin again.bin || fail "the binary from the rewritten entries is not the binary without them"
+echo "cache: ok"
@@ -0,0 +1,20 @@
+#!/bin/sh
+
+# xsim --coverage counts the runs of each line and the directions of each conditional jump of coverage.xasm, and
+# writes them as an lcov tracefile.
+# usage: test_coverage.sh <xasm> <xsim> <xsim_client>, in a scratch directory.
+xasm=$1 xsim=$2
+dir=$(cd "$(dirname "$0")" && pwd)
+fail() { echo "FAIL: $*"; exit 1; }
+
+"$xasm" --lines=coverage.lines "$dir/coverage.xasm" coverage.bin > /dev/null || fail "cannot assemble coverage.xasm"
+"$xsim" --coverage=coverage.info --lines=coverage.lines coverage.bin TRUE > run.txt || fail "cannot run coverage.bin: $(cat run.txt)"
+
+# blocks: MOV, the loop, the jump to never, HLT and never, which is not run
+grep -q "^Coverage: blocks 4/5, lines 7/9, branch directions 3/4$" run.txt || fail "the summary is: $(cat run.txt)"
+grep -q "^SF:.*/coverage.xasm$" coverage.info || fail "the tracefile has no coverage.xasm: $(cat coverage.info)"
+expected="DA:2,1 DA:4,5 DA:5,5 DA:6,5 DA:7,1 DA:8,1 DA:9,1 DA:11,0 DA:12,0
+BRDA:6,0,0,4 BRDA:6,0,1,1 BRDA:8,1,0,0 BRDA:8,1,1,1 BRF:4 BRH:3 LF:9 LH:7"
+counts=$(grep -E "^(DA|BRDA|BRF|BRH|LF|LH):" coverage.info | tr '\n' ' ')
+[ "$counts" = "$(echo $expected) " ] || fail "the counts are: $counts, not: $(echo $expected)"
+echo "coverage: ok"
@@ -0,0 +1,47 @@
+#!/bin/sh
+
+# xsim --heatmap counts the bytes heatmap.xasm fetches, stores and moves on the stack, per line of RAM and per region,
+# and draws them as a PPM image.
+# usage: test_heatmap.sh <xasm> <xsim> <xsim_client>, in a scratch directory.
+xasm=$1 xsim=$2
+dir=$(cd "$(dirname "$0")" && pwd)
+fail() { echo "FAIL: $*"; exit 1; }
+
+"$xasm" "$dir/heatmap.xasm" heatmap.bin > /dev/null || fail "cannot assemble heatmap.xasm"
+
+# 47 instructions of 4 bytes: 18 on the line of 0x1000, 25 of 0x1010, 4 of 0x1020; 8 STW of 2 bytes at 0x0100; PSH and
+# CLL write 2 bytes below the stack bottom of 0x2000, POP and RET read them.
+"$xsim" --heatmap=lines16 heatmap.bin TRUE > report.txt || fail "cannot run heatmap.bin: $(cat report.txt)"
+expected="Memory traffic in bytes, over 47 instructions:
+  region      start            fetch        read       write  stack_read stack_write
+  data        0000                 0           0          16           0           0
+  code+stack  1000               188           0           0           4           4
+  free        2000                 0           0           0           0           0
+  display     3000                 0           0           0           0           0
+  input       4000                 0           0           0           0           0
+Peak stack depth: 2 bytes, down to 1ffe"
+report=$(sed -n "/^Memory traffic/,\$p" report.txt)
+[ "$report" = "$expected" ] || fail "the report is:
+$report"
+expected="address,fetch,read,write,stack_read,stack_write
+0100,0,0,16,0,0
+1000,72,0,0,0,0
+1010,100,0,0,0,0
+1020,16,0,0,0,0
+1ff0,0,0,0,4,4"
+[ "$(cat lines16.csv)" = "$expected" ] || fail "lines16.csv is:
+$(cat lines16.csv)"
+
+# 512 lines up to the stack: 8 rows of 64 lines, of 8 by 8 pixels
+[ "$(head -n 3 lines16.ppm | tr '\n' ' ')" = "P6 512 64 255 " ] || fail "the header of lines16.ppm is: $(head -n 3 lines16.ppm)"
+[ $(wc -c < lines16.ppm) -eq $((14 + 512*64*3)) ] || fail "lines16.ppm has $(wc -c < lines16.ppm) bytes"
+
+"$xsim" --heatmap=lines32 --heatmap-line=32 heatmap.bin TRUE > /dev/null || fail "cannot run heatmap.bin with lines of 32 bytes"
+expected="address,fetch,read,write,stack_read,stack_write
+0100,0,0,16,0,0
+1000,172,0,0,0,0
+1020,16,0,0,0,0
+1fe0,0,0,0,4,4"
+[ "$(cat lines32.csv)" = "$expected" ] || fail "lines32.csv is:
+$(cat lines32.csv)"
+echo "heatmap: ok"
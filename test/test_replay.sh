@@ -0,0 +1,26 @@
+#!/bin/sh
+
+# xsim --record logs the KBD input and checks of the output of a run, and --replay runs the program on the logged
+# input without stdin and matches it; a log whose input was edited makes the replay diverge, with exit code -4.
+# usage: test_replay.sh <xasm> <xsim> <xsim_client>, in a scratch directory.
+xasm=$1 xsim=$2
+dir=$(cd "$(dirname "$0")" && pwd)
+fail() { echo "FAIL: $*"; exit 1; }
+
+"$xasm" "$dir/replay.xasm" replay.bin > /dev/null || fail "cannot assemble replay.xasm"
+
+echo "hello world" | "$xsim" --record=run.log replay.bin TRUE > recorded.txt || fail "record exited with $?"
+grep -q "^helloworld$" recorded.txt || fail "the recorded run wrote: $(cat recorded.txt)"
+
+"$xsim" --replay=run.log replay.bin TRUE < /dev/null > replayed.txt || fail "replay exited with $?: $(cat replayed.txt)"
+grep -q "^helloworld$" replayed.txt || fail "the replay wrote: $(cat replayed.txt)"
+grep -q "^Replay matched: 2 inputs, 2 outputs, 8 instructions$" replayed.txt || fail "the replay reported: $(cat replayed.txt)"
+
+# the logged input is stored as is: make it another word of the same size
+sed 's/hello/jello/' run.log > edited.log
+cmp -s run.log edited.log && fail "the log does not hold the input hello"
+"$xsim" --replay=edited.log replay.bin TRUE < /dev/null > diverged.txt
+status=$?
+[ $status -eq 252 ] || fail "the replay of an edited log exited with $status, not -4: $(cat diverged.txt)"
+grep -q "^Replay diverged: " diverged.txt || fail "the replay of an edited log reported: $(cat diverged.txt)"
+echo "replay: ok"
@@ -0,0 +1,43 @@
+#!/bin/sh
+
+# the debugger of xsim goes back to the exact registers and RAM of a position: reverse-step to a position run before,
+# and reverse-continue and last-change to the state that running forward to the same position gives; last-change stops
+# at the instruction that wrote the address.
+# usage: test_reverse.sh <xasm> <xsim> <xsim_client>, in a scratch directory.
+xasm=$1 xsim=$2
+dir=$(cd "$(dirname "$0")" && pwd)
+fail() { echo "FAIL: $*"; exit 1; }
+
+"$xasm" --map=reverse.map "$dir/reverse.xasm" reverse.bin > /dev/null || fail "cannot assemble reverse.xasm"
+loop=$(awk '$2=="loop" { print $1 }' reverse.map)
+store=$(awk '$2=="store" { print $1 }' reverse.map)
+
+# run the debugger on commands, with a short checkpoint interval, so that going back restores a checkpoint and runs
+# forward from it.
+debug()
+{
+    printf '%s\n' "$@" > commands.txt
+    "$xsim" --debug=commands.txt --checkpoint-interval=7 reverse.bin TRUE
+}
+
+# the state after a command: the position and registers, the next instruction, and the stored count.
+debug 'step 20' 'mem 0x100 2' 'step 50' 'reverse-step 50' 'mem 0x100 2' > back.txt
+forward=$(sed -n 3,5p back.txt)
+back=$(sed -n 8,10p back.txt)
+case $forward in "#20 "*) ;; *) fail "step 20 is at: $forward" ;; esac
+[ "$forward" = "$back" ] || fail "reverse-step 50 from #70 is not the state of #20: $back, not $forward"
+
+# reverse-continue to the last run of loop: INC RA before the 50th count; last-change of the count from there: its STW
+# of 49.
+debug 'continue' "reverse-continue 0x$loop" 'mem 0x100 2' 'last-change 0x100 2' 'mem 0x100 2' > last.txt
+atLoop=$(sed -n 4,6p last.txt)
+atStore=$(sed -n 7,9p last.txt)
+case $atLoop in "#"*"RA=0031 "*"PC=$loop "*) ;; *) fail "reverse-continue 0x$loop is at: $atLoop" ;; esac
+case $atStore in "#"*"RA=0031 "*"PC=$store "*"0100: 30 00") ;; *) fail "last-change 0x100 is at: $atStore" ;; esac
+for state in "$atLoop" "$atStore"
+do
+    position=$(echo "$state" | sed -n '1s/^#\([0-9]*\) .*/\1/p')
+    expected=$(debug "step $position" 'mem 0x100 2' | sed -n 3,5p)
+    [ "$state" = "$expected" ] || fail "going back to #$position is not the state of running to it: $state, not $expected"
+done
+echo "reverse: ok"
@@ -0,0 +1,39 @@
+#!/bin/sh
+
+# xsim --serve runs the jobs of xsim_client: a job returns the output and registers of its run, as xsim would run it,
+# a job whose instruction budget runs out stops there with status 1, and --quit stops a server run with --allow-quit.
+# usage: test_serve.sh <xasm> <xsim> <xsim_client>, in a scratch directory.
+xasm=$1 xsim=$2 client=$3
+dir=$(cd "$(dirname "$0")" && pwd)
+fail() { echo "FAIL: $*"; exit 1; }
+
+"$xasm" "$dir/serve.xasm" serve.bin > /dev/null || fail "cannot assemble serve.xasm"
+
+# the path of a Unix socket is short
+socket=${TMPDIR:-/tmp}/xsim_test_serve_$$.sock
+"$xsim" --serve="$socket" --threads=2 --allow-quit > server.txt &
+server=$!
+trap 'kill $server 2> /dev/null; rm -f "$socket"' EXIT
+tries=0
+while [ ! -S "$socket" ]
+do
+    tries=$((tries+1))
+    [ $tries -le 100 ] || fail "the server does not listen: $(cat server.txt)"
+    sleep 0.1
+done
+
+echo hello | "$client" "$socket" serve.bin --registers > job.txt || fail "the job exited with $?: $(cat job.txt)"
+grep -q "^hello$" job.txt || fail "the job wrote: $(cat job.txt)"
+grep -q "^RA=00000005 RB=000003e8 .*instructions=3005$" job.txt || fail "the job stopped at: $(cat job.txt)"
+
+echo hello | "$client" "$socket" serve.bin --budget=100 --registers > budget.txt
+status=$?
+[ $status -eq 1 ] || fail "the job with a budget exited with $status, not 1: $(cat budget.txt)"
+grep -q "^Instruction budget used up after 100 instructions$" budget.txt || fail "the job with a budget reported: $(cat budget.txt)"
+grep -q "^RA=00000005 .*instructions=100$" budget.txt || fail "the job with a budget stopped at: $(cat budget.txt)"
+
+"$client" "$socket" --quit || fail "quit exited with $?"
+wait $server
+status=$?
+[ $status -eq 0 ] || fail "the server exited with $status: $(cat server.txt)"
+echo "serve: ok"
@@ -0,0 +1,51 @@
+#!/bin/sh
+
+# xsim --stats and --stats-json count the instructions, opcodes, jumps, calls, RAM bytes and I/O bytes of stats.xasm,
+# on the 16-bit and the 32-bit machine.
+# usage: test_stats.sh <xasm> <xsim> <xsim_client>, in a scratch directory.
+xasm=$1 xsim=$2
+dir=$(cd "$(dirname "$0")" && pwd)
+fail() { echo "FAIL: $*"; exit 1; }
+
+# run stats.xasm for bits ($1) on the input hi; expect its stats, without the host time, to be the rest of the
+# arguments.
+expect()
+{
+    bits=$1
+    shift
+    "$xasm" --bits=$bits "$dir/stats.xasm" stats$bits.bin > /dev/null || fail "cannot assemble stats.xasm for $bits bits"
+    echo hi | "$xsim" --stats-json=stats$bits.json stats$bits.bin TRUE > stats$bits.txt || fail "cannot run stats$bits.bin: $(cat stats$bits.txt)"
+    grep -q "^Instructions: 26 in .* ms, .* MIPS$" stats$bits.txt || fail "the report of stats$bits.bin is: $(cat stats$bits.txt)"
+    json=$(grep -v -e '"host_seconds":' -e '"mips":' stats$bits.json)
+    [ "$json" = "$(printf '%s\n' "$@")" ] || fail "stats$bits.json is:
+$json"
+}
+
+# KBD, DPL and MOV; 3 runs of the loop of 7 instructions, with 2 calls; STW and HLT. the bytes read are the returns and
+# the output of DPL; the bytes written are the calls, STW and the input of KBD, with the counts of the strings.
+expect 16 \
+    '{' \
+    '  "instructions": 26,' \
+    '  "opcodes": {"CLL": 6, "RET": 6, "INC": 3, "CMP": 3, "JPL": 3, "MOV": 1, "STW": 1, "HLT": 1, "KBD": 1, "DPL": 1},' \
+    '  "branches": {"taken": 2, "not_taken": 1},' \
+    '  "calls": 6,' \
+    '  "returns": 6,' \
+    '  "max_call_depth": 2,' \
+    '  "ram_bytes": {"fetched": 104, "read": 16, "written": 18},' \
+    '  "io_bytes": {"kbd": 2, "dpl": 2, "dsp": 0}' \
+    '}'
+grep -q "^RAM bytes: 104 fetched, 16 read, 18 written$" stats16.txt || fail "the report of stats16.bin is: $(cat stats16.txt)"
+
+# the same run, with 8-byte instructions for a wide operand, and 4-byte words
+expect 32 \
+    '{' \
+    '  "instructions": 26,' \
+    '  "opcodes": {"CLL": 6, "RET": 6, "INC": 3, "CMP": 3, "JPL": 3, "MOV": 1, "STW": 1, "HLT": 1, "KBD": 1, "DPL": 1},' \
+    '  "branches": {"taken": 2, "not_taken": 1},' \
+    '  "calls": 6,' \
+    '  "returns": 6,' \
+    '  "max_call_depth": 2,' \
+    '  "ram_bytes": {"fetched": 164, "read": 28, "written": 32},' \
+    '  "io_bytes": {"kbd": 2, "dpl": 2, "dsp": 0}' \
+    '}'
+echo "stats: ok"
@@ -0,0 +1,45 @@
+#!/bin/sh
+
+# xsim --timing times timing.xasm to the cycle, with the default model and with options.
+# usage: test_timing.sh <xasm> <xsim> <xsim_client>, in a scratch directory.
+xasm=$1 xsim=$2
+dir=$(cd "$(dirname "$0")" && pwd)
+fail() { echo "FAIL: $*"; exit 1; }
+
+"$xasm" --map=timing.map "$dir/timing.xasm" timing.bin > /dev/null || fail "cannot assemble timing.xasm"
+
+# expect the lines of the report, from its Cycles line on, to be the rest of the arguments.
+expect()
+{
+    report=$(sed -n '/^Cycles:/,$p' "$1")
+    shift
+    [ "$report" = "$(printf '%s\n' "$@")" ] || fail "the report is:
+$report"
+}
+
+# by default: MOV misses the i-cache line of 0x1000 (1+20 cycles); LDW waits 2 cycles for the MUL result of RB, and
+# misses the d-cache line of 0x0100 (1+2+20); ADD waits 1 cycle for the load; CLL misses the i-cache line of 0x1010
+# and the d-cache line of the stack (1+20+20); the call and the return are predicted.
+"$xsim" --timing --map=timing.map timing.bin TRUE > default.txt || fail "cannot time timing.bin: $(cat default.txt)"
+expect default.txt \
+    "Cycles: 90, instructions: 7, CPI: 12.86" \
+    "Stall cycles: 83 = load-use 1 + mul/div 2 + branch 0 + icache 40 + dcache 40" \
+    "Branches: 2, mispredicted 0 (0.0%)" \
+    "I-cache: 5 hits, 2 misses, hit rate 71.4%" \
+    "D-cache: 1 hits, 2 misses, hit rate 33.3%" \
+    "Routine                 Instructions      Cycles    CPI  Load-use   Mul/div    Branch    I-miss    D-miss" \
+    "(program)                          6          89  14.83         1         2         0         2         2" \
+    "f                                  1           1   1.00         0         0         0         0         0"
+
+# with a slower MUL and misses for free: LDW waits 9 cycles for RB
+"$xsim" --timing=mul=10,miss=0 --map=timing.map timing.bin TRUE > options.txt || fail "cannot time timing.bin: $(cat options.txt)"
+expect options.txt \
+    "Cycles: 17, instructions: 7, CPI: 2.43" \
+    "Stall cycles: 10 = load-use 1 + mul/div 9 + branch 0 + icache 0 + dcache 0" \
+    "Branches: 2, mispredicted 0 (0.0%)" \
+    "I-cache: 5 hits, 2 misses, hit rate 71.4%" \
+    "D-cache: 1 hits, 2 misses, hit rate 33.3%" \
+    "Routine                 Instructions      Cycles    CPI  Load-use   Mul/div    Branch    I-miss    D-miss" \
+    "(program)                          6          16   2.67         1         9         0         2         2" \
+    "f                                  1           1   1.00         0         0         0         0         0"
+echo "timing: ok"
@@ -1,5 +1,6 @@
 #!/bin/sh
 
-src/Debug/xasm ../xie_computer/xlib_test/test_$1.xasm 1.bin   ../xie_computer/xlib
-read -p "Press enter to continue============================================"
-src/Debug/xsim  1.bin
\ No newline at end of file
+# run the xlib tests against their golden files, or the tests named, e.g. test_xlib.sh test_find_max
+# run it from the build directory, or give the xtest to run in XTEST.
+dir=$(cd "$(dirname "$0")" && pwd)
+"${XTEST:-src/xtest}" "$dir" "$dir/../xlib" "$@"